@@ -0,0 +1,398 @@
+#define FUSE_USE_VERSION 30
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "wfs.h"
+#include "libwfs.h"
+#include "stats.h"
+
+// Calls to the filesystem timed by a workload
+struct run {
+    long count;
+    long cap;
+    long long *nanos;
+};
+
+struct workload {
+    const char *name;
+    const char *desc;
+    int (*fn)(struct run *r, long n);
+};
+
+static struct fuse_operations *ops = &wfs_ops;
+static unsigned int seed = 42;
+static char data[BLOCK_SIZE * 64];
+
+// Largest file, and the chunk sequential workloads move per call
+#define FILE_MAX ((IND_BLOCK + BLOCK_SIZE / sizeof(off_t)) * BLOCK_SIZE)
+#define CHUNK    4096
+#define SEQ_SIZE (FILE_MAX / CHUNK * CHUNK)
+#define DEPTH    16
+#define MIRROR_FILES 8
+
+// Note a call that started at start and returned rc. Returns rc.
+static int record(struct run *r, long long start, int rc) {
+    long long ns = stats_clock() - start;
+    if (r->count == r->cap) {
+        long cap = r->cap ? r->cap * 2 : 1024;
+        long long *grown = realloc(r->nanos, cap * sizeof(long long));
+        if (!grown) {
+            return -ENOMEM;
+        }
+        r->nanos = grown;
+        r->cap = cap;
+    }
+    r->nanos[r->count++] = ns;
+    return rc;
+}
+
+static int fail(const char *what, const char *path, int rc) {
+    fprintf(stderr, "bench: %s %s: %s\n", what, path, strerror(-rc));
+    return rc;
+}
+
+static int fillNothing(void *buf, const char *name, const struct stat *st, off_t off) {
+    (*(long *) buf)++;
+    return 0;
+}
+
+static int removeAll(const char *fmt, int count) {
+    char path[64];
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), fmt, i);
+        int rc = ops->unlink(path);
+        if (rc < 0) {
+            return fail("unlink", path, rc);
+        }
+    }
+    return 0;
+}
+
+// Write a file of size bytes in CHUNK calls, untimed
+static int writeFile(const char *path, size_t size) {
+    int rc = ops->mknod(path, S_IFREG | 0644, 0);
+    for (size_t off = 0; rc == 0 && off < size; off += CHUNK) {
+        size_t len = size - off < CHUNK ? size - off : CHUNK;
+        rc = ops->write(path, data + off % (sizeof(data) - CHUNK), len, off, NULL);
+        rc = rc < 0 ? rc : 0;
+    }
+    if (rc == 0) {
+        rc = ops->release(path, NULL);
+    }
+    return rc < 0 ? fail("write", path, rc) : 0;
+}
+
+// Files created in the root until there are no inodes or directory entries left,
+// then removed (untimed) and created again
+static int benchCreate(struct run *r, long n) {
+    char path[64];
+    int made = 0;
+    for (long i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "/c%d", made);
+        long long start = stats_clock();
+        int rc = record(r, start, ops->mknod(path, S_IFREG | 0644, 0));
+        if (rc == -ENOSPC && made > 0) {
+            r->count--;
+            if ((rc = removeAll("/c%d", made)) < 0) {
+                return rc;
+            }
+            made = 0;
+            i--;
+            continue;
+        }
+        if (rc < 0) {
+            return fail("mknod", path, rc);
+        }
+        made++;
+    }
+    return removeAll("/c%d", made);
+}
+
+// getattr at the bottom of a chain of DEPTH directories
+static int benchStat(struct run *r, long n) {
+    char path[DEPTH * 2 + 1] = "";
+    for (int d = 0; d < DEPTH; d++) {
+        strcat(path, "/d");
+        int rc = ops->mkdir(path, 0755);
+        if (rc < 0) {
+            return fail("mkdir", path, rc);
+        }
+    }
+    for (long i = 0; i < n; i++) {
+        struct stat st;
+        long long start = stats_clock();
+        int rc = record(r, start, ops->getattr(path, &st));
+        if (rc < 0) {
+            return fail("getattr", path, rc);
+        }
+    }
+    for (int d = DEPTH; d > 0; d--) {
+        path[d * 2] = '\0';
+        int rc = ops->rmdir(path);
+        if (rc < 0) {
+            return fail("rmdir", path, rc);
+        }
+    }
+    return 0;
+}
+
+// 100-byte appends to one file, closed and truncated (untimed) when it is full
+static int benchAppend(struct run *r, long n) {
+    const char *path = "/append";
+    int rc = ops->mknod(path, S_IFREG | 0644, 0);
+    if (rc < 0) {
+        return fail("mknod", path, rc);
+    }
+    off_t size = 0;
+    for (long i = 0; i < n; i++) {
+        if (size + 100 > FILE_MAX) {
+            ops->release(path, NULL);
+            ops->truncate(path, 0);
+            size = 0;
+        }
+        long long start = stats_clock();
+        rc = record(r, start, ops->write(path, data + size % BLOCK_SIZE, 100, size, NULL));
+        if (rc < 0) {
+            return fail("write", path, rc);
+        }
+        size += 100;
+    }
+    ops->release(path, NULL);
+    return ops->unlink(path);
+}
+
+// Whole files written CHUNK at a time and closed; the close is timed too, as that
+// is where buffered writes get their blocks
+static int benchSeqWrite(struct run *r, long n) {
+    const char *path = "/seq";
+    int rc = ops->mknod(path, S_IFREG | 0644, 0);
+    if (rc < 0) {
+        return fail("mknod", path, rc);
+    }
+    off_t off = 0;
+    for (long i = 0; i < n; i++) {
+        if (off == SEQ_SIZE) {
+            long long start = stats_clock();
+            rc = record(r, start, ops->release(path, NULL));
+            ops->truncate(path, 0);
+            off = 0;
+        } else {
+            long long start = stats_clock();
+            rc = record(r, start, ops->write(path, data + off % (sizeof(data) - CHUNK), CHUNK, off, NULL));
+            off += CHUNK;
+        }
+        if (rc < 0) {
+            return fail("write", path, rc);
+        }
+    }
+    ops->release(path, NULL);
+    return ops->unlink(path);
+}
+
+// One file read CHUNK at a time from start to end, over and over
+static int benchSeqRead(struct run *r, long n) {
+    const char *path = "/seq";
+    int rc = writeFile(path, SEQ_SIZE);
+    if (rc < 0) {
+        return rc;
+    }
+    static char buf[CHUNK];
+    for (long i = 0; i < n; i++) {
+        off_t off = (i % (SEQ_SIZE / CHUNK)) * CHUNK;
+        long long start = stats_clock();
+        rc = record(r, start, ops->read(path, buf, CHUNK, off, NULL));
+        if (rc != CHUNK) {
+            return fail("read", path, rc < 0 ? rc : -EIO);
+        }
+    }
+    return ops->unlink(path);
+}
+
+// readdir of a directory holding as many entries as it can
+static int benchReaddir(struct run *r, long n) {
+    char path[64];
+    int rc = ops->mkdir("/big", 0755);
+    if (rc < 0) {
+        return fail("mkdir", "/big", rc);
+    }
+    int made = 0;
+    for (;;) {
+        snprintf(path, sizeof(path), "/big/entry-%d", made);
+        if ((rc = ops->mknod(path, S_IFREG | 0644, 0)) < 0) {
+            break;
+        }
+        made++;
+    }
+    if (rc != -ENOSPC) {
+        return fail("mknod", path, rc);
+    }
+    for (long i = 0; i < n; i++) {
+        long entries = 0;
+        long long start = stats_clock();
+        rc = record(r, start, ops->readdir("/big", &entries, fillNothing, 0, NULL));
+        if (rc < 0 || entries != made + 2) {
+            return fail("readdir", "/big", rc < 0 ? rc : -EIO);
+        }
+    }
+    if ((rc = removeAll("/big/entry-%d", made)) < 0) {
+        return rc;
+    }
+    return ops->rmdir("/big");
+}
+
+// Random CHUNK reads over several files. On mirrored images the per-disk read
+// counters show how the reads were spread over the copies.
+static int benchMirror(struct run *r, long n) {
+    char path[64];
+    for (int f = 0; f < MIRROR_FILES; f++) {
+        snprintf(path, sizeof(path), "/m%d", f);
+        int rc = writeFile(path, SEQ_SIZE);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    static char buf[CHUNK];
+    for (long i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "/m%d", rand_r(&seed) % MIRROR_FILES);
+        off_t off = (rand_r(&seed) % (SEQ_SIZE / CHUNK)) * CHUNK;
+        long long start = stats_clock();
+        int rc = record(r, start, ops->read(path, buf, CHUNK, off, NULL));
+        if (rc != CHUNK) {
+            return fail("read", path, rc < 0 ? rc : -EIO);
+        }
+    }
+    return removeAll("/m%d", MIRROR_FILES);
+}
+
+static struct workload workloads[] = {
+    { "create",   "create files in one directory", benchCreate },
+    { "stat",     "getattr 16 directories deep", benchStat },
+    { "append",   "100-byte appends", benchAppend },
+    { "seqwrite", "4 KiB sequential writes and closes", benchSeqWrite },
+    { "seqread",  "4 KiB sequential reads", benchSeqRead },
+    { "readdir",  "readdir of a full directory", benchReaddir },
+    { "mirror",   "4 KiB random reads over the copies", benchMirror },
+};
+#define WORKLOADS ((int) (sizeof(workloads) / sizeof(workloads[0])))
+
+static int compareNanos(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(struct run *r, int p) {
+    if (!r->count) {
+        return 0;
+    }
+    long i = (r->count * p + 99) / 100 - 1;
+    return r->nanos[i < 0 ? 0 : i] / 1000.0;
+}
+
+static int runWorkload(struct workload *w, long n) {
+    struct run r = { 0 };
+    struct thread_stats before, after;
+    stats_sum(&before);
+    long long start = stats_clock();
+    int rc = w->fn(&r, n);
+    double secs = (stats_clock() - start) / 1e9;
+    stats_sum(&after);
+    if (rc < 0) {
+        free(r.nanos);
+        return rc;
+    }
+
+    long long replicated = 0;
+    for (int d = 0; d < STATS_DISKS; d++) {
+        replicated += after.disks[d].replicated - before.disks[d].replicated;
+    }
+    qsort(r.nanos, r.count, sizeof(long long), compareNanos);
+    printf("%-9s %8ld ops %10.0f ops/s  p50 %8.1f us  p99 %8.1f us  %10lld bytes replicated",
+           w->name, r.count, secs > 0 ? r.count / secs : 0.0, percentile(&r, 50), percentile(&r, 99),
+           replicated);
+    if (w->fn == benchMirror) {
+        printf("  read per disk:");
+        for (int d = 0; d < STATS_DISKS; d++) {
+            long long read = after.disks[d].read - before.disks[d].read;
+            if (read) {
+                printf(" %d:%lld", d, read);
+            }
+        }
+    }
+    printf("\n");
+    free(r.nanos);
+    return 0;
+}
+
+static void usage(char *name) {
+    printf("Usage: %s [-n ops] [-w workload]... disk1 [disk2 ... diskN] [wfs options]\n", name);
+    printf("Runs workloads against freshly made images through the wfs operations, without\n");
+    printf("mounting, and prints ops/s, latency percentiles and bytes replicated for each.\n");
+    printf("\t-n ops         calls timed per workload (default 10000)\n");
+    printf("\t-w workload    run only these (default all):\n");
+    for (int i = 0; i < WORKLOADS; i++) {
+        printf("\t               %-9s %s\n", workloads[i].name, workloads[i].desc);
+    }
+    printf("wfs options as for wfs, e.g. -o backend=pwrite; see wfs -h\n");
+}
+
+int main(int argc, char **argv) {
+    long n = 10000;
+    int selected[WORKLOADS] = { 0 };
+    int any = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "+n:w:h")) != -1) {
+        if (opt == 'n') {
+            n = atol(optarg);
+        } else if (opt == 'w') {
+            int i = 0;
+            while (i < WORKLOADS && strcmp(workloads[i].name, optarg) != 0) {
+                i++;
+            }
+            if (i == WORKLOADS) {
+                fprintf(stderr, "bench: no workload %s\n", optarg);
+                return 1;
+            }
+            selected[i] = any = 1;
+        } else {
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || n <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // wfs_mount wants the images right after the program name
+    char *mountArgv[argc - optind + 2];
+    int mountArgc = 0;
+    mountArgv[mountArgc++] = argv[0];
+    for (int i = optind; i < argc; i++) {
+        mountArgv[mountArgc++] = argv[i];
+    }
+    mountArgv[mountArgc] = NULL;
+
+    struct fuse_args args;
+    int rc = wfs_mount(mountArgc, mountArgv, &args);
+    if (rc != 0) {
+        return rc;
+    }
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = rand_r(&seed);
+    }
+
+    ops->init(NULL);
+    for (int i = 0; i < WORKLOADS && rc == 0; i++) {
+        if (!any || selected[i]) {
+            rc = runWorkload(&workloads[i], n);
+        }
+    }
+    ops->destroy(NULL);
+
+    fuse_opt_free_args(&args);
+    wfs_unmount();
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,577 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "disk.h"
+
+// Most disks a view set can hold (wfs takes them from the command line)
+#define MAX_VIEWS    64
+// Writes per io_uring submission
+#define RING_ENTRIES 64
+// Fewest pages a resident budget allows
+#define MIN_RESIDENT 64
+
+// Page states under pwrite and io_uring, one byte per page
+#define PAGE_NONE  (0)  // not read yet, or dropped: PROT_NONE
+#define PAGE_CLEAN (1)  // same as the image: PROT_READ
+#define PAGE_DIRTY (2)  // written since the last write-back: PROT_READ | PROT_WRITE
+#define PAGE_FRESH (3)  // clean, and loaded since the clock hand last passed it
+
+struct view {
+    char *base;
+    size_t size;            // page-rounded length of the mapping
+    size_t length;          // bytes of the image behind it
+    int fd, directFd;       // directFd is -1 without O_DIRECT
+    unsigned char *pages;   // NULL under mmap and for missing disks
+};
+
+struct ring {
+    int fd;
+    void *sqMap, *cqMap;
+    size_t sqMapSize, cqMapSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+};
+
+// A queued write, waiting for the ring to fill up or the write-back to end
+struct pending {
+    int fd;
+    char *buf;
+    size_t len;
+    off_t off;
+};
+
+struct disk_stats diskStats;
+
+static struct view views[MAX_VIEWS];
+static int viewCount = 0;
+static size_t pageSize;
+static struct sigaction oldAction;
+static int handlerInstalled = 0;
+
+// Pages loaded over all views, and the most that may be before clean ones are dropped
+static size_t loaded = 0, budget = 0;
+static int handView = 0;
+static size_t handPage = 0;
+static int nothingClean = 0;    // the last sweep found only dirty pages
+
+static struct ring ring = { .fd = -1 };
+static struct pending queue[RING_ENTRIES];
+static int queued = 0;
+
+static const char *backendNames[] = { "mmap", "pwrite", "io_uring" };
+
+int disk_backend(const char *name) {
+    for (int b = DISK_MMAP; b <= DISK_URING; b++) {
+        if (strcmp(name, backendNames[b]) == 0) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+const char *disk_backend_name(int backend) {
+    return backend >= DISK_MMAP && backend <= DISK_URING ? backendNames[backend] : "?";
+}
+
+static int writeAll(int fd, const char *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// Drop the first clean page the clock hand comes to, giving pages loaded since it
+// last passed them a second chance. Dirty pages stay until they are written back.
+static void dropPage() {
+    size_t steps = 0;
+    for (int d = 0; d < viewCount; d++) {
+        steps += views[d].pages ? 2 * (views[d].size / pageSize) : 0;
+    }
+    while (steps > 0) {
+        struct view *v = &views[handView];
+        if (!v->pages || handPage >= v->size / pageSize) {
+            handView = (handView + 1) % viewCount;
+            handPage = 0;
+            continue;
+        }
+        steps--;
+        size_t page = handPage++;
+        if (v->pages[page] == PAGE_FRESH) {
+            v->pages[page] = PAGE_CLEAN;
+        } else if (v->pages[page] == PAGE_CLEAN) {
+            // Unreadable first, so nothing sees it empty
+            char *p = v->base + page * pageSize;
+            mprotect(p, pageSize, PROT_NONE);
+            madvise(p, pageSize, MADV_DONTNEED);
+            v->pages[page] = PAGE_NONE;
+            loaded--;
+            diskStats.pagesDropped++;
+            return;
+        }
+    }
+    nothingClean = 1;
+}
+
+// Bring a page in from the image, making room under the budget first. Reads past the
+// end of the image leave zeros.
+static void loadPage(struct view *v, size_t page) {
+    while (budget && loaded >= budget && !nothingClean) {
+        dropPage();
+    }
+    char *p = v->base + page * pageSize;
+    size_t done = 0;
+    mprotect(p, pageSize, PROT_READ | PROT_WRITE);
+    while (page * pageSize + done < v->length && done < pageSize) {
+        ssize_t n = pread(v->fd, p + done, pageSize - done, page * pageSize + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    mprotect(p, pageSize, PROT_READ);
+    v->pages[page] = PAGE_FRESH;
+    loaded++;
+    diskStats.pagesRead++;
+}
+
+// Only pread, mprotect, madvise and plain stores happen here, all safe in a signal
+// handler. A write to a page that was never read faults twice: once to load, once to
+// dirty. Dropping a clean page another access still needs is safe the same way: the
+// access faults and loads it again.
+static void onFault(int sig, siginfo_t *info, void *context) {
+    char *addr = info->si_addr;
+    for (int d = 0; d < viewCount; d++) {
+        struct view *v = &views[d];
+        if (!v->pages || addr < v->base || addr >= v->base + v->size) {
+            continue;
+        }
+        size_t page = (addr - v->base) / pageSize;
+        if (v->pages[page] == PAGE_NONE) {
+            loadPage(v, page);
+            return;
+        }
+        if (v->pages[page] == PAGE_CLEAN || v->pages[page] == PAGE_FRESH) {
+            mprotect(v->base + page * pageSize, pageSize, PROT_READ | PROT_WRITE);
+            v->pages[page] = PAGE_DIRTY;
+            return;
+        }
+        break;
+    }
+
+    // Not ours: a real fault
+    if (oldAction.sa_flags & SA_SIGINFO) {
+        oldAction.sa_sigaction(sig, info, context);
+    } else if (oldAction.sa_handler != SIG_DFL && oldAction.sa_handler != SIG_IGN) {
+        oldAction.sa_handler(sig);
+    } else {
+        // Returning re-runs the access, which now takes the default action
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+static int installHandler() {
+    if (handlerInstalled) {
+        return 0;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = onFault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, &oldAction) < 0) {
+        return -1;
+    }
+    handlerInstalled = 1;
+    return 0;
+}
+
+static int ringSetup() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (ring.fd < 0) {
+        return -1;
+    }
+
+    ring.sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cqMapSize > ring.sqMapSize) {
+            ring.sqMapSize = ring.cqMapSize;
+        }
+        ring.cqMapSize = 0;
+    }
+    ring.sqMap = mmap(NULL, ring.sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cqMap = ring.cqMapSize ? mmap(NULL, ring.cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING) : ring.sqMap;
+    ring.sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqMap == MAP_FAILED || ring.cqMap == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+
+    char *sq = ring.sqMap, *cq = ring.cqMap;
+    ring.sqTail = (unsigned *) (sq + p.sq_off.tail);
+    ring.sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring.sqArray = (unsigned *) (sq + p.sq_off.array);
+    ring.cqHead = (unsigned *) (cq + p.cq_off.head);
+    ring.cqTail = (unsigned *) (cq + p.cq_off.tail);
+    ring.cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void ringClose() {
+    if (ring.fd < 0) {
+        return;
+    }
+    munmap(ring.sqes, ring.sqesSize);
+    if (ring.cqMapSize) {
+        munmap(ring.cqMap, ring.cqMapSize);
+    }
+    munmap(ring.sqMap, ring.sqMapSize);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+// Submit everything queued as one batch and wait for all of it. Short or failed
+// writes are finished with pwrite. If the kernel refuses the batch, what it didn't
+// take is left in the submission ring, where the next batch would send it again: the
+// ring is closed and pwrite used from then on.
+static int submitQueue() {
+    if (queued == 0) {
+        return 0;
+    }
+    int rc = 0;
+    unsigned tail = *ring.sqTail;
+    for (int i = 0; i < queued; i++) {
+        unsigned idx = tail & *ring.sqMask;
+        struct io_uring_sqe *sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = queue[i].fd;
+        sqe->addr = (unsigned long) queue[i].buf;
+        sqe->len = queue[i].len;
+        sqe->off = queue[i].off;
+        sqe->user_data = i;
+        ring.sqArray[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    while (submitted < queued) {
+        int n = syscall(__NR_io_uring_enter, ring.fd, queued - submitted, queued - submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "wfs: io_uring_enter failed (%s), using pwrite\n", n < 0 ? strerror(errno) : "no entries taken");
+            for (int i = submitted; i < queued; i++) {
+                rc |= writeAll(queue[i].fd, queue[i].buf, queue[i].len, queue[i].off);
+            }
+            break;
+        }
+        submitted += n;
+    }
+    diskStats.batches++;
+
+    for (int done = 0; done < submitted; ) {
+        unsigned head = *ring.cqHead;
+        unsigned cqTail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        if (head == cqTail) {
+            syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        for (; head != cqTail; head++, done++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            struct pending *w = &queue[cqe->user_data];
+            size_t written = cqe->res > 0 ? (size_t) cqe->res : 0;
+            if (written < w->len) {
+                rc |= writeAll(w->fd, w->buf + written, w->len - written, w->off + written);
+            }
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+    if (submitted < queued) {
+        ringClose();
+        diskStats.backend = DISK_PWRITE;
+    }
+    queued = 0;
+    return rc;
+}
+
+// Write a run of pages back. O_DIRECT needs the length aligned too, which only the
+// last run of an image may not be.
+static int writeRun(struct view *v, size_t first, size_t last) {
+    off_t off = first * pageSize;
+    size_t end = (last + 1) * pageSize;
+    if (end > v->length) {
+        end = v->length;
+    }
+    if ((off_t) end <= off) {
+        return 0;
+    }
+    size_t len = end - off;
+    int fd = v->directFd >= 0 && len % pageSize == 0 ? v->directFd : v->fd;
+    diskStats.pagesWritten += last - first + 1;
+
+    if (diskStats.backend != DISK_URING) {
+        return writeAll(fd, v->base + off, len, off);
+    }
+    queue[queued] = (struct pending) { fd, v->base + off, len, off };
+    if (++queued == RING_ENTRIES) {
+        return submitQueue();
+    }
+    return 0;
+}
+
+int disk_open(int backend, int count, const int *fds, size_t size, int direct, size_t resident, char **out) {
+    if (count > MAX_VIEWS || backend < DISK_MMAP || backend > DISK_URING || (direct && backend == DISK_MMAP)) {
+        errno = EINVAL;
+        return -1;
+    }
+    pageSize = sysconf(_SC_PAGESIZE);
+    size_t rounded = (size + pageSize - 1) / pageSize * pageSize;
+    // A single access can touch a few pages at once, and needs them all loaded
+    budget = resident ? (resident / pageSize > MIN_RESIDENT ? resident / pageSize : MIN_RESIDENT) : 0;
+    loaded = 0;
+    nothingClean = 0;
+    handView = 0;
+    handPage = 0;
+
+    if (backend == DISK_URING && ringSetup() < 0) {
+        fprintf(stderr, "wfs: io_uring unavailable (%s), using pwrite\n", strerror(errno));
+        backend = DISK_PWRITE;
+    }
+    diskStats.backend = backend;
+    if (backend != DISK_MMAP && installHandler() < 0) {
+        return -1;
+    }
+
+    for (int d = 0; d < count; d++) {
+        struct view *v = &views[d];
+        v->size = rounded;
+        v->length = size;
+        v->fd = fds[d];
+        v->directFd = -1;
+        v->pages = NULL;
+        if (fds[d] < 0) {
+            // Stand-in for a missing member
+            v->base = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        } else if (backend == DISK_MMAP) {
+            v->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[d], 0);
+        } else {
+            v->base = mmap(NULL, rounded, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            v->pages = calloc(rounded / pageSize, 1);
+            if (!v->pages) {
+                viewCount = d + 1;
+                return -1;
+            }
+        }
+        viewCount = d + 1;
+        if (v->base == MAP_FAILED) {
+            v->base = NULL;
+            return -1;
+        }
+
+        // Reopened so that metadata reads still go through the page cache. Filesystems
+        // without O_DIRECT (tmpfs) just keep buffered writes.
+        if (direct && fds[d] >= 0) {
+            char path[32];
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", fds[d]);
+            v->directFd = open(path, O_WRONLY | O_DIRECT);
+        }
+        out[d] = v->base;
+    }
+    return 0;
+}
+
+int disk_populate(off_t off, size_t len) {
+    size_t first = off / pageSize;
+    size_t end = (off + len + pageSize - 1) / pageSize;
+    int rc = 0;
+    for (int d = 0; d < viewCount; d++) {
+        struct view *v = &views[d];
+        if (v->fd < 0) {
+            continue;
+        }
+        if (end * pageSize > v->size) {
+            end = v->size / pageSize;
+        }
+        if (!v->pages) {
+            // Mapped over the same range of the image, but populated
+            size_t mapLen = end * pageSize > v->length ? v->length - first * pageSize : (end - first) * pageSize;
+            void *p = mmap(v->base + first * pageSize, mapLen, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_FIXED | MAP_POPULATE, v->fd, first * pageSize);
+            rc |= p == MAP_FAILED ? -1 : 0;
+            continue;
+        }
+        for (size_t page = first; page < end; page++) {
+            if (v->pages[page] == PAGE_NONE) {
+                loadPage(v, page);
+            }
+        }
+    }
+    return rc;
+}
+
+void disk_willneed(const char *addr, size_t len) {
+    for (int d = 0; d < viewCount; d++) {
+        struct view *v = &views[d];
+        if (v->fd < 0 || addr < v->base || addr >= v->base + v->size) {
+            continue;
+        }
+        size_t start = (addr - v->base) / pageSize * pageSize;
+        size_t end = addr - v->base + len;
+        if (end > v->length) {
+            end = v->length;
+        }
+        if (!v->pages) {
+            madvise(v->base + start, end - start, MADV_WILLNEED);
+        } else {
+            // Into the page cache, where the fault's pread will find it
+            posix_fadvise(v->fd, start, end - start, POSIX_FADV_WILLNEED);
+        }
+        return;
+    }
+}
+
+int disk_writeback() {
+    if (diskStats.backend == DISK_MMAP) {
+        return 0;
+    }
+    int rc = 0;
+    long before = diskStats.pagesWritten;
+    for (int d = 0; d < viewCount; d++) {
+        struct view *v = &views[d];
+        if (!v->pages) {
+            continue;
+        }
+        size_t pages = v->size / pageSize;
+        for (size_t first = 0; first < pages; first++) {
+            if (v->pages[first] != PAGE_DIRTY) {
+                continue;
+            }
+            size_t last = first;
+            while (last + 1 < pages && v->pages[last + 1] == PAGE_DIRTY) {
+                last++;
+            }
+            // Read-only again before the write, so a store racing it faults and
+            // dirties the page for the next write-back
+            mprotect(v->base + first * pageSize, (last - first + 1) * pageSize, PROT_READ);
+            memset(v->pages + first, PAGE_CLEAN, last - first + 1);
+            nothingClean = 0;
+            rc |= writeRun(v, first, last);
+            first = last;
+        }
+    }
+    if (diskStats.backend == DISK_URING) {
+        rc |= submitQueue();
+    }
+    if (diskStats.pagesWritten != before) {
+        diskStats.writebacks++;
+    }
+    return rc;
+}
+
+int disk_sync() {
+    int rc = disk_writeback();
+    for (int d = 0; d < viewCount; d++) {
+        struct view *v = &views[d];
+        if (v->fd < 0 || !v->base) {
+            continue;
+        }
+        if (diskStats.backend == DISK_MMAP) {
+            rc |= msync(v->base, v->length, MS_SYNC);
+        } else {
+            rc |= fsync(v->fd);
+        }
+    }
+    return rc;
+}
+
+int disk_punch(int d, off_t off, size_t len) {
+    struct view *v = &views[d];
+    if (v->fd < 0) {
+        memset(v->base + off, 0, len);
+        return 0;
+    }
+    if (fallocate(v->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) < 0) {
+        return -1;
+    }
+    if (!v->pages) {
+        return 0;  // the shared mapping sees the hole
+    }
+
+    // Whole pages are dropped and read back (as zeros) when next touched. Loaded
+    // pages the range only partly covers are zeroed in place, keeping their state.
+    size_t end = off + len;
+    for (size_t page = off / pageSize; page * pageSize < end; page++) {
+        char *p = v->base + page * pageSize;
+        size_t from = page * pageSize > (size_t) off ? page * pageSize : (size_t) off;
+        size_t to = (page + 1) * pageSize < end ? (page + 1) * pageSize : end;
+        if (v->pages[page] == PAGE_NONE) {
+            continue;
+        }
+        if (to - from == pageSize) {
+            madvise(p, pageSize, MADV_DONTNEED);
+            mprotect(p, pageSize, PROT_NONE);
+            v->pages[page] = PAGE_NONE;
+            loaded--;
+            continue;
+        }
+        mprotect(p, pageSize, PROT_READ | PROT_WRITE);
+        memset(v->base + from, 0, to - from);
+        if (v->pages[page] != PAGE_DIRTY) {
+            mprotect(p, pageSize, PROT_READ);
+        }
+    }
+    return 0;
+}
+
+void disk_close() {
+    disk_writeback();
+    for (int d = 0; d < viewCount; d++) {
+        struct view *v = &views[d];
+        if (v->base) {
+            munmap(v->base, v->pages || v->fd < 0 ? v->size : v->length);
+        }
+        if (v->directFd >= 0) {
+            close(v->directFd);
+        }
+        free(v->pages);
+        memset(v, 0, sizeof(*v));
+    }
+    viewCount = 0;
+    ringClose();
+    if (handlerInstalled) {
+        sigaction(SIGSEGV, &oldAction, NULL);
+        handlerInstalled = 0;
+    }
+}
@@ -0,0 +1,70 @@
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+  Storage backends for the disk images (wfs -o backend=NAME).
+
+  wfs works on one memory view per disk image. The backend decides what sits behind
+  the view and how changes get back to the image file:
+
+  mmap     the image is mapped MAP_SHARED and the kernel writes pages back (default)
+  pwrite   the view is anonymous memory, filled a page at a time with pread on first
+           touch. Pages written to are tracked and written back with pwrite.
+  io_uring like pwrite, but each write-back goes out as one batch of io_uring writes
+           over all disks. Falls back to pwrite if the kernel refuses a ring.
+
+  With pwrite and io_uring, pages are tracked through their protection: untouched
+  pages are PROT_NONE, loaded ones PROT_READ, and written ones PROT_READ | PROT_WRITE
+  until the next write-back. A SIGSEGV handler moves pages along. Only pages that are
+  touched take memory, and write-back can use O_DIRECT (-o direct).
+
+  Loaded pages are anonymous memory, which only swap can take back, so they are kept
+  under a budget (-o resident): past it, clean pages are dropped (MADV_DONTNEED) in
+  clock order and read again if touched. Dirty pages stay until written back.
+*/
+
+#define DISK_MMAP   (0)
+#define DISK_PWRITE (1)
+#define DISK_URING  (2)
+
+struct disk_stats {
+    int backend;            // in use, after any fallback
+    long pagesRead;         // pages faulted in from the images
+    long pagesDropped;      // clean pages dropped to stay under the budget
+    long pagesWritten;      // pages written back
+    long writebacks;        // write-backs that found dirty pages
+    long batches;           // io_uring submissions
+};
+
+extern struct disk_stats diskStats;
+
+// Backend number for a -o backend= name, or -1
+int disk_backend(const char *name);
+const char *disk_backend_name(int backend);
+
+// Open a view of size bytes on each of the count images. A negative fd stands for a
+// missing disk: its view is plain zeroed memory that is never written back. Returns 0,
+// or -1 with errno set. direct asks for O_DIRECT write-back (not with mmap). Under
+// pwrite and io_uring, about resident bytes of loaded pages are kept over all views;
+// 0 keeps every page loaded.
+int disk_open(int backend, int count, const int *fds, size_t size, int direct, size_t resident, char **views);
+
+// Read [off, off + len) of every image in now, as MAP_POPULATE would. Meant for the
+// metadata regions.
+int disk_populate(off_t off, size_t len);
+
+// Start reading the len bytes at addr, which lies in a view, in the background
+void disk_willneed(const char *addr, size_t len);
+
+// Write dirty pages back to the images. A no-op under mmap.
+int disk_writeback(void);
+
+// Write back, then wait until the images are durable (fsync)
+int disk_sync(void);
+
+// Punch out len bytes at off of disk d: the image reads zeros there afterwards, and
+// so does the view. Returns -1 if the image can't punch holes; the caller then
+// zeroes the range itself.
+int disk_punch(int d, off_t off, size_t len);
+
+void disk_close(void);
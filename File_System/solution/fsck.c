@@ -0,0 +1,983 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/fs.h>  // FS_COMPR_FL
+#undef BLOCK_SIZE         // clashes with wfs.h's, which is the one meant here
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "wfs.h"
+#include "raid.h"
+
+/*
+  wfs-fsck checks the disks of an unmounted filesystem, given in the order wfs takes
+  them, or in any order on images whose superblocks record it. The images are
+  mapped, and the scans are spread over threads by ranges of inodes, blocks and
+  stripes:
+
+  1. every allocated inode: its number, size and block slots, and for directories
+     their entries; block slots are counted per data block
+  2. the tree from the root: unreachable inodes and link counts
+  3. every data block against the data bitmap and the reference counts, and the
+     fingerprint table against the blocks
+  4. the copies: metadata on every disk against disk 0, which is the copy wfs serves,
+     mirrors against each other and parity against the data. Regions marked in the
+     write-intent bitmap are left to wfs, which brings them in line at mount.
+
+  A RAID 1 mirror that missed mounts is left out of all of this, and one that didn't
+  is checked in place of disk 0: wfs copies the newest mirror over it at the next
+  mount. Other layouts can't be checked while a disk is out of date.
+
+  With -y problems are repaired as they are found. Slots that can't be right are
+  cleared, which leaves a hole in the file, and blocks and inodes nothing refers to
+  are freed. Changed metadata is copied to every disk at the end, and changed data
+  blocks get their mirrors and parity rewritten.
+
+  The exit status follows e2fsck: 0 when nothing was wrong, 1 when everything wrong
+  was repaired, 4 when problems remain and 8 when the disks couldn't be checked.
+*/
+
+#define FSCK_CLEAN   0
+#define FSCK_FIXED   1
+#define FSCK_ERRORS  4
+#define FSCK_FAILED  8
+
+#define MAX_FILE_BLOCKS (IND_BLOCK + (int)(BLOCK_SIZE / sizeof(off_t)))
+#define DENTRIES_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(struct wfs_dentry)))
+#define MAX_DENTRIES (IND_BLOCK * DENTRIES_PER_BLOCK)
+
+// Work handed to a thread at a time: inodes, data blocks (a multiple of 8, so no two
+// threads share a bitmap byte), stripes or rows, and bytes of metadata
+#define INODE_GRAIN  256
+#define BLOCK_GRAIN  4096
+#define ROW_GRAIN    256
+#define META_GRAIN   (64 * 1024)
+
+int disk_count;
+char **disks, **diskNames;
+char *stale;            // disks that missed mounts (RAID 1 only)
+size_t fsSize;
+struct wfs_sb *sb;
+long iCount, dCount;
+int parity, pairs, repair, threadCount;
+long ownStart, ownEnd;  // superblock bytes that differ between disks (see wfs.h)
+
+char *inodeMap, *inodeStart, *dataMap;
+uint16_t *refCounts;
+struct wfs_fingerprint *fingerprints;
+char *wiMap;
+
+// Filled in by the scans
+unsigned *blockRefs;    // block slots pointing at each data block
+unsigned *inodeRefs;    // directory entries naming each inode
+unsigned *subdirs;      // directories in each directory
+char *reached;          // inodes reachable from the root
+char *touched;          // bitmap of data blocks rewritten on disk 0's copy
+char *released;         // bitmap of data blocks freed along with an unreachable inode
+long problems, fixes, staleRegions;
+int metaChanged;
+pthread_mutex_t printLock = PTHREAD_MUTEX_INITIALIZER;
+
+void usage(char *name) {
+    printf("Usage: %s [-y] [-t threads] disk1 disk2 ...\n", name);
+    printf("\t-y Repair what can be repaired\n");
+    printf("\t-t Threads to check with (default: one per CPU)\n");
+    printf("Exit status: 0 clean, 1 problems repaired, 4 problems left, 8 not checked\n");
+}
+
+int isBitSet(const char *map, long i) {
+    return (map[i / 8] >> (i % 8)) & 1;
+}
+
+void setBit(char *map, long i) {
+    __atomic_fetch_or(&map[i / 8], 1 << (i % 8), __ATOMIC_RELAXED);
+}
+
+void clearBit(char *map, long i) {
+    __atomic_fetch_and(&map[i / 8], ~(1 << (i % 8)), __ATOMIC_RELAXED);
+}
+
+// Report a problem. Returns 1 if it is to be repaired, in which case the message says
+// so. fixable is 0 for problems -y can't do anything about.
+int problem(int fixable, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&printLock);
+    vprintf(fmt, ap);
+    fputs(repair ? (fixable ? ", fixed\n" : ", not fixed\n") : "\n", stdout);
+    problems++;
+    fixes += repair && fixable;
+    pthread_mutex_unlock(&printLock);
+    va_end(ap);
+    return repair && fixable;
+}
+
+struct wfs_inode *inodeAt(long i) {
+    return (struct wfs_inode *)(inodeStart + i * BLOCK_SIZE);
+}
+
+// Index of the data block at addr, or -1 if addr isn't a block address
+long blockIndex(off_t addr) {
+    off_t rel = addr - sb->d_blocks_ptr;
+    if (rel < 0 || rel % BLOCK_SIZE || rel / BLOCK_SIZE >= dCount) {
+        return -1;
+    }
+    return rel / BLOCK_SIZE;
+}
+
+// Data block i as stored on the copy wfs reads it from (member 0), or on the other
+// member of its RAID 10 pair, or on RAID 1 mirror `member`
+char *dataBlock(long i, int member) {
+    off_t region = sb->d_blocks_ptr;
+    if (pairs) {
+        return disks[2 * (i % pairs) + member] + region + (i / pairs) * BLOCK_SIZE;
+    }
+    if (parity) {
+        int ndata = disk_count - parity;
+        long s = i / ndata;
+        return disks[raid_data_disk(disk_count, parity, s, i % ndata)] + region + s * BLOCK_SIZE;
+    }
+    return disks[member] + region + i * BLOCK_SIZE;
+}
+
+// Stripe s's data blocks in order, then P and Q, as in wfs
+void stripeMembers(long s, char **members) {
+    int ndata = disk_count - parity;
+    off_t off = sb->d_blocks_ptr + s * BLOCK_SIZE;
+    for (int i = 0; i < ndata; i++) {
+        members[i] = disks[raid_data_disk(disk_count, parity, s, i)] + off;
+    }
+    members[ndata] = disks[raid_p_disk(disk_count, s)] + off;
+    if (parity == 2) {
+        members[ndata + 1] = disks[raid_q_disk(disk_count, s)] + off;
+    }
+}
+
+uint64_t blockHash(const char *data) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Run fn over [0, count) on every thread, grain items at a time
+struct work {
+    void (*fn)(long from, long to);
+    long count, grain, next;
+};
+
+void *worker(void *arg) {
+    struct work *w = arg;
+    long from;
+    while ((from = __atomic_fetch_add(&w->next, w->grain, __ATOMIC_RELAXED)) < w->count) {
+        w->fn(from, from + w->grain < w->count ? from + w->grain : w->count);
+    }
+    return NULL;
+}
+
+void parallel(void (*fn)(long from, long to), long count, long grain) {
+    struct work w = {fn, count, grain, 0};
+    pthread_t threads[threadCount];
+    int started = 0;
+    for (; started < threadCount - 1; started++) {
+        if (pthread_create(&threads[started], NULL, worker, &w) != 0) {
+            break;
+        }
+    }
+    worker(&w);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+// Where a file's block slots end: past the block holding its last byte, or in a
+// compressed file past the cluster holding it
+int slotsInUse(struct wfs_inode *inode) {
+    off_t size = inode->size;
+    if (inode->flags & FS_COMPR_FL) {
+        size = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE;
+    }
+    long slots = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return slots < MAX_FILE_BLOCKS ? slots : MAX_FILE_BLOCKS;
+}
+
+// Check the file block slot n of inode i, which holds *slot, and count the block it
+// points at. indirect is the block holding the slot, or -1 for the inode itself.
+void checkSlot(long i, struct wfs_inode *inode, int n, off_t *slot, long indirect) {
+    if (!*slot) {
+        return;
+    }
+    const char *why = NULL;
+    long b = blockIndex(*slot);
+    if (*slot == CLUSTER_MARK) {
+        if (inode->flags & FS_COMPR_FL) {
+            return;
+        }
+        why = "a cluster mark in an uncompressed file";
+    } else if (b < 0) {
+        why = "a bad block address";
+    } else if (n >= slotsInUse(inode)) {
+        why = "a block past the end of the file";
+    }
+
+    if (!why) {
+        __atomic_fetch_add(&blockRefs[b], 1, __ATOMIC_RELAXED);
+    } else if (problem(1, "inode %ld: slot %d holds %s (%lld)", i, n, why, (long long) *slot)) {
+        *slot = 0;
+        if (indirect >= 0) {
+            setBit(touched, indirect);
+        } else {
+            metaChanged = 1;
+        }
+    }
+}
+
+void checkFile(long i, struct wfs_inode *inode) {
+    if (inode->size < 0 || inode->size > (off_t) MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        if (problem(1, "inode %ld: size %lld out of range", i, (long long) inode->size)) {
+            inode->size = inode->size < 0 ? 0 : (off_t) MAX_FILE_BLOCKS * BLOCK_SIZE;
+            metaChanged = 1;
+        }
+    }
+    for (int n = 0; n < IND_BLOCK; n++) {
+        checkSlot(i, inode, n, &inode->blocks[n], -1);
+    }
+
+    off_t ind = inode->blocks[IND_BLOCK];
+    if (!ind) {
+        return;
+    }
+    long b = blockIndex(ind);
+    if (b < 0 || slotsInUse(inode) <= IND_BLOCK) {
+        const char *why = b < 0 ? "a bad address" : "no slots in use";
+        if (problem(1, "inode %ld: indirect block %lld has %s", i, (long long) ind, why)) {
+            inode->blocks[IND_BLOCK] = 0;
+            metaChanged = 1;
+        }
+        if (b < 0 || repair) {
+            return;
+        }
+    }
+    __atomic_fetch_add(&blockRefs[b], 1, __ATOMIC_RELAXED);
+    off_t *slots = (off_t *) dataBlock(b, 0);
+    for (int n = 0; n < BLOCK_SIZE / sizeof(off_t); n++) {
+        checkSlot(i, inode, IND_BLOCK + n, &slots[n], b);
+    }
+}
+
+// Entry k of a directory, or NULL if the block that should hold it isn't one
+struct wfs_dentry *dirEntry(struct wfs_inode *dir, int k) {
+    long b = blockIndex(dir->blocks[k / DENTRIES_PER_BLOCK]);
+    return b < 0 ? NULL : (struct wfs_dentry *) dataBlock(b, 0) + k % DENTRIES_PER_BLOCK;
+}
+
+// Whether inode i is allocated and holds something; an inode with no file type is
+// left for the tree walk to free
+int inUse(long i) {
+    return isBitSet(inodeMap, i) && (inodeAt(i)->mode & S_IFMT);
+}
+
+// The inode an entry names, if it is one that can be named
+int entryInode(struct wfs_dentry *entry) {
+    if (!entry || entry->num <= 0 || entry->num >= iCount || !inUse(entry->num)) {
+        return -1;
+    }
+    return entry->num;
+}
+
+// Take entry k out of directory inode, moving the last entry into its place as wfs
+// does, so entries stay packed
+void removeEntry(struct wfs_inode *dir, int k) {
+    int last = dir->size / sizeof(struct wfs_dentry) - 1;
+    long kb = blockIndex(dir->blocks[k / DENTRIES_PER_BLOCK]);
+    long lb = blockIndex(dir->blocks[last / DENTRIES_PER_BLOCK]);
+    struct wfs_dentry *entry = (struct wfs_dentry *) dataBlock(kb, 0) + k % DENTRIES_PER_BLOCK;
+    struct wfs_dentry *lastEntry = (struct wfs_dentry *) dataBlock(lb, 0) + last % DENTRIES_PER_BLOCK;
+    if (entry != lastEntry) {
+        memcpy(entry, lastEntry, sizeof(*entry));
+    }
+    memset(lastEntry, 0, sizeof(*lastEntry));
+    dir->size -= sizeof(struct wfs_dentry);
+    setBit(touched, kb);
+    setBit(touched, lb);
+    metaChanged = 1;
+}
+
+void checkDir(long i, struct wfs_inode *dir) {
+    off_t size = dir->size;
+    if (size < 0 || size % sizeof(struct wfs_dentry) || size > MAX_DENTRIES * sizeof(struct wfs_dentry)) {
+        if (problem(1, "inode %ld: directory size %lld is not a whole number of entries", i, (long long) size)) {
+            size = size < 0 ? 0 : size > MAX_DENTRIES * sizeof(struct wfs_dentry) ? MAX_DENTRIES * sizeof(struct wfs_dentry) : size;
+            dir->size = size - size % sizeof(struct wfs_dentry);
+            metaChanged = 1;
+        }
+    }
+    if (dir->blocks[IND_BLOCK]) {
+        if (problem(1, "inode %ld: directory has an indirect block", i)) {
+            dir->blocks[IND_BLOCK] = 0;
+            metaChanged = 1;
+        }
+    }
+
+    // Directories never shrink, so blocks past the last entry may still be held
+    int blocks = 0;
+    for (int n = 0; n < IND_BLOCK; n++) {
+        off_t addr = dir->blocks[n];
+        long b = blockIndex(addr);
+        if (addr && b < 0) {
+            if (problem(1, "inode %ld: slot %d holds a bad block address (%lld)", i, n, (long long) addr)) {
+                dir->blocks[n] = 0;
+                metaChanged = 1;
+            }
+        } else if (addr) {
+            __atomic_fetch_add(&blockRefs[b], 1, __ATOMIC_RELAXED);
+        }
+        if (blocks == n && addr && b >= 0) {
+            blocks++;
+        }
+    }
+    if (dir->size > (off_t) blocks * BLOCK_SIZE) {
+        if (problem(1, "inode %ld: directory entries run past its blocks", i)) {
+            dir->size = (off_t) blocks * BLOCK_SIZE;
+            metaChanged = 1;
+        } else {
+            return;
+        }
+    }
+
+    int n = dir->size / sizeof(struct wfs_dentry);
+    for (int k = 0; k < n; k++) {
+        struct wfs_dentry *entry = dirEntry(dir, k);
+        const char *why = NULL;
+        if (!entry->name[0] || memchr(entry->name, '/', strnlen(entry->name, MAX_NAME))) {
+            why = "a bad name";
+        } else if (entry->num <= 0 || entry->num >= iCount) {
+            why = "a bad inode number";
+        } else if (!inUse(entry->num)) {
+            why = "an unused inode";
+        }
+        for (int j = 0; !why && j < k; j++) {
+            if (strncmp(dirEntry(dir, j)->name, entry->name, MAX_NAME) == 0) {
+                why = "a name used before";
+            }
+        }
+
+        if (why) {
+            if (problem(1, "inode %ld: entry %d (%.*s) names %s", i, k, MAX_NAME, entry->name, why)) {
+                removeEntry(dir, k);
+                k--;
+                n--;
+            }
+            continue;
+        }
+        __atomic_fetch_add(&inodeRefs[entry->num], 1, __ATOMIC_RELAXED);
+        if (S_ISDIR(inodeAt(entry->num)->mode)) {
+            subdirs[i]++;
+        }
+    }
+
+    // wfs looks names up in every slot of a directory's blocks, so the slots past
+    // the last entry must stay empty
+    for (int k = n; k < blocks * DENTRIES_PER_BLOCK; k++) {
+        struct wfs_dentry *entry = dirEntry(dir, k);
+        if (entry->name[0] && problem(1, "inode %ld: entry %d (%.*s) is past the end of the directory", i, k, MAX_NAME, entry->name)) {
+            memset(entry, 0, sizeof(*entry));
+            setBit(touched, blockIndex(dir->blocks[k / DENTRIES_PER_BLOCK]));
+        }
+    }
+}
+
+// Phase 1, over inode ranges
+void checkInodes(long from, long to) {
+    for (long i = from; i < to; i++) {
+        if (!inUse(i)) {
+            continue;
+        }
+        struct wfs_inode *inode = inodeAt(i);
+        if (inode->num != i) {
+            if (problem(1, "inode %ld: numbered %d", i, inode->num)) {
+                inode->num = i;
+                metaChanged = 1;
+            }
+        }
+        if (S_ISDIR(inode->mode)) {
+            checkDir(i, inode);
+        } else {
+            checkFile(i, inode);
+        }
+    }
+}
+
+// Drop a block slot's reference to block b for an inode being freed. The block is
+// freed with the last reference, as wfs would, rather than reported as leaked.
+void dropRef(long b) {
+    unsigned refs = --blockRefs[b];
+    if (!refs) {
+        clearBit(dataMap, b);
+        setBit(released, b);
+    }
+    if (refCounts && refCounts[b] == refs + 1) {
+        refCounts[b] = refs;
+    }
+}
+
+// Drop the block references and entries of an inode being freed
+void releaseInode(long i, struct wfs_inode *inode) {
+    if (S_ISDIR(inode->mode)) {
+        for (int n = 0; n < IND_BLOCK; n++) {
+            if (blockIndex(inode->blocks[n]) >= 0) {
+                dropRef(blockIndex(inode->blocks[n]));
+            }
+        }
+        for (int k = 0; k < inode->size / sizeof(struct wfs_dentry); k++) {
+            int child = entryInode(dirEntry(inode, k));
+            if (child > 0) {
+                inodeRefs[child]--;
+            }
+        }
+    } else if (inode->mode & S_IFMT) {
+        // Phase 1 cleared every slot it didn't count
+        for (int n = 0; n < IND_BLOCK; n++) {
+            if (inode->blocks[n] && inode->blocks[n] != CLUSTER_MARK) {
+                dropRef(blockIndex(inode->blocks[n]));
+            }
+        }
+        if (inode->blocks[IND_BLOCK]) {
+            long b = blockIndex(inode->blocks[IND_BLOCK]);
+            off_t *slots = (off_t *) dataBlock(b, 0);
+            for (int n = 0; n < BLOCK_SIZE / sizeof(off_t); n++) {
+                if (slots[n] && slots[n] != CLUSTER_MARK) {
+                    dropRef(blockIndex(slots[n]));
+                }
+            }
+            dropRef(b);
+        }
+    }
+    memset(inode, 0, BLOCK_SIZE);
+    clearBit(inodeMap, i);
+    metaChanged = 1;
+}
+
+// Phase 2: walk the tree from the root, then check what was and wasn't reached
+void checkTree() {
+    struct wfs_inode *root = inodeAt(0);
+    if (!isBitSet(inodeMap, 0) || !S_ISDIR(root->mode)) {
+        problem(0, "inode 0: the root is not a directory");
+        return;
+    }
+
+    long *queue = malloc(iCount * sizeof(long));
+    long head = 0, tail = 0;
+    queue[tail++] = 0;
+    reached[0] = 1;
+    while (head < tail) {
+        struct wfs_inode *dir = inodeAt(queue[head++]);
+        for (int k = 0; k < dir->size / sizeof(struct wfs_dentry); k++) {
+            int child = entryInode(dirEntry(dir, k));
+            if (child < 0 || reached[child]) {
+                continue;
+            }
+            reached[child] = 1;
+            if (S_ISDIR(inodeAt(child)->mode)) {
+                queue[tail++] = child;
+            }
+        }
+    }
+    free(queue);
+
+    for (long i = 1; i < iCount; i++) {
+        if (isBitSet(inodeMap, i) && !reached[i]) {
+            if (problem(1, "inode %ld: allocated but not reachable from the root", i)) {
+                releaseInode(i, inodeAt(i));
+            }
+        }
+    }
+
+    for (long i = 0; i < iCount; i++) {
+        if (!reached[i] || !isBitSet(inodeMap, i)) {
+            continue;
+        }
+        struct wfs_inode *inode = inodeAt(i);
+        int isDir = S_ISDIR(inode->mode);
+        if (isDir && inodeRefs[i] > 1) {
+            problem(0, "inode %ld: directory is in %u directories", i, inodeRefs[i]);
+        }
+        long links = isDir ? (i == 0 ? 2 : 1) + subdirs[i] : inodeRefs[i];
+        if (inode->nlinks != links) {
+            if (problem(1, "inode %ld: %d links, should be %ld", i, inode->nlinks, links)) {
+                inode->nlinks = links;
+                metaChanged = 1;
+            }
+        }
+    }
+}
+
+// Phase 3, over data block ranges
+void checkBlocks(long from, long to) {
+    for (long b = from; b < to; b++) {
+        unsigned refs = blockRefs[b];
+        int used = isBitSet(dataMap, b);
+        if (refs && !used) {
+            if (problem(1, "block %ld: in use but marked free", b)) {
+                setBit(dataMap, b);
+                metaChanged = 1;
+            }
+        } else if (!refs && used) {
+            if (problem(1, "block %ld: marked in use but nothing refers to it", b)) {
+                clearBit(dataMap, b);
+                metaChanged = 1;
+            }
+        }
+
+        // A count of 0 means the block was never shared and has one owner
+        if (!refCounts) {
+            if (refs > 1) {
+                problem(0, "block %ld: in %u block slots", b, refs);
+            }
+            continue;
+        }
+        unsigned count = refCounts[b];
+        int ok = refs > 1 ? count == refs : refs ? count <= 1 : count == 0;
+        if (!ok && problem(1, "block %ld: reference count %u, %u block slots", b, count, refs)) {
+            refCounts[b] = refs > 1 ? refs : 0;
+            metaChanged = 1;
+        }
+    }
+}
+
+void checkFingerprints(long from, long to) {
+    for (long n = from; n < to; n++) {
+        struct wfs_fingerprint *fp = &fingerprints[n];
+        if (fp->block <= 0) {
+            continue;
+        }
+        long b = fp->block - 1;
+        const char *why = NULL;
+        if (b < dCount && isBitSet(released, b)) {
+            fp->block = FP_DELETED;
+            continue;
+        }
+        if (b >= dCount || !blockRefs[b]) {
+            why = "a block not in use";
+        } else if (blockHash(dataBlock(b, 0)) != fp->hash) {
+            why = "a block whose contents changed";
+        }
+        if (why && problem(1, "fingerprint %ld: holds %s (%ld)", n, why, b)) {
+            fp->block = FP_DELETED;
+            metaChanged = 1;
+        }
+    }
+}
+
+// Phase 4, over blocks for RAID 0 and 1, rows for RAID 10 and stripes for parity.
+// Blocks fsck rewrote are copied or have their parity regenerated without a report.
+void checkMirrors(long from, long to) {
+    for (long b = from; b < to; b++) {
+        int rewritten = isBitSet(touched, b);
+        if (!rewritten && (sb->raid_mode == RAID0 || (wiMap && isBitSet(wiMap, b / WI_REGION)))) {
+            continue;
+        }
+        int bad = 0;
+        for (int d = 1; d < disk_count; d++) {
+            bad |= (rewritten || !stale[d]) && memcmp(dataBlock(b, 0), dataBlock(b, d), BLOCK_SIZE) != 0;
+        }
+        if (!bad || (!rewritten && !problem(1, "block %ld: mirrors disagree", b))) {
+            continue;
+        }
+        // Copies vote for the copies they match; ties go to disk 0, which is also
+        // where fsck's own changes are. Those go to stale mirrors too, the rest of a
+        // stale mirror is left to wfs.
+        int best = 0, bestVotes = 0;
+        for (int d = 0; d < disk_count && !rewritten; d++) {
+            int votes = 0;
+            for (int e = 0; e < disk_count && !stale[d]; e++) {
+                votes += !stale[e] && memcmp(dataBlock(b, d), dataBlock(b, e), BLOCK_SIZE) == 0;
+            }
+            if (votes > bestVotes) {
+                best = d;
+                bestVotes = votes;
+            }
+        }
+        for (int d = 0; d < disk_count; d++) {
+            if (d != best && (rewritten || !stale[d])) {
+                memcpy(dataBlock(b, d), dataBlock(b, best), BLOCK_SIZE);
+            }
+        }
+    }
+}
+
+void checkPairs(long from, long to) {
+    for (long row = from; row < to; row++) {
+        for (int p = 0; p < pairs; p++) {
+            long b = row * pairs + p;
+            char *a = dataBlock(b, 0), *c = dataBlock(b, 1);
+            if (b < dCount && isBitSet(touched, b)) {
+                memcpy(c, a, BLOCK_SIZE);
+            } else if (wiMap && b < dCount && isBitSet(wiMap, b / WI_REGION)) {
+                continue;
+            } else if (memcmp(a, c, BLOCK_SIZE) && problem(1, "block %ld: pair %d members disagree", b, p)) {
+                memcpy(c, a, BLOCK_SIZE);
+            }
+        }
+    }
+}
+
+void checkStripes(long from, long to) {
+    int ndata = disk_count - parity;
+    char *members[disk_count];
+    char p[BLOCK_SIZE], q[BLOCK_SIZE];
+    for (long s = from; s < to; s++) {
+        stripeMembers(s, members);
+        int rewritten = 0, pending = 0;
+        for (long b = s * ndata; b < (s + 1) * ndata && b < dCount; b++) {
+            rewritten |= isBitSet(touched, b);
+            pending |= wiMap && isBitSet(wiMap, b / WI_REGION);
+        }
+        if (pending && !rewritten) {
+            continue;
+        }
+        if (parity == 2) {
+            raid_gen_pq(ndata, members, p, q, BLOCK_SIZE);
+        } else {
+            raid_gen_p(ndata, members, p, BLOCK_SIZE);
+        }
+        int good = !memcmp(p, members[ndata], BLOCK_SIZE) && (parity == 1 || !memcmp(q, members[ndata + 1], BLOCK_SIZE));
+        if (good) {
+            continue;
+        }
+        if (rewritten) {
+            memcpy(members[ndata], p, BLOCK_SIZE);
+            if (parity == 2) {
+                memcpy(members[ndata + 1], q, BLOCK_SIZE);
+            }
+            continue;
+        }
+        // RAID 6 can find a single bad member and repair it; RAID 5 rewrites P
+        int fixable = 1;
+        if (repair) {
+            fixable = parity == 2 ? raid6_repair(ndata, members, members[ndata], members[ndata + 1], BLOCK_SIZE) >= 0
+                                  : raid5_repair(ndata, members, members[ndata], BLOCK_SIZE) >= 0;
+        }
+        problem(fixable, "stripe %ld: parity does not match the data", s);
+    }
+}
+
+// Metadata is numbered as the bytes before the data region followed by the tail
+// regions after it (write-intent, reference counts, fingerprints), which every disk
+// holds a copy of
+off_t metaTail() {
+    return sb->wi_bitmap_ptr ? sb->wi_bitmap_ptr : sb->refcount_ptr;
+}
+
+long metaSize() {
+    return sb->d_blocks_ptr + (metaTail() ? fsSize - metaTail() : 0);
+}
+
+// Compare [off, off + len) on every disk against disk 0, or copy it from disk 0. wfs
+// copies all of it to a stale mirror at mount.
+void compareMetadata(off_t off, size_t len, int copy) {
+    for (int d = 1; d < disk_count && len; d++) {
+        if (stale[d] || memcmp(disks[0] + off, disks[d] + off, len) == 0) {
+            continue;
+        }
+        if (copy) {
+            memcpy(disks[d] + off, disks[0] + off, len);
+            continue;
+        }
+        long at = 0;
+        while (disks[0][off + at] == disks[d][off + at]) {
+            at++;
+        }
+        problem(1, "%s: metadata differs from %s at offset %lld", diskNames[d], diskNames[0], (long long) (off + at));
+    }
+}
+
+void metadataRange(long from, long to, int copy) {
+    long split = sb->d_blocks_ptr;
+    if (from < split) {
+        long end = to < split ? to : split;
+        if (from < ownStart) {
+            compareMetadata(from, (end < ownStart ? end : ownStart) - from, copy);
+        }
+        from = from > ownEnd ? from : ownEnd;
+        if (from < end) {
+            compareMetadata(from, end - from, copy);
+        }
+    }
+    if (to > split) {
+        from = from > split ? from : split;
+        compareMetadata(metaTail() + from - split, to - from, copy);
+    }
+}
+
+void checkMetadata(long from, long to) {
+    metadataRange(from, to, 0);
+}
+
+void copyMetadata(long from, long to) {
+    metadataRange(from, to, 1);
+}
+
+// Put the disks in the order their superblocks record and check they are from one
+// filesystem. Images made before the identity fields stay in the order given. Under
+// RAID 1, a mirror that is up to date takes the place of a disk 0 that isn't.
+int orderDisks(char **names) {
+    struct wfs_sb *first = (struct wfs_sb *) disks[0];
+    if (first->i_bitmap_ptr < (off_t) sizeof(struct wfs_sb) || first->magic != WFS_MAGIC ||
+        first->disk_count != disk_count) {
+        return 0;  // a wrong disk count is reported by checkSuperblock
+    }
+    char *ordered[disk_count], *orderedNames[disk_count];
+    memset(ordered, 0, sizeof(ordered));
+    uint64_t newest = 0;
+    int dirty = 0;
+    for (int d = 0; d < disk_count; d++) {
+        struct wfs_sb *disk = (struct wfs_sb *) disks[d];
+        if (disk->magic != WFS_MAGIC || memcmp(disk->uuid, first->uuid, sizeof(first->uuid)) != 0) {
+            fprintf(stderr, "%s: not from the same filesystem as %s\n", names[d], names[0]);
+            return -1;
+        }
+        if (disk->version > WFS_VERSION) {
+            fprintf(stderr, "%s: superblock version %u is newer than this wfs-fsck\n", names[d], disk->version);
+            return -1;
+        }
+        if (disk->disk_index < 0 || disk->disk_index >= disk_count || ordered[disk->disk_index]) {
+            fprintf(stderr, "%s: disk index %d is out of range or taken\n", names[d], disk->disk_index);
+            return -1;
+        }
+        ordered[disk->disk_index] = disks[d];
+        orderedNames[disk->disk_index] = names[d];
+        newest = disk->events > newest ? disk->events : newest;
+        dirty |= disk->state != WFS_CLEAN;
+    }
+    memcpy(disks, ordered, sizeof(ordered));
+    memcpy(names, orderedNames, sizeof(orderedNames));
+    ownStart = offsetof(struct wfs_sb, disk_index);
+    ownEnd = sizeof(struct wfs_sb);
+
+    for (int d = 0; d < disk_count; d++) {
+        struct wfs_sb *disk = (struct wfs_sb *) disks[d];
+        if (disk->events == newest) {
+            continue;
+        }
+        if (first->raid_mode != RAID1) {
+            fprintf(stderr, "%s: missed %llu mounts, %s\n", names[d], (unsigned long long) (newest - disk->events),
+                    raid_parity(first->raid_mode) ? "check again once wfs has rebuilt it"
+                                                  : "and can't be checked with the others");
+            return -1;
+        }
+        printf("%s: missed %llu mounts, not compared; wfs brings it up to date at the next mount\n", names[d],
+               (unsigned long long) (newest - disk->events));
+        stale[d] = 1;
+    }
+    if (stale[0]) {
+        int d = 1;
+        while (stale[d]) {
+            d++;
+        }
+        char *disk = disks[0], *name = names[0];
+        disks[0] = disks[d];
+        names[0] = names[d];
+        disks[d] = disk;
+        names[d] = name;
+        stale[0] = 0;
+        stale[d] = 1;
+    }
+    if (dirty) {
+        printf("%s: not unmounted cleanly, wfs recovers the regions last written at the next mount\n", names[0]);
+    }
+    return 0;
+}
+
+// Check the superblock on disk 0 describes a layout that fits the disks. Sets fsSize.
+int checkSuperblock(char **names, off_t diskSize) {
+    if (sb->disk_count != disk_count) {
+        fprintf(stderr, "%s: filesystem has %d disks, %d given\n", names[0], sb->disk_count, disk_count);
+        return -1;
+    }
+    int mode = sb->raid_mode;
+    if (mode != RAID0 && mode != RAID1 && mode != RAID5 && mode != RAID6 && mode != RAID10) {
+        fprintf(stderr, "%s: unknown raid mode %d\n", names[0], mode);
+        return -1;
+    }
+    long regionBlocks = raid_region_blocks(mode, disk_count, sb->num_data_blocks);
+    if (sb->num_inodes == 0 || sb->num_inodes % 8 || sb->num_data_blocks % 8 ||
+        sb->i_bitmap_ptr < sizeof(struct wfs_sb) ||
+        sb->d_bitmap_ptr < sb->i_bitmap_ptr + (off_t) sb->num_inodes / 8 ||
+        sb->i_blocks_ptr < sb->d_bitmap_ptr + (off_t) sb->num_data_blocks / 8 ||
+        sb->d_blocks_ptr < sb->i_blocks_ptr + (off_t) sb->num_inodes * BLOCK_SIZE ||
+        sb->d_blocks_ptr % BLOCK_SIZE ||
+        (sb->wi_bitmap_ptr && sb->wi_bitmap_ptr < sb->d_blocks_ptr + regionBlocks * BLOCK_SIZE) ||
+        (sb->fingerprint_ptr && (!sb->refcount_ptr || sb->num_fingerprints & (sb->num_fingerprints - 1)))) {
+        fprintf(stderr, "%s: superblock describes an impossible layout\n", names[0]);
+        return -1;
+    }
+
+    // The same sizes wfs maps
+    fsSize = sb->d_blocks_ptr + (size_t) BLOCK_SIZE * regionBlocks;
+    if (sb->wi_bitmap_ptr) {
+        fsSize = sb->wi_bitmap_ptr + ((sb->num_data_blocks + WI_REGION - 1) / WI_REGION + 7) / 8;
+    }
+    if (sb->refcount_ptr) {
+        fsSize = sb->refcount_ptr + sb->num_data_blocks * sizeof(uint16_t);
+    }
+    if (sb->fingerprint_ptr) {
+        fsSize = sb->fingerprint_ptr + sb->num_fingerprints * sizeof(struct wfs_fingerprint);
+    }
+    if (fsSize > diskSize) {
+        fprintf(stderr, "%s: disk is smaller than the filesystem\n", names[0]);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    int op;
+    while ((op = getopt(argc, argv, "yt:")) != -1) {
+        switch (op) {
+            case 'y':
+                repair = 1;
+                break;
+            case 't':
+                threadCount = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return FSCK_FAILED;
+        }
+    }
+    if (optind == argc || threadCount < 1) {
+        usage(argv[0]);
+        return FSCK_FAILED;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Map every disk whole; the superblock says how much of it is the filesystem
+    char **names = argv + optind;
+    disk_count = argc - optind;
+    disks = calloc(disk_count, sizeof(char *));
+    stale = calloc(disk_count, 1);
+    diskNames = names;
+    off_t diskSize = 0;
+    for (int d = 0; d < disk_count; d++) {
+        int fd = open(names[d], repair ? O_RDWR : O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(names[d]);
+            return FSCK_FAILED;
+        }
+        if (st.st_size < sizeof(struct wfs_sb)) {
+            fprintf(stderr, "%s: too small to hold a filesystem\n", names[d]);
+            return FSCK_FAILED;
+        }
+        if (d == 0 || st.st_size < diskSize) {
+            diskSize = st.st_size;
+        }
+        disks[d] = mmap(NULL, st.st_size, PROT_READ | (repair ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+        if (disks[d] == MAP_FAILED) {
+            perror("mmap");
+            return FSCK_FAILED;
+        }
+        close(fd);
+    }
+
+    if (orderDisks(names) < 0) {
+        return FSCK_FAILED;
+    }
+    sb = (struct wfs_sb *) disks[0];
+    if (checkSuperblock(names, diskSize) < 0) {
+        return FSCK_FAILED;
+    }
+    iCount = sb->num_inodes;
+    dCount = sb->num_data_blocks;
+    parity = raid_parity(sb->raid_mode);
+    pairs = sb->raid_mode == RAID10 ? disk_count / 2 : 0;
+    inodeMap = disks[0] + sb->i_bitmap_ptr;
+    inodeStart = disks[0] + sb->i_blocks_ptr;
+    dataMap = disks[0] + sb->d_bitmap_ptr;
+    wiMap = sb->wi_bitmap_ptr ? disks[0] + sb->wi_bitmap_ptr : NULL;
+    refCounts = sb->refcount_ptr ? (uint16_t *) (disks[0] + sb->refcount_ptr) : NULL;
+    fingerprints = sb->fingerprint_ptr ? (struct wfs_fingerprint *) (disks[0] + sb->fingerprint_ptr) : NULL;
+    for (int d = 0; d < disk_count; d++) {
+        madvise(disks[d], sb->d_blocks_ptr, MADV_WILLNEED);
+    }
+
+    blockRefs = calloc(dCount, sizeof(unsigned));
+    inodeRefs = calloc(iCount, sizeof(unsigned));
+    subdirs = calloc(iCount, sizeof(unsigned));
+    reached = calloc(iCount, 1);
+    touched = calloc(dCount / 8 + 1, 1);
+    released = calloc(dCount / 8 + 1, 1);
+    if (!blockRefs || !inodeRefs || !subdirs || !reached || !touched || !released) {
+        perror("calloc");
+        return FSCK_FAILED;
+    }
+
+    // Copies are compared before anything is repaired on disk 0
+    int redundant = disk_count > 1 && sb->raid_mode != RAID0;
+    if (redundant) {
+        parallel(checkMetadata, metaSize(), META_GRAIN);
+    }
+
+    parallel(checkInodes, iCount, INODE_GRAIN);
+    checkTree();
+    parallel(checkBlocks, dCount, BLOCK_GRAIN);
+    if (fingerprints) {
+        parallel(checkFingerprints, sb->num_fingerprints, BLOCK_GRAIN);
+    }
+
+    long rows = raid_region_blocks(sb->raid_mode, disk_count, dCount);
+    if (pairs) {
+        parallel(checkPairs, rows, ROW_GRAIN);
+    } else if (parity) {
+        parallel(checkStripes, rows, ROW_GRAIN);
+    } else if (disk_count > 1) {
+        parallel(checkMirrors, dCount, ROW_GRAIN);
+    }
+    if (wiMap && sb->raid_mode != RAID0) {
+        for (long r = 0; r < (dCount + WI_REGION - 1) / WI_REGION; r++) {
+            staleRegions += isBitSet(wiMap, r);
+        }
+    }
+
+    // wfs keeps metadata on every disk, even under RAID 0
+    if (repair && disk_count > 1 && (redundant || metaChanged)) {
+        parallel(copyMetadata, metaSize(), META_GRAIN);
+    }
+    if (repair) {
+        for (int d = 0; d < disk_count; d++) {
+            msync(disks[d], fsSize, MS_SYNC);
+        }
+    }
+
+    long inodes = 0, blocks = 0;
+    for (long i = 0; i < iCount; i++) {
+        inodes += isBitSet(inodeMap, i);
+    }
+    for (long b = 0; b < dCount; b++) {
+        blocks += isBitSet(dataMap, b);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %ld/%ld inodes, %ld/%ld blocks, raid %d over %d disks\n", names[0], inodes, iCount,
+           blocks, dCount, sb->raid_mode, disk_count);
+    if (staleRegions) {
+        printf("%s: %ld regions still to be brought in line by wfs, not compared\n", names[0], staleRegions);
+    }
+    printf("%s: %ld problems, %ld fixed, checked in %.2fs with %d threads\n", names[0], problems, fixes,
+           secs, threadCount);
+
+    return !problems ? FSCK_CLEAN : fixes == problems ? FSCK_FIXED : FSCK_ERRORS;
+}
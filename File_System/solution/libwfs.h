@@ -0,0 +1,22 @@
+#include <fuse.h>
+
+/*
+  The filesystem as a library (libwfs.a). wfs mounts it through FUSE; bench calls
+  the operations directly, in the same process and without the kernel.
+
+  One mount per process: wfs_mount sets up the globals the operations work on.
+  wfs_ops.init starts the background threads and wfs_ops.destroy stops them and
+  writes everything back, as FUSE would call them around a mount.
+*/
+
+extern struct fuse_operations wfs_ops;
+
+// Open the disk images listed first in argv and take the wfs options (see wfs_usage)
+// out of the rest, which are left in args. Returns 0, or nonzero once the reason has
+// been printed.
+int wfs_mount(int argc, char **argv, struct fuse_args *args);
+
+// Unmap and close the disk images
+void wfs_unmount(void);
+
+void wfs_usage(char *name);
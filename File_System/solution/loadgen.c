@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+  Load generator for a mounted filesystem: processes x threads workers doing a mix
+  of create, write, read, stat and unlink on a working set of files, while the
+  parent prints a time series of throughput and latency.
+
+  Each worker owns the files whose index is its number modulo the worker count,
+  and remembers what it last wrote to each, so every read can be checked and
+  nothing depends on how other workers' operations interleave. Contents are a
+  pseudo-random function of the file, its generation and the offset. At the end
+  each worker reads back all of its files, and the parent checks the directory
+  listings against what the workers say exists.
+*/
+
+enum op { OP_CREATE, OP_WRITE, OP_READ, OP_STAT, OP_UNLINK, OP_COUNT };
+static const char *opNames[OP_COUNT] = { "create", "write", "read", "stat", "unlink" };
+
+// Latency bucket b counts operations under 2^b microseconds
+#define LAT_BUCKETS  24
+#define FILES_PER_DIR 64
+
+// Counters of one worker, in memory shared with the parent. Only the worker
+// writes them.
+struct worker_stats {
+    long ops[OP_COUNT];
+    long errors;
+    long corrupt;
+    long latency[LAT_BUCKETS];
+} __attribute__((aligned(64)));
+
+// File states, also shared: what each file's owner believes is on disk
+#define ABSENT  0
+#define PRESENT 1
+#define UNKNOWN 2   // an operation on it failed part way
+
+struct options {
+    int procs, threads;
+    int files;
+    long minSize, maxSize;
+    int logSizes;       // sizes spread evenly over orders of magnitude, not bytes
+    int readPercent;    // of reads and writes
+    int metaPercent;    // of all operations on existing files: stat and unlink
+    int seconds;
+    long opsPerWorker;  // 0: run for seconds
+    double interval;
+    int keep;           // leave the files behind
+    const char *dir;
+} opt = {
+    .procs = 1,
+    .threads = 4,
+    .files = 256,
+    .minSize = 512,
+    .maxSize = 32768,
+    .logSizes = 1,
+    .readPercent = 70,
+    .metaPercent = 20,
+    .seconds = 10,
+    .interval = 1,
+};
+
+struct worker_stats *stats;
+unsigned char *state;
+uint32_t *generation;
+uint32_t *sizes;
+volatile int *stopFlag;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Contents of len bytes of generation gen of file index, starting at off (a
+// multiple of 8)
+void fillPattern(char *buf, size_t len, int index, uint32_t gen, size_t off) {
+    uint64_t seed = mix(((uint64_t) gen << 32) | (uint32_t) index);
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t word = mix(seed + (off + i) / 8);
+        memcpy(buf + i, &word, len - i < 8 ? len - i : 8);
+    }
+}
+
+void filePath(char *path, size_t len, int index) {
+    snprintf(path, len, "%s/lg-d%d/lg-%d", opt.dir, index / FILES_PER_DIR, index);
+}
+
+long pickSize(unsigned int *seed) {
+    double u = rand_r(seed) / (RAND_MAX + 1.0);
+    if (opt.logSizes && opt.minSize > 0) {
+        return (long) exp(log(opt.minSize) + u * (log(opt.maxSize + 1) - log(opt.minSize)));
+    }
+    return opt.minSize + (long) (u * (opt.maxSize - opt.minSize + 1));
+}
+
+// Write the whole file at index with a new generation. O_EXCL on create, so a file
+// that should not exist yet is caught.
+int writeFile(int index, long size, int create, char *buf) {
+    char path[PATH_MAX];
+    filePath(path, sizeof(path), index);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | (create ? O_EXCL : 0), 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    uint32_t gen = generation[index] + 1;
+    fillPattern(buf, size, index, gen, 0);
+    int rc = 0;
+    for (long off = 0; off < size && rc == 0; ) {
+        ssize_t n = write(fd, buf + off, size - off);
+        if (n < 0) {
+            rc = -errno;
+        }
+        off += n > 0 ? n : 0;
+    }
+    if (close(fd) < 0 && rc == 0) {
+        rc = -errno;
+    }
+    if (rc == 0) {
+        generation[index] = gen;
+        sizes[index] = size;
+    }
+    return rc;
+}
+
+// Read the file at index and compare it with what was last written. 1 if it
+// differs, 0 if it matches, or an error.
+int checkFile(int index, char *buf, char *want) {
+    char path[PATH_MAX];
+    filePath(path, sizeof(path), index);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    long size = sizes[index];
+    long got = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + got, size + 1 - got)) > 0 && got < size + 1) {
+        got += n;
+    }
+    int rc = n < 0 ? -errno : 0;
+    close(fd);
+    if (rc < 0) {
+        return rc;
+    }
+    fillPattern(want, size, index, generation[index], 0);
+    return got != size || memcmp(buf, want, size) != 0;
+}
+
+void count(struct worker_stats *s, enum op op, double start, int rc) {
+    long us = (long) ((now() - start) * 1e6);
+    int b = 0;
+    while (b < LAT_BUCKETS - 1 && us >= (1L << b)) {
+        b++;
+    }
+    __atomic_fetch_add(&s->ops[op], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->latency[b], 1, __ATOMIC_RELAXED);
+    if (rc < 0) {
+        __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+    } else if (rc > 0) {
+        __atomic_fetch_add(&s->corrupt, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// After a failed write or unlink the file's contents are anyone's guess: try to
+// get rid of it
+void forget(int index) {
+    char path[PATH_MAX];
+    filePath(path, sizeof(path), index);
+    state[index] = (unlink(path) == 0 || errno == ENOENT) ? ABSENT : UNKNOWN;
+}
+
+struct worker {
+    int id, count;
+    pthread_t thread;
+};
+
+void *workerMain(void *arg) {
+    struct worker *w = arg;
+    struct worker_stats *s = &stats[w->id];
+    unsigned int seed = 1 + w->id;
+    char *buf = malloc(opt.maxSize + 1);
+    char *want = malloc(opt.maxSize + 1);
+    int owned = (opt.files - w->id + w->count - 1) / w->count;
+    if (!buf || !want || owned <= 0) {
+        free(buf);
+        free(want);
+        return NULL;
+    }
+
+    for (long i = 0; !*stopFlag && (!opt.opsPerWorker || i < opt.opsPerWorker); i++) {
+        int index = w->id + (rand_r(&seed) % owned) * w->count;
+        if (state[index] == UNKNOWN) {
+            forget(index);
+            continue;
+        }
+        int roll = rand_r(&seed) % 100;
+        double start = now();
+        int rc;
+        if (state[index] == ABSENT) {
+            rc = writeFile(index, pickSize(&seed), 1, buf);
+            count(s, OP_CREATE, start, rc);
+            if (rc == 0) {
+                state[index] = PRESENT;
+            } else {
+                forget(index);
+            }
+        } else if (roll < opt.metaPercent / 2) {
+            char path[PATH_MAX];
+            struct stat st;
+            filePath(path, sizeof(path), index);
+            rc = stat(path, &st) < 0 ? -errno : st.st_size != sizes[index];
+            count(s, OP_STAT, start, rc);
+        } else if (roll < opt.metaPercent) {
+            char path[PATH_MAX];
+            filePath(path, sizeof(path), index);
+            rc = unlink(path) < 0 ? -errno : 0;
+            count(s, OP_UNLINK, start, rc);
+            if (rc == 0) {
+                state[index] = ABSENT;
+            } else {
+                forget(index);
+            }
+        } else if (rand_r(&seed) % 100 < opt.readPercent) {
+            rc = checkFile(index, buf, want);
+            count(s, OP_READ, start, rc);
+        } else {
+            rc = writeFile(index, pickSize(&seed), 0, buf);
+            count(s, OP_WRITE, start, rc);
+            if (rc < 0) {
+                forget(index);
+            }
+        }
+    }
+
+    // Final pass: everything this worker owns is as it was last left
+    for (int index = w->id; index < opt.files; index += w->count) {
+        char path[PATH_MAX];
+        struct stat st;
+        filePath(path, sizeof(path), index);
+        if (state[index] == PRESENT) {
+            int rc = checkFile(index, buf, want);
+            if (rc != 0) {
+                fprintf(stderr, "loadgen: %s: %s\n", path, rc < 0 ? strerror(-rc) : "contents differ");
+                __atomic_fetch_add(&s->corrupt, 1, __ATOMIC_RELAXED);
+            }
+        } else if (state[index] == ABSENT && stat(path, &st) == 0) {
+            fprintf(stderr, "loadgen: %s: exists after unlink\n", path);
+            __atomic_fetch_add(&s->corrupt, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(buf);
+    free(want);
+    return NULL;
+}
+
+// One process's share of the workers
+int runProcess(int proc) {
+    struct worker workers[opt.threads];
+    int total = opt.procs * opt.threads;
+    for (int t = 0; t < opt.threads; t++) {
+        workers[t].id = proc * opt.threads + t;
+        workers[t].count = total;
+        if (pthread_create(&workers[t].thread, NULL, workerMain, &workers[t]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (int t = 0; t < opt.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    return 0;
+}
+
+void sumStats(struct worker_stats *sum) {
+    memset(sum, 0, sizeof(*sum));
+    for (int w = 0; w < opt.procs * opt.threads; w++) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            sum->ops[op] += __atomic_load_n(&stats[w].ops[op], __ATOMIC_RELAXED);
+        }
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            sum->latency[b] += __atomic_load_n(&stats[w].latency[b], __ATOMIC_RELAXED);
+        }
+        sum->errors += __atomic_load_n(&stats[w].errors, __ATOMIC_RELAXED);
+        sum->corrupt += __atomic_load_n(&stats[w].corrupt, __ATOMIC_RELAXED);
+    }
+}
+
+// Upper bound in microseconds of the bucket holding the p-th percentile
+long percentile(long *latency, long total, int p) {
+    long seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += latency[b];
+        if (total && seen * 100 >= total * p) {
+            return 1L << b;
+        }
+    }
+    return 0;
+}
+
+// One line of the time series, for the operations between prev and cur
+void report(double t, double secs, struct worker_stats *prev, struct worker_stats *cur) {
+    long ops = 0;
+    long latency[LAT_BUCKETS];
+    for (int op = 0; op < OP_COUNT; op++) {
+        ops += cur->ops[op] - prev->ops[op];
+    }
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        latency[b] = cur->latency[b] - prev->latency[b];
+    }
+    printf("%.1f,%ld,%.0f,%ld,%ld", t, ops, secs > 0 ? ops / secs : 0.0,
+           percentile(latency, ops, 50), percentile(latency, ops, 99));
+    for (int op = 0; op < OP_COUNT; op++) {
+        printf(",%ld", cur->ops[op] - prev->ops[op]);
+    }
+    printf(",%ld,%ld\n", cur->errors - prev->errors, cur->corrupt - prev->corrupt);
+    fflush(stdout);
+}
+
+// Every file the workers say exists is listed, and no other
+int checkListings() {
+    int bad = 0;
+    int dirs = (opt.files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    char *listed = calloc(opt.files, 1);
+    if (!listed) {
+        return 1;
+    }
+    for (int d = 0; d < dirs; d++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/lg-d%d", opt.dir, d);
+        DIR *dir = opendir(path);
+        if (!dir) {
+            fprintf(stderr, "loadgen: %s: %s\n", path, strerror(errno));
+            bad++;
+            continue;
+        }
+        struct dirent *e;
+        while ((e = readdir(dir))) {
+            int index;
+            if (sscanf(e->d_name, "lg-%d", &index) == 1 && index >= 0 && index < opt.files) {
+                if (listed[index]++) {
+                    fprintf(stderr, "loadgen: %s listed twice\n", e->d_name);
+                    bad++;
+                }
+            }
+        }
+        closedir(dir);
+    }
+    for (int i = 0; i < opt.files; i++) {
+        if (state[i] != UNKNOWN && listed[i] != (state[i] == PRESENT)) {
+            fprintf(stderr, "loadgen: lg-%d %s\n", i, listed[i] ? "listed but unlinked" : "missing from its directory");
+            bad++;
+        }
+    }
+    free(listed);
+    return bad;
+}
+
+void cleanup() {
+    int dirs = (opt.files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    char path[PATH_MAX];
+    for (int i = 0; i < opt.files; i++) {
+        if (state[i] != ABSENT) {
+            filePath(path, sizeof(path), i);
+            unlink(path);
+        }
+    }
+    for (int d = 0; d < dirs; d++) {
+        snprintf(path, sizeof(path), "%s/lg-d%d", opt.dir, d);
+        rmdir(path);
+    }
+}
+
+void usage(char *name) {
+    printf("Usage: %s [options] dir\n", name);
+    printf("Runs a mix of create, write, read, stat and unlink in dir from many clients and\n");
+    printf("prints a CSV time series of throughput and latency, then checks every file.\n");
+    printf("\t-p procs        processes (default 1)\n");
+    printf("\t-t threads      threads per process (default 4)\n");
+    printf("\t-f files        working set, spread over directories of %d (default 256)\n", FILES_PER_DIR);
+    printf("\t-s min-max      file sizes in bytes (default 512-32768)\n");
+    printf("\t-u              sizes uniform in bytes rather than in orders of magnitude\n");
+    printf("\t-r percent      reads among reads and writes (default 70)\n");
+    printf("\t-m percent      stat and unlink among operations on existing files (default 20)\n");
+    printf("\t-d seconds      run time (default 10)\n");
+    printf("\t-n ops          stop each worker after ops operations instead\n");
+    printf("\t-i seconds      time series interval (default 1)\n");
+    printf("\t-k              keep the files afterwards\n");
+    printf("Exits 1 if any file was found corrupt, missing or left behind.\n");
+}
+
+void *shared(size_t len) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "p:t:f:s:ur:m:d:n:i:kh")) != -1) {
+        switch (c) {
+        case 'p': opt.procs = atoi(optarg); break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'f': opt.files = atoi(optarg); break;
+        case 's':
+            if (sscanf(optarg, "%ld-%ld", &opt.minSize, &opt.maxSize) != 2) {
+                opt.minSize = -1;
+            }
+            break;
+        case 'u': opt.logSizes = 0; break;
+        case 'r': opt.readPercent = atoi(optarg); break;
+        case 'm': opt.metaPercent = atoi(optarg); break;
+        case 'd': opt.seconds = atoi(optarg); break;
+        case 'n': opt.opsPerWorker = atol(optarg); break;
+        case 'i': opt.interval = atof(optarg); break;
+        case 'k': opt.keep = 1; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || opt.procs < 1 || opt.threads < 1 || opt.files < 1 ||
+        opt.minSize < 0 || opt.maxSize < opt.minSize || opt.interval <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    opt.dir = argv[optind];
+
+    int workers = opt.procs * opt.threads;
+    stats = shared(workers * sizeof(struct worker_stats));
+    state = shared(opt.files);
+    generation = shared(opt.files * sizeof(uint32_t));
+    sizes = shared(opt.files * sizeof(uint32_t));
+    stopFlag = shared(sizeof(int));
+    if (!stats || !state || !generation || !sizes || !stopFlag) {
+        perror("mmap");
+        return 1;
+    }
+
+    for (int d = 0; d < (opt.files + FILES_PER_DIR - 1) / FILES_PER_DIR; d++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/lg-d%d", opt.dir, d);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            perror(path);
+            return 1;
+        }
+    }
+
+    pid_t pids[opt.procs];
+    for (int p = 0; p < opt.procs; p++) {
+        pids[p] = fork();
+        if (pids[p] < 0) {
+            perror("fork");
+            *stopFlag = 1;
+            opt.procs = p;
+            break;
+        }
+        if (pids[p] == 0) {
+            _exit(runProcess(p));
+        }
+    }
+
+    printf("time,ops,ops_per_sec,p50_us,p99_us");
+    for (int op = 0; op < OP_COUNT; op++) {
+        printf(",%s", opNames[op]);
+    }
+    printf(",errors,corrupt\n");
+
+    struct worker_stats prev, cur;
+    memset(&prev, 0, sizeof(prev));
+    double start = now(), last = start;
+    int running = opt.procs;
+    while (running > 0) {
+        usleep((useconds_t) (opt.interval * 1e6));
+        double t = now();
+        if (!opt.opsPerWorker && t - start >= opt.seconds) {
+            *stopFlag = 1;
+        }
+        sumStats(&cur);
+        report(t - start, t - last, &prev, &cur);
+        prev = cur;
+        last = t;
+        while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0) {
+            running--;
+        }
+    }
+
+    // Workers' final checks ran after the last line of the series
+    sumStats(&cur);
+    long total = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        total += cur.ops[op];
+    }
+    double secs = now() - start;
+    int bad = checkListings();
+    printf("# %ld ops in %.1f s, %.0f ops/s, p50 <%ldus, p99 <%ldus, %ld errors, %ld corrupt, %d listing errors\n",
+           total, secs, total / secs, percentile(cur.latency, total, 50), percentile(cur.latency, total, 99),
+           cur.errors, cur.corrupt, bad);
+    if (!opt.keep) {
+        cleanup();
+    }
+    return cur.corrupt || bad ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define MIN_MATCH     4
+#define LAST_LITERALS 5   // the format ends every block with at least this many literals
+#define MF_LIMIT      12  // and no match may start closer than this to the end
+#define MAX_OFFSET    65535
+#define HASH_LOG      12
+
+static unsigned hash4(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Write a length that did not fit in its token nibble
+static unsigned char *putLength(unsigned char *op, int n) {
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = n;
+    return op;
+}
+
+// Emit one sequence: litLen literals from lit, then a match of mlen bytes at offset
+// (mlen 0 for the final, literals-only sequence). Returns NULL if it doesn't fit.
+static unsigned char *putSequence(unsigned char *op, unsigned char *oend,
+                                  const unsigned char *lit, int litLen, int offset, int mlen) {
+    int worst = 1 + litLen / 255 + 1 + litLen + 2 + mlen / 255 + 1;
+    if (worst > oend - op) {
+        return NULL;
+    }
+
+    int ml = mlen ? mlen - MIN_MATCH : 0;
+    *op++ = (litLen >= 15 ? 15 : litLen) << 4 | (ml >= 15 ? 15 : ml);
+    if (litLen >= 15) {
+        op = putLength(op, litLen - 15);
+    }
+    memcpy(op, lit, litLen);
+    op += litLen;
+
+    if (mlen) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (ml >= 15) {
+            op = putLength(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+// Greedy single-pass matcher over a hash of the last position each 4-byte prefix
+// was seen at
+int lz4_compress(const char *src, int len, char *dst, int cap) {
+    const unsigned char *in = (const unsigned char *) src;
+    const unsigned char *end = in + len;
+    const unsigned char *anchor = in;
+    unsigned char *op = (unsigned char *) dst;
+    unsigned char *oend = op + cap;
+
+    int table[1 << HASH_LOG];
+    memset(table, 0xff, sizeof table);
+
+    if (len > MF_LIMIT) {
+        const unsigned char *ip = in;
+        const unsigned char *mfLimit = end - MF_LIMIT;
+        const unsigned char *matchLimit = end - LAST_LITERALS;
+        while (ip < mfLimit) {
+            unsigned h = hash4(ip);
+            int ref = table[h];
+            table[h] = ip - in;
+            if (ref < 0 || (ip - in) - ref > MAX_OFFSET || memcmp(in + ref, ip, MIN_MATCH) != 0) {
+                ip++;
+                continue;
+            }
+
+            const unsigned char *match = in + ref;
+            while (ip > anchor && match > in && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+            int mlen = MIN_MATCH;
+            while (ip + mlen < matchLimit && ip[mlen] == match[mlen]) {
+                mlen++;
+            }
+
+            op = putSequence(op, oend, anchor, ip - anchor, ip - match, mlen);
+            if (!op) {
+                return 0;
+            }
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+
+    op = putSequence(op, oend, anchor, end - anchor, 0, 0);
+    if (!op) {
+        return 0;
+    }
+    return op - (unsigned char *) dst;
+}
+
+// Read a length continued past its token nibble. Returns -1 on running out of input.
+static int getLength(const unsigned char **ipp, const unsigned char *iend, int n) {
+    const unsigned char *ip = *ipp;
+    unsigned char b;
+    do {
+        if (ip >= iend) {
+            return -1;
+        }
+        b = *ip++;
+        n += b;
+    } while (b == 255);
+    *ipp = ip;
+    return n;
+}
+
+// Every length and offset is checked, since the input comes off the disk images
+int lz4_decompress(const char *src, int len, char *dst, int cap) {
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *iend = ip + len;
+    unsigned char *op = (unsigned char *) dst;
+    unsigned char *oend = op + cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+
+        int litLen = token >> 4;
+        if (litLen == 15 && (litLen = getLength(&ip, iend, litLen)) < 0) {
+            return -1;
+        }
+        if (litLen > iend - ip || litLen > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, litLen);
+        op += litLen;
+        ip += litLen;
+        if (ip == iend) {
+            return op - (unsigned char *) dst;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - (unsigned char *) dst) {
+            return -1;
+        }
+
+        int mlen = token & 15;
+        if (mlen == 15 && (mlen = getLength(&ip, iend, mlen)) < 0) {
+            return -1;
+        }
+        mlen += MIN_MATCH;
+        if (mlen > oend - op) {
+            return -1;
+        }
+        // Byte by byte: a match may overlap the bytes it is producing
+        const unsigned char *match = op - offset;
+        for (int i = 0; i < mlen; i++) {
+            op[i] = match[i];
+        }
+        op += mlen;
+    }
+    return -1;
+}
@@ -0,0 +1,16 @@
+/*
+  LZ4 block format (no frame header), as used for compressed file clusters.
+
+  A block is a run of sequences. Each sequence is a token byte whose high nibble
+  is the literal count and low nibble the match length minus 4 (15 in either means
+  more length bytes follow, each adding up to 255), the literals, then a 2-byte
+  little-endian offset back into the output. The last sequence is literals only.
+*/
+
+// Compress len bytes of src into dst. Returns the compressed size, or 0 if it does
+// not fit in cap bytes.
+int lz4_compress(const char *src, int len, char *dst, int cap);
+
+// Decompress len bytes of src into dst, which has room for cap bytes. Returns the
+// decompressed size, or -1 if src is not a valid block or overflows dst.
+int lz4_decompress(const char *src, int len, char *dst, int cap);
@@ -0,0 +1,15 @@
+#define FUSE_USE_VERSION 30
+#include "libwfs.h"
+
+int main(int argc, char **argv) {
+    struct fuse_args args;
+    int rc = wfs_mount(argc, argv, &args);
+    if (rc != 0) {
+        return rc;
+    }
+
+    int result = fuse_main(args.argc, args.argv, &wfs_ops, NULL);
+    fuse_opt_free_args(&args);
+    wfs_unmount();  // Clean up before exiting
+    return result;
+}
@@ -7,18 +7,22 @@
 #include <fcntl.h>
 #include <time.h>
 #include "wfs.h"
+#include "raid.h"
 #include <getopt.h>
+#include <sys/random.h>
 
-int roundup(int num, int factor) {
+off_t roundup(off_t num, off_t factor) {
     return num % factor == 0 ? num : num + (factor - (num % factor));
 }
 
 void usage(char *name) {
     printf("Usage: %s -r <raid mode> -d <disk image file> -d <disk image file> ... -i <inode count> -b <data block count>\n", name);
-    printf("\t-r RAID mode: 0 (striping) or 1 (mirroring)\n");
+    printf("\t-r RAID mode: 0 (striping), 1 (mirroring), 5 (single parity), 6 (double parity) or 10 (striped mirrors)\n");
     printf("\t-d Specifies a disk file (can be used multiple times)\n");
     printf("\t-i Number of inodes in the filesystem (rounded to nearest multiple of 32)\n");
     printf("\t-b Number of data blocks in the filesystem (rounded to nearest multiple of 32)\n");
+    printf("\t-R Keep block reference counts, for copy-on-write clones and snapshots\n");
+    printf("\t-D Deduplicate data blocks (implies -R, adds a fingerprint region)\n");
 }
 
 int main(int argc, char **argv) {
@@ -26,14 +30,15 @@ int main(int argc, char **argv) {
     char *disk_files[10];
     int disk_count = 0;
     int inodeCount = 0, dataCount = 0;
+    int refcounts = 0, dedup = 0;
 
     int op;
-    while ((op = getopt(argc, argv, "r:d:i:b:")) != -1) {
+    while ((op = getopt(argc, argv, "r:d:i:b:RD")) != -1) {
         switch (op) {
             case 'r':
                 raid_mode = atoi(optarg);
-                if (raid_mode != 0 && raid_mode != 1) {
-                    fprintf(stderr, "Invalid RAID mode. Use 0 (striping) or 1 (mirroring).\n");
+                if (raid_mode != RAID0 && raid_mode != RAID1 && raid_mode != RAID5 && raid_mode != RAID6 && raid_mode != RAID10) {
+                    fprintf(stderr, "Invalid RAID mode. Use 0 (striping), 1 (mirroring), 5 or 6 (parity), or 10 (striped mirrors).\n");
                     usage(argv[0]);
                     return 1;
                 }
@@ -51,6 +56,13 @@ int main(int argc, char **argv) {
             case 'b':
                 dataCount = roundup(atoi(optarg), 32);
                 break;
+            case 'R':
+                refcounts = 1;
+                break;
+            case 'D':
+                refcounts = 1;
+                dedup = 1;
+                break;
             default:
                 usage(argv[0]);
                 return 1;
@@ -67,11 +79,43 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // Calculate total size for the filesystem
-    int bitmap_size = inodeCount / 8 + dataCount / 8;
-    int inode_region_size = inodeCount * BLOCK_SIZE;
-    int data_region_size = dataCount * BLOCK_SIZE;
-    int fs_size = sizeof(struct wfs_sb) + bitmap_size + inode_region_size + data_region_size;
+    // Parity needs at least two data blocks per stripe to be cheaper than mirroring
+    int parity = raid_parity(raid_mode);
+    if (parity && disk_count < parity + 2) {
+        fprintf(stderr, "RAID %d requires at least %d disks.\n", raid_mode, parity + 2);
+        return 1;
+    }
+    if (raid_mode == RAID10 && (disk_count < 4 || disk_count % 2)) {
+        fprintf(stderr, "RAID 10 requires an even number of disks, at least four.\n");
+        return 1;
+    }
+    int striped = parity || raid_mode == RAID10;
+
+    // Lay out the regions and calculate total size for the filesystem
+    // off_t throughout: multi-gigabyte images overflow an int
+    off_t i_bitmap_ptr = sizeof(struct wfs_sb);
+    off_t d_bitmap_ptr = i_bitmap_ptr + inodeCount / 8;
+    off_t i_blocks_ptr = roundup(d_bitmap_ptr + dataCount / 8, BLOCK_SIZE);
+    off_t d_blocks_ptr = roundup(i_blocks_ptr + (off_t) inodeCount * BLOCK_SIZE, BLOCK_SIZE);
+    off_t wi_bitmap_ptr = d_blocks_ptr + (off_t) raid_region_blocks(raid_mode, disk_count, dataCount) * BLOCK_SIZE;
+    off_t wi_bitmap_size = ((dataCount + WI_REGION - 1) / WI_REGION + 7) / 8;
+    off_t fs_size = wi_bitmap_ptr + roundup(wi_bitmap_size, BLOCK_SIZE);
+
+    off_t refcount_ptr = 0, fingerprint_ptr = 0;
+    long fingerprintCount = 0;
+    if (refcounts) {
+        refcount_ptr = fs_size;
+        fs_size = refcount_ptr + roundup(dataCount * sizeof(uint16_t), BLOCK_SIZE);
+    }
+    // The fingerprint table is kept at most half full
+    if (dedup) {
+        fingerprint_ptr = fs_size;
+        fingerprintCount = 1;
+        while (fingerprintCount < 2L * dataCount) {
+            fingerprintCount *= 2;
+        }
+        fs_size = fingerprint_ptr + roundup(fingerprintCount * sizeof(struct wfs_fingerprint), BLOCK_SIZE);
+    }
 
     // Calculate total available disk space
     long long total_disk_space = 0;
@@ -86,7 +130,7 @@ int main(int argc, char **argv) {
 
     // Check if enough space is available
     if ((raid_mode == 0 && fs_size > (total_disk_space / disk_count)) ||  // RAID 0
-        (raid_mode == 1 && fs_size > st.st_size)) {                      // RAID 1
+        (raid_mode != 0 && fs_size > st.st_size)) {                      // every other mode
         fprintf(stderr, "Requested blocks and inodes exceed available disk space.\n");
         return -1; // Fail with correct exit code
     }
@@ -112,12 +156,25 @@ int main(int argc, char **argv) {
     struct wfs_sb *superBlock = (struct wfs_sb *) mapped[0];
     superBlock->num_inodes = inodeCount;
     superBlock->num_data_blocks = dataCount;
-    superBlock->i_bitmap_ptr = sizeof(struct wfs_sb);
-    superBlock->d_bitmap_ptr = superBlock->i_bitmap_ptr + inodeCount / 8;
-    superBlock->i_blocks_ptr = roundup(superBlock->d_bitmap_ptr + dataCount / 8, BLOCK_SIZE);
-    superBlock->d_blocks_ptr = roundup(superBlock->i_blocks_ptr + inodeCount * BLOCK_SIZE, BLOCK_SIZE);
+    superBlock->i_bitmap_ptr = i_bitmap_ptr;
+    superBlock->d_bitmap_ptr = d_bitmap_ptr;
+    superBlock->i_blocks_ptr = i_blocks_ptr;
+    superBlock->d_blocks_ptr = d_blocks_ptr;
     superBlock->raid_mode = raid_mode; 
     superBlock->disk_count = disk_count; 
+    superBlock->wi_bitmap_ptr = wi_bitmap_ptr;  // starts clean: every mirror is in sync
+    superBlock->refcount_ptr = refcount_ptr;    // both regions start out empty
+    superBlock->fingerprint_ptr = fingerprint_ptr;
+    superBlock->num_fingerprints = fingerprintCount;
+    superBlock->magic = WFS_MAGIC;
+    superBlock->version = WFS_VERSION;
+    superBlock->state = WFS_CLEAN;
+    if (getrandom(superBlock->uuid, sizeof(superBlock->uuid), 0) != sizeof(superBlock->uuid)) {
+        perror("getrandom");
+        return 1;
+    }
+    superBlock->uuid[6] = (superBlock->uuid[6] & 0x0f) | 0x40;  // a version 4 (random) UUID
+    superBlock->uuid[8] = (superBlock->uuid[8] & 0x3f) | 0x80;
 
     // Allocate root inode
     char *i_map = (char *) mapped[0] + superBlock->i_bitmap_ptr;
@@ -139,7 +196,27 @@ int main(int argc, char **argv) {
 
     // Mirror metadata for both RAID 1 and RAID 0 (metadata is always mirrored)
     for (int i = 1; i < disk_count; i++) {
-        memcpy(mapped[i], mapped[0], fs_size); // Copy the entire filesystem region
+        memcpy(mapped[i], mapped[0], striped ? d_blocks_ptr : fs_size); // Everything, or up to the striped data
+        ((struct wfs_sb *) mapped[i])->disk_index = i;
+    }
+
+    // Under RAID 10 the root directory block is row 0 of the first pair
+    if (raid_mode == RAID10) {
+        memcpy((char *) mapped[1] + d_blocks_ptr, root_dir, BLOCK_SIZE);
+    }
+
+    // Under parity the root directory block is the first data block of stripe 0. The
+    // other data blocks are zero, so P is a copy of it, and so is Q (coefficient 2^0).
+    if (parity) {
+        int rootDisk = raid_data_disk(disk_count, parity, 0, 0);
+        if (rootDisk != 0) {
+            memcpy((char *) mapped[rootDisk] + d_blocks_ptr, root_dir, BLOCK_SIZE);
+            memset(root_dir, 0, BLOCK_SIZE);
+        }
+        memcpy((char *) mapped[raid_p_disk(disk_count, 0)] + d_blocks_ptr, (char *) mapped[rootDisk] + d_blocks_ptr, BLOCK_SIZE);
+        if (parity == 2) {
+            memcpy((char *) mapped[raid_q_disk(disk_count, 0)] + d_blocks_ptr, (char *) mapped[rootDisk] + d_blocks_ptr, BLOCK_SIZE);
+        }
     }
 
     // Clean up
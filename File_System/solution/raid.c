@@ -0,0 +1,136 @@
+#include <string.h>
+#include "raid.h"
+
+// The kernels work on 32 bytes at a time with GCC vector extensions. On x86-64 they
+// are also built for AVX2 and the loader picks the best copy for the CPU.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define RAID_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define RAID_KERNEL
+#endif
+
+typedef unsigned long long raid_vec __attribute__((vector_size(32)));
+
+#define BYTES(b) (0x0101010101010101ULL * (b))
+
+// Unaligned loads and stores; macros, since vectors can't cross function boundaries
+// without AVX fixing the calling convention
+#define LOAD(v, src) memcpy(&(v), (src), sizeof(raid_vec))
+#define STORE(dst, v) memcpy((dst), &(v), sizeof(raid_vec))
+
+// Multiply every byte by 2 in GF(2^8): shift left and fold the carried-out bit back
+// in with the low byte of the polynomial
+#define GF_MUL2(v) ((((v) << 1) & BYTES(0xfe)) ^ ((((v) >> 7) & BYTES(0x01)) * 0x1d))
+
+RAID_KERNEL void raid_xor(char *dst, const char *src, size_t len) {
+    for (size_t i = 0; i < len; i += sizeof(raid_vec)) {
+        raid_vec a, b;
+        LOAD(a, dst + i);
+        LOAD(b, src + i);
+        a ^= b;
+        STORE(dst + i, a);
+    }
+}
+
+RAID_KERNEL void raid_gen_p(int ndata, char **data, char *p, size_t len) {
+    for (size_t i = 0; i < len; i += sizeof(raid_vec)) {
+        raid_vec pv, v;
+        LOAD(pv, data[0] + i);
+        for (int d = 1; d < ndata; d++) {
+            LOAD(v, data[d] + i);
+            pv ^= v;
+        }
+        STORE(p + i, pv);
+    }
+}
+
+// Q by Horner's rule from the last data block down, so only multiplies by 2 are needed
+RAID_KERNEL void raid_gen_pq(int ndata, char **data, char *p, char *q, size_t len) {
+    for (size_t i = 0; i < len; i += sizeof(raid_vec)) {
+        raid_vec pv, qv, v;
+        LOAD(pv, data[ndata - 1] + i);
+        qv = pv;
+        for (int d = ndata - 2; d >= 0; d--) {
+            LOAD(v, data[d] + i);
+            pv ^= v;
+            qv = GF_MUL2(qv) ^ v;
+        }
+        STORE(p + i, pv);
+        STORE(q + i, qv);
+    }
+}
+
+static unsigned char gfLog[256];
+
+__attribute__((constructor)) static void gf_init() {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+}
+
+static int isZero(const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int raid5_repair(int ndata, char **data, char *p, size_t len) {
+    char calc[len];
+    raid_gen_p(ndata, data, calc, len);
+    if (memcmp(calc, p, len) == 0) {
+        return 0;
+    }
+    memcpy(p, calc, len);
+    return 1;
+}
+
+int raid6_repair(int ndata, char **data, char *p, char *q, size_t len) {
+    // Syndromes: what the stored parity is off by
+    char sp[len], sq[len];
+    raid_gen_pq(ndata, data, sp, sq, len);
+    raid_xor(sp, p, len);
+    raid_xor(sq, q, len);
+
+    int pOff = !isZero(sp, len), qOff = !isZero(sq, len);
+    if (!pOff && !qOff) {
+        return 0;
+    }
+    if (!qOff) {
+        raid_xor(p, sp, len);
+        return 1;
+    }
+    if (!pOff) {
+        raid_xor(q, sq, len);
+        return 1;
+    }
+
+    // Data block z off by E leaves sp = E and sq = 2^z * E in every byte E touches
+    int z = -1;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char a = sp[i], b = sq[i];
+        if (!a && !b) {
+            continue;
+        }
+        if (!a || !b) {
+            return -1;
+        }
+        int zi = (gfLog[b] - gfLog[a] + 255) % 255;
+        if (z >= 0 && zi != z) {
+            return -1;
+        }
+        z = zi;
+    }
+    if (z >= ndata) {
+        return -1;
+    }
+    raid_xor(data[z], sp, len);
+    return 1;
+}
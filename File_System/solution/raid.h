@@ -0,0 +1,63 @@
+#include <stddef.h>
+
+/*
+  Parity RAID layout (raid_mode 5 and 6).
+
+  Data blocks are striped one block per disk. Stripe s holds disk_count - parity
+  consecutive logical data blocks plus their parity, all at the same offset
+  (d_blocks_ptr + s * BLOCK_SIZE) on every disk. Parity rotates left-symmetric:
+  P sits on disk (disk_count - 1 - s % disk_count), Q on the disk after it, and
+  the data blocks follow on the disks after that, wrapping around.
+
+  Q is the Reed-Solomon syndrome over GF(2^8) with generator 2 and polynomial
+  0x11d, as in Linux md: Q = sum of 2^i * D_i.
+*/
+
+#define RAID0  (0)
+#define RAID1  (1)
+#define RAID5  (5)
+#define RAID6  (6)
+#define RAID10 (10)  /* striped over mirror pairs: data block i on disks 2p, 2p + 1, p = i % pairs */
+
+// Parity blocks per stripe for a raid mode, 0 for the mirrored modes
+static inline int raid_parity(int raid_mode) {
+    return raid_mode == RAID5 ? 1 : raid_mode == RAID6 ? 2 : 0;
+}
+
+// Blocks each disk's data region needs to hold `blocks` logical data blocks. RAID 0
+// and 1 keep every block on every disk.
+static inline long raid_region_blocks(int raid_mode, int disks, long blocks) {
+    if (raid_mode == RAID10) {
+        return (blocks + disks / 2 - 1) / (disks / 2);
+    }
+    int parity = raid_parity(raid_mode);
+    if (!parity) {
+        return blocks;
+    }
+    return (blocks + disks - parity - 1) / (disks - parity);
+}
+
+static inline int raid_p_disk(int disks, long stripe) {
+    return disks - 1 - stripe % disks;
+}
+
+static inline int raid_q_disk(int disks, long stripe) {
+    return (raid_p_disk(disks, stripe) + 1) % disks;
+}
+
+// Disk holding data block i (0-based within the stripe)
+static inline int raid_data_disk(int disks, int parity, long stripe, int i) {
+    return (raid_p_disk(disks, stripe) + parity + i) % disks;
+}
+
+// Parity kernels over len bytes (raid.c). len must be a multiple of 32.
+void raid_xor(char *dst, const char *src, size_t len);
+void raid_gen_p(int ndata, char **data, char *p, size_t len);
+void raid_gen_pq(int ndata, char **data, char *p, char *q, size_t len);
+
+// Check a stripe against its parity and fix what can be fixed. RAID 5 can only tell
+// that something is wrong, so it rewrites P from the data. RAID 6 finds the single bad
+// member from the P and Q syndromes and repairs it. Returns the number of members
+// rewritten (0 or 1), or -1 if the damage can't be pinned on one member.
+int raid5_repair(int ndata, char **data, char *p, size_t len);
+int raid6_repair(int ndata, char **data, char *p, char *q, size_t len);
@@ -0,0 +1,145 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+#include "trace.h"
+
+__thread struct thread_stats *threadStats;
+
+static struct thread_stats *allStats = NULL;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t exitKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static struct thread_stats spare;
+static int spareListed = 0;
+
+static const char *opNames[OP_COUNT] = {
+    "getattr", "mknod", "mkdir", "unlink", "rmdir", "rename", "read", "write",
+    "truncate", "open", "flush", "fsync", "ioctl", "readdir",
+};
+
+// Runs as a thread exits: its counters stay in the list for the next thread
+static void threadExit(void *arg) {
+    struct thread_stats *t = arg;
+    pthread_mutex_lock(&statsLock);
+    t->idle = 1;
+    pthread_mutex_unlock(&statsLock);
+}
+
+static void makeKey(void) {
+    pthread_key_create(&exitKey, threadExit);
+}
+
+struct thread_stats *stats_register(void) {
+    pthread_once(&keyOnce, makeKey);
+    pthread_mutex_lock(&statsLock);
+    struct thread_stats *t = allStats;
+    while (t && !t->idle) {
+        t = t->next;
+    }
+    if (t) {
+        t->idle = 0;
+    } else if ((t = calloc(1, sizeof(*t)))) {
+        t->next = allStats;
+        allStats = t;
+    } else {
+        // Out of memory: such threads share one copy, and count racily
+        t = &spare;
+        if (!spareListed) {
+            t->next = allStats;
+            allStats = t;
+            spareListed = 1;
+        }
+    }
+    pthread_mutex_unlock(&statsLock);
+    pthread_setspecific(exitKey, t);
+    threadStats = t;
+    return t;
+}
+
+long long stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int stats_op(enum wfs_op op, long long start, int rc) {
+    struct thread_stats *t = stats();
+    long long ns = stats_clock() - start;
+    long long us = ns / 1000;
+    int b = 0;
+    while (b < LAT_BUCKETS - 1 && us >= (1LL << b)) {
+        b++;
+    }
+    t->calls[op]++;
+    t->errors[op] += rc < 0;
+    t->nanos[op] += ns;
+    t->latency[op][b]++;
+    trace_end(op, start, ns, rc);
+    return rc;
+}
+
+const char *stats_op_name(int op) {
+    return op >= 0 && op < OP_COUNT ? opNames[op] : "?";
+}
+
+void stats_sum(struct thread_stats *sum) {
+    memset(sum, 0, sizeof(*sum));
+    pthread_mutex_lock(&statsLock);
+    for (struct thread_stats *t = allStats; t; t = t->next) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            sum->calls[op] += t->calls[op];
+            sum->errors[op] += t->errors[op];
+            sum->nanos[op] += t->nanos[op];
+            for (int b = 0; b < LAT_BUCKETS; b++) {
+                sum->latency[op][b] += t->latency[op][b];
+            }
+        }
+        for (int d = 0; d < STATS_DISKS; d++) {
+            sum->disks[d].read += t->disks[d].read;
+            sum->disks[d].written += t->disks[d].written;
+            sum->disks[d].replicated += t->disks[d].replicated;
+        }
+        sum->lookups += t->lookups;
+        sum->lookupDepth += t->lookupDepth;
+        sum->lookupMax = t->lookupMax > sum->lookupMax ? t->lookupMax : sum->lookupMax;
+        sum->allocs += t->allocs;
+        sum->allocScanned += t->allocScanned;
+        sum->allocMax = t->allocMax > sum->allocMax ? t->allocMax : sum->allocMax;
+        sum->repairs += t->repairs;
+    }
+    pthread_mutex_unlock(&statsLock);
+}
+
+// Operations are listed with their latency histogram as "<Nus:count" for each
+// bucket that is not empty
+void stats_write(FILE *f, int disks) {
+    struct thread_stats sum;
+    stats_sum(&sum);
+
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (!sum.calls[op]) {
+            continue;
+        }
+        fprintf(f, "op %-8s %ld calls, %ld errors, %lld us total:", opNames[op], sum.calls[op],
+                sum.errors[op], sum.nanos[op] / 1000);
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            if (sum.latency[op][b]) {
+                if (b == LAT_BUCKETS - 1) {
+                    fprintf(f, " >=%lldus:%ld", 1LL << (b - 1), sum.latency[op][b]);
+                } else {
+                    fprintf(f, " <%lldus:%ld", 1LL << b, sum.latency[op][b]);
+                }
+            }
+        }
+        fprintf(f, "\n");
+    }
+    for (int d = 0; d < disks && d < STATS_DISKS; d++) {
+        fprintf(f, "disk %d %lld bytes read, %lld written, %lld replicated\n", d,
+                sum.disks[d].read, sum.disks[d].written, sum.disks[d].replicated);
+    }
+    fprintf(f, "lookup %ld paths, %ld components, deepest %ld\n", sum.lookups, sum.lookupDepth, sum.lookupMax);
+    fprintf(f, "alloc %ld allocations, %ld bits scanned, longest scan %ld\n", sum.allocs, sum.allocScanned, sum.allocMax);
+    fprintf(f, "repair %ld\n", sum.repairs);
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+
+/*
+  Operation counters, read through STATS_FILE (see wfs.h) while mounted.
+
+  Each thread that touches a counter gets its own struct thread_stats, so counting
+  is a plain increment with no lock or shared cache line. Readers add up every
+  thread's copy. A thread's copy outlives it and is handed to the next new thread,
+  so nothing counted is lost.
+*/
+
+enum wfs_op {
+    OP_GETATTR, OP_MKNOD, OP_MKDIR, OP_UNLINK, OP_RMDIR, OP_RENAME, OP_READ, OP_WRITE,
+    OP_TRUNCATE, OP_OPEN, OP_FLUSH, OP_FSYNC, OP_IOCTL, OP_READDIR, OP_COUNT
+};
+
+// Latency bucket b counts operations that took under 2^b microseconds; the last
+// one also takes everything slower
+#define LAT_BUCKETS 24
+#define STATS_DISKS 16
+
+struct disk_counters {
+    long long read;           // file data served from this disk
+    long long written;        // data blocks committed to it
+    long long replicated;     // copies and parity written to keep it redundant
+};
+
+struct thread_stats {
+    long calls[OP_COUNT];
+    long errors[OP_COUNT];
+    long long nanos[OP_COUNT];
+    long latency[OP_COUNT][LAT_BUCKETS];
+    struct disk_counters disks[STATS_DISKS];
+    long lookups, lookupDepth, lookupMax;     // path components walked
+    long allocs, allocScanned, allocMax;      // bitmap bits scanned per allocation
+    long repairs;                             // replicas and stripes repaired
+    struct thread_stats *next;
+    int idle;                                 // its thread has exited
+};
+
+extern __thread struct thread_stats *threadStats;
+struct thread_stats *stats_register(void);
+
+// This thread's counters
+static inline struct thread_stats *stats(void) {
+    return threadStats ? threadStats : stats_register();
+}
+
+// Timestamp for stats_op, in nanoseconds
+long long stats_clock(void);
+
+// Count an operation that started at start and returned rc. Returns rc.
+int stats_op(enum wfs_op op, long long start, int rc);
+
+// The operation's name, as in the stats file
+const char *stats_op_name(int op);
+
+// Every thread's counters added up
+void stats_sum(struct thread_stats *sum);
+
+// Write the counters as text, one line per operation and disk
+void stats_write(FILE *f, int disks);
@@ -0,0 +1,252 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "stats.h"
+#include "trace.h"
+
+int traceOn = 0;
+
+// A thread's ring. Only its thread writes events and head; only the writer thread
+// reads them, and moves drained along.
+struct trace_ring {
+    struct trace_event events[TRACE_EVENTS];
+    _Atomic uint64_t head;              // events ever recorded
+    uint64_t drained;                   // events written to FILE or counted lost
+    struct trace_event cur;             // the operation in progress
+    long long diskBytes[STATS_DISKS];   // this thread's disk counters when it began
+    int active;
+    uint32_t tid;
+    struct trace_ring *next;
+    int idle;                           // its thread has exited
+};
+
+static __thread struct trace_ring *threadRing;
+static struct trace_ring *allRings = NULL;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t exitKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+
+static FILE *traceFile = NULL;
+static int traceStream = 0;
+static sem_t traceWake;
+static pthread_t writerThread;
+static int writerRunning = 0;
+static volatile int writerStop = 0;
+
+// Runs as a thread exits: its ring is handed to the next new thread, and what it
+// recorded is still drained
+static void threadExit(void *arg) {
+    struct trace_ring *r = arg;
+    pthread_mutex_lock(&ringsLock);
+    r->idle = 1;
+    pthread_mutex_unlock(&ringsLock);
+}
+
+static void makeKey(void) {
+    pthread_key_create(&exitKey, threadExit);
+}
+
+// This thread's ring, or NULL if there is no memory for one
+static struct trace_ring *ring(void) {
+    if (threadRing) {
+        return threadRing;
+    }
+    pthread_once(&keyOnce, makeKey);
+    pthread_mutex_lock(&ringsLock);
+    struct trace_ring *r = allRings;
+    while (r && !r->idle) {
+        r = r->next;
+    }
+    if (r) {
+        r->idle = 0;
+    } else if ((r = calloc(1, sizeof(*r)))) {
+        r->next = allRings;
+        allRings = r;
+    }
+    pthread_mutex_unlock(&ringsLock);
+    if (r) {
+        r->tid = syscall(SYS_gettid);
+        pthread_setspecific(exitKey, r);
+        threadRing = r;
+    }
+    return r;
+}
+
+// Bytes this thread has moved to or from disk d
+static long long diskBytes(struct thread_stats *st, int d) {
+    return st->disks[d].read + st->disks[d].written + st->disks[d].replicated;
+}
+
+void trace_begin_op(const char *path, off_t offset, size_t size) {
+    struct trace_ring *r = ring();
+    if (!r) {
+        return;
+    }
+    struct thread_stats *st = stats();
+    memset(&r->cur, 0, sizeof(r->cur));
+    r->cur.offset = offset;
+    r->cur.size = size;
+    r->cur.inode = -1;
+    if (path) {
+        size_t len = strlen(path);
+        const char *tail = len < TRACE_PATH ? path : path + len - (TRACE_PATH - 1);
+        strcpy(r->cur.path, tail);
+    }
+    for (int d = 0; d < STATS_DISKS; d++) {
+        r->diskBytes[d] = diskBytes(st, d);
+    }
+    r->active = 1;
+}
+
+void trace_inode_op(int inode) {
+    if (threadRing && threadRing->active) {
+        threadRing->cur.inode = inode;
+    }
+}
+
+void trace_alloc_op(void) {
+    if (threadRing && threadRing->active) {
+        threadRing->cur.allocated++;
+    }
+}
+
+void trace_end_op(int op, long long start, long long ns, int rc) {
+    struct trace_ring *r = threadRing;
+    if (!r || !r->active) {
+        return;
+    }
+    struct thread_stats *st = stats();
+    r->active = 0;
+    r->cur.start = start;
+    r->cur.duration = ns;
+    r->cur.tid = r->tid;
+    r->cur.op = op;
+    r->cur.rc = rc;
+    for (int d = 0; d < STATS_DISKS; d++) {
+        if (diskBytes(st, d) != r->diskBytes[d]) {
+            r->cur.disks |= 1 << d;
+        }
+    }
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    r->events[head % TRACE_EVENTS] = r->cur;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+// Write out what r recorded since the last drain. Events its thread overwrote before
+// or while they were copied are counted in one TRACE_LOST event.
+static void drainRing(struct trace_ring *r, struct trace_event *buf) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t from = r->drained;
+    if (head - from > TRACE_EVENTS) {
+        from = head - TRACE_EVENTS;
+    }
+    for (uint64_t i = from; i < head; i++) {
+        buf[i - from] = r->events[i % TRACE_EVENTS];
+    }
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t now = atomic_load_explicit(&r->head, memory_order_relaxed);
+    // The owner may be writing event now, into the slot of event now - TRACE_EVENTS
+    uint64_t valid = now + 1 > from + TRACE_EVENTS ? now + 1 - TRACE_EVENTS : from;
+    if (valid > head) {
+        valid = head;
+    }
+
+    if (valid > r->drained) {
+        struct trace_event lost = {
+            .start = valid < head ? buf[valid - from].start : stats_clock(),
+            .size = valid - r->drained,
+            .tid = r->tid,
+            .op = TRACE_LOST,
+            .inode = -1,
+        };
+        fwrite(&lost, sizeof(lost), 1, traceFile);
+    }
+    fwrite(buf + (valid - from), sizeof(*buf), head - valid, traceFile);
+    r->drained = head;
+}
+
+static void drainAll(void) {
+    static struct trace_event buf[TRACE_EVENTS];
+    pthread_mutex_lock(&ringsLock);
+    for (struct trace_ring *r = allRings; r; r = r->next) {
+        drainRing(r, buf);
+    }
+    pthread_mutex_unlock(&ringsLock);
+    fflush(traceFile);
+}
+
+static void traceSignal(int signal) {
+    sem_post(&traceWake);
+}
+
+// Drain on every SIGUSR1, and every second when streaming, until stopped
+static void *writerMain(void *arg) {
+    while (!writerStop) {
+        if (traceStream) {
+            struct timespec next;
+            clock_gettime(CLOCK_REALTIME, &next);
+            next.tv_sec++;
+            if (sem_timedwait(&traceWake, &next) < 0 && errno == EINTR) {
+                continue;
+            }
+        } else if (sem_wait(&traceWake) < 0) {
+            continue;
+        }
+        drainAll();
+    }
+    return NULL;
+}
+
+int trace_open(const char *file, int stream) {
+    traceFile = fopen(file, "w");
+    if (!traceFile) {
+        perror(file);
+        return -1;
+    }
+    struct trace_header header = { .version = TRACE_VERSION, .eventSize = sizeof(struct trace_event) };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, traceFile);
+    fflush(traceFile);
+    traceStream = stream;
+    return 0;
+}
+
+void trace_start(void) {
+    if (!traceFile) {
+        return;
+    }
+    sem_init(&traceWake, 0, 0);
+    if (pthread_create(&writerThread, NULL, writerMain, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    writerRunning = 1;
+    signal(SIGUSR1, traceSignal);
+    traceOn = 1;
+}
+
+void trace_stop(void) {
+    if (!traceFile) {
+        return;
+    }
+    traceOn = 0;
+    if (writerRunning) {
+        signal(SIGUSR1, SIG_IGN);
+        writerStop = 1;
+        sem_post(&traceWake);
+        pthread_join(writerThread, NULL);
+        writerRunning = 0;
+        sem_destroy(&traceWake);
+    }
+    drainAll();
+    fclose(traceFile);
+    traceFile = NULL;
+}
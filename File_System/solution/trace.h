@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+  Operation trace, for finding out afterwards what a slow mount was doing
+  (-o trace=FILE, see wfs_usage).
+
+  Every thread records the operations it serves into a ring of its own, holding its
+  last TRACE_EVENTS: the owner writes an event and then publishes it by advancing
+  head, with no lock. A writer thread drains the rings into FILE on SIGUSR1 and at
+  unmount, and with trace_stream every second as well. Events a ring lost to
+  wrapping before it was drained are replaced by one TRACE_LOST event.
+
+  FILE is a struct trace_header followed by struct trace_events as they were drained,
+  so each thread's events are in order but threads are interleaved. wfs-trace
+  decodes it.
+*/
+
+#define TRACE_MAGIC "WFSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_EVENTS 4096   // per thread, a power of two
+#define TRACE_PATH 76
+#define TRACE_LOST 0xffff   // op of the event that stands for lost ones
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t eventSize;       // sizeof(struct trace_event)
+};
+
+struct trace_event {
+    int64_t start;            // ns since some point before the mount (CLOCK_MONOTONIC)
+    int64_t duration;         // ns
+    int64_t offset;           // read and write: where in the file
+    uint64_t size;            // read and write: bytes asked for; TRACE_LOST: events lost
+    uint32_t tid;
+    uint16_t op;              // enum wfs_op, or TRACE_LOST
+    uint16_t disks;           // bit d: disk d was read, written or replicated to
+    int32_t rc;
+    int32_t inode;            // the inode last looked up or allocated, or -1
+    uint32_t allocated;       // data blocks allocated
+    char path[TRACE_PATH];    // the end of the path if it doesn't fit, NUL-terminated
+};
+
+_Static_assert(sizeof(struct trace_event) == 128, "trace_event is written to files");
+
+extern int traceOn;
+
+// Create FILE for the trace, draining every second if stream is set. Returns -1 once
+// the reason has been printed.
+int trace_open(const char *file, int stream);
+
+// Start recording, and the writer thread; SIGUSR1 drains the rings from now on
+void trace_start(void);
+
+// Drain the rings one last time, stop the writer and close FILE
+void trace_stop(void);
+
+// Begin recording an operation on path (NULL if none) of this thread
+void trace_begin_op(const char *path, off_t offset, size_t size);
+
+// Finish it: op started at start (see stats_clock) and returned rc after ns
+void trace_end_op(int op, long long start, long long ns, int rc);
+
+// Note the inode a path resolved to, and data blocks allocated
+void trace_inode_op(int inode);
+void trace_alloc_op(void);
+
+static inline void trace_begin(const char *path, off_t offset, size_t size) {
+    if (traceOn) {
+        trace_begin_op(path, offset, size);
+    }
+}
+
+static inline void trace_end(int op, long long start, long long ns, int rc) {
+    if (traceOn) {
+        trace_end_op(op, start, ns, rc);
+    }
+}
+
+static inline void trace_inode(int inode) {
+    if (traceOn) {
+        trace_inode_op(inode);
+    }
+}
+
+static inline void trace_alloc(void) {
+    if (traceOn) {
+        trace_alloc_op();
+    }
+}
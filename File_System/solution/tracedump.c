@@ -0,0 +1,240 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+#include "trace.h"
+
+/*
+  wfs-trace decodes a trace written by wfs -o trace=FILE (see trace.h). It prints a
+  summary per operation: calls, errors, latency percentiles, bytes asked for, data
+  blocks allocated, and how many operations touched each disk. With -s N it also
+  lists the N slowest operations, and with -c OUT it writes the events as Chrome
+  trace JSON (chrome://tracing, Perfetto), one track per thread.
+*/
+
+struct op_summary {
+    long calls, errors;
+    long long bytes, allocated;
+    long disks[16];
+    long long *durations;
+};
+
+struct trace_event *events;
+long eventCount, lostCount;
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s N] [-c chrome.json] FILE\n", name);
+    fprintf(stderr, "\t-s N      also list the N slowest operations\n");
+    fprintf(stderr, "\t-c OUT    write the events to OUT as Chrome trace JSON\n");
+}
+
+// Read FILE's events into events. Returns -1 once the reason has been printed.
+int load(const char *file) {
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        perror(file);
+        return -1;
+    }
+    struct trace_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION || header.eventSize != sizeof(struct trace_event)) {
+        fprintf(stderr, "Error: %s is not a wfs trace of this version\n", file);
+        fclose(f);
+        return -1;
+    }
+
+    long capacity = 0;
+    struct trace_event e;
+    while (fread(&e, sizeof(e), 1, f) == 1) {
+        if (e.op == TRACE_LOST) {
+            lostCount += e.size;
+            continue;
+        }
+        if (eventCount == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            struct trace_event *grown = realloc(events, capacity * sizeof(*events));
+            if (!grown) {
+                perror("realloc");
+                fclose(f);
+                return -1;
+            }
+            events = grown;
+        }
+        events[eventCount++] = e;
+    }
+    fclose(f);
+    return 0;
+}
+
+int compareDurations(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+int compareSlowest(const void *a, const void *b) {
+    const struct trace_event *x = a, *y = b;
+    return (x->duration < y->duration) - (x->duration > y->duration);
+}
+
+int compareStart(const void *a, const void *b) {
+    const struct trace_event *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+// The duration in us that permille of the n sorted durations are at or under
+double percentile(const long long *sorted, long n, int permille) {
+    long i = (n * permille + 999) / 1000 - 1;
+    return sorted[i] / 1000.0;
+}
+
+int summarize(void) {
+    struct op_summary ops[OP_COUNT];
+    memset(ops, 0, sizeof(ops));
+    for (long i = 0; i < eventCount; i++) {
+        if (events[i].op < OP_COUNT) {
+            ops[events[i].op].calls++;
+        }
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (ops[op].calls && !(ops[op].durations = malloc(ops[op].calls * sizeof(long long)))) {
+            perror("malloc");
+            return -1;
+        }
+        ops[op].calls = 0;
+    }
+    for (long i = 0; i < eventCount; i++) {
+        struct trace_event *e = &events[i];
+        if (e->op >= OP_COUNT) {
+            continue;
+        }
+        struct op_summary *s = &ops[e->op];
+        s->durations[s->calls++] = e->duration;
+        s->errors += e->rc < 0;
+        s->bytes += e->size;
+        s->allocated += e->allocated;
+        for (int d = 0; d < 16; d++) {
+            s->disks[d] += e->disks >> d & 1;
+        }
+    }
+
+    printf("%ld events, %ld lost\n", eventCount, lostCount);
+    printf("%-8s %8s %6s %10s %9s %9s %9s %9s %12s %9s  %s\n", "op", "calls", "errors", "total us",
+           "mean us", "p50 us", "p99 us", "max us", "bytes", "allocated", "disks touched");
+    for (int op = 0; op < OP_COUNT; op++) {
+        struct op_summary *s = &ops[op];
+        if (!s->calls) {
+            continue;
+        }
+        long long total = 0;
+        for (long i = 0; i < s->calls; i++) {
+            total += s->durations[i];
+        }
+        qsort(s->durations, s->calls, sizeof(long long), compareDurations);
+        printf("%-8s %8ld %6ld %10.0f %9.1f %9.1f %9.1f %9.1f %12lld %9lld ", stats_op_name(op), s->calls,
+               s->errors, total / 1000.0, total / 1000.0 / s->calls, percentile(s->durations, s->calls, 500),
+               percentile(s->durations, s->calls, 990), s->durations[s->calls - 1] / 1000.0, s->bytes,
+               s->allocated);
+        for (int d = 0; d < 16; d++) {
+            if (s->disks[d]) {
+                printf(" %d:%ld", d, s->disks[d]);
+            }
+        }
+        printf("\n");
+        free(s->durations);
+    }
+    return 0;
+}
+
+void listSlowest(long n) {
+    struct trace_event *sorted = malloc(eventCount * sizeof(*sorted));
+    if (!sorted) {
+        perror("malloc");
+        return;
+    }
+    memcpy(sorted, events, eventCount * sizeof(*sorted));
+    qsort(sorted, eventCount, sizeof(*sorted), compareSlowest);
+    printf("slowest:\n");
+    for (long i = 0; i < n && i < eventCount; i++) {
+        struct trace_event *e = &sorted[i];
+        printf("%10.1f us %-8s tid %u inode %d offset %lld size %llu rc %d allocated %u %s\n",
+               e->duration / 1000.0, stats_op_name(e->op), e->tid, e->inode, (long long) e->offset,
+               (unsigned long long) e->size, e->rc, e->allocated, e->path);
+    }
+    free(sorted);
+}
+
+// path as the body of a JSON string
+void jsonString(FILE *f, const char *s) {
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+}
+
+// Complete ("X") events, with times in us from the first event
+int writeChrome(const char *file) {
+    FILE *f = fopen(file, "w");
+    if (!f) {
+        perror(file);
+        return -1;
+    }
+    qsort(events, eventCount, sizeof(*events), compareStart);
+    long long origin = eventCount ? events[0].start : 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (long i = 0; i < eventCount; i++) {
+        struct trace_event *e = &events[i];
+        fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"wfs\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"path\":\"", i ? "," : "", stats_op_name(e->op), e->tid,
+                (e->start - origin) / 1000.0, e->duration / 1000.0);
+        jsonString(f, e->path);
+        fprintf(f, "\",\"inode\":%d,\"offset\":%lld,\"size\":%llu,\"rc\":%d,\"allocated\":%u,\"disks\":%u}}",
+                e->inode, (long long) e->offset, (unsigned long long) e->size, e->rc, e->allocated, e->disks);
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        perror(file);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *chrome = NULL;
+    long slowest = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+        switch (opt) {
+        case 's':
+            slowest = atol(optarg);
+            break;
+        case 'c':
+            chrome = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (load(argv[optind]) < 0 || summarize() < 0) {
+        return 1;
+    }
+    if (slowest > 0) {
+        listSlowest(slowest);
+    }
+    if (chrome && writeChrome(chrome) < 0) {
+        return 1;
+    }
+    free(events);
+    return 0;
+}
@@ -1,7 +1,13 @@
 #define FUSE_USE_VERSION 30
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <limits.h>
+#include <linux/fs.h>  // FS_IOC_GETFLAGS and friends
+#undef BLOCK_SIZE         // clashes with wfs.h's, which is the one meant here
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -9,11 +15,40 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include "wfs.h"
+#include "libwfs.h"
+#include "raid.h"
+#include "lz4.h"
+#include "disk.h"
+#include "stats.h"
+#include "trace.h"
 
 #define OK 0
 
+// Blocks the reclaimer punches per hold of fsLock
+#define RECLAIM_BATCH 256
+// Blocks the scrubber checks per hold of fsLock
+#define SCRUB_CHUNK 64
+// Write-intent regions a resync copies per hold of fsLock
+#define SYNC_BATCH 16
+// Decompressed clusters kept for reads
+#define CLUSTER_CACHE 32
+// Files whose writes can be held back at once, and how much of each
+#define WB_BUFFERS 16
+#define WB_SIZE    (32 * BLOCK_SIZE)
+// Files whose reads are followed for readahead, and the first window in blocks
+#define RA_FILES   16
+#define RA_MIN     8
+// Metadata cache pages tracked for write-back, and the huge page size its arena is
+// rounded to
+#define META_PAGE  4096
+#define HUGE_PAGE  (2 << 20)
+
+// Direct blocks plus the pointers that fit in the indirect block
+#define MAX_FILE_BLOCKS (IND_BLOCK + (int)(BLOCK_SIZE / sizeof(off_t)))
+
 // Globals
 int iCount, dCount;
 char *memStart;
@@ -26,6 +61,214 @@ char *dataStart;
 int disk_count = 0;
 int *fds = NULL;
 char **disk_maps = NULL;
+size_t mapSize = 0;     // bytes of each disk's view
+
+// Filesystem lock and deferred block reclaim (see deferFree)
+pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reclaimCond = PTHREAD_COND_INITIALIZER;
+pthread_t reclaimThread;
+int reclaimRunning = 0, reclaimStop = 0;
+char *pendingMap = NULL;
+int *reclaimQueue = NULL;
+int reclaimCount = 0, reclaimCap = 0;
+
+// Background scrubber (see scrubMain). verifiedMap has a bit per data block whose
+// replicas are known to agree since mount.
+struct scrub_stats {
+    long passes;          // completed passes
+    long scanned;         // blocks checked so far in the current pass
+    long total;           // allocated blocks when the current pass started
+    long repaired;        // replicas rewritten, over all passes
+    long long bytesRead;  // over all passes and disks
+    time_t lastPass;      // when the last pass finished
+} scrubStats;
+pthread_cond_t scrubCond;
+pthread_t scrubThread;
+int scrubRunning = 0, scrubStop = 0;
+char *verifiedMap = NULL;
+
+// Mirror resync (see syncMain). wiMap is the write-intent bitmap, in memory only on
+// images without the region. syncDisk is the mirror being brought up to date; it is
+// moved to the end of disk_maps so it is never the disk metadata is served from.
+char *wiMap = NULL;
+int wiRegions = 0, wiOnDisk = 0;
+int syncDisk = -1;
+struct sync_stats {
+    long regions;           // dirty regions when the resync started
+    long done;              // regions copied so far
+    long long bytes;        // bytes copied so far
+    struct timespec start;
+    struct timespec end;    // zero until the resync completes
+} syncStats;
+pthread_t syncThread;
+int syncRunning = 0, syncStop = 0;
+
+// Disk identity (see wfs.h), on images that have it. diskIndex[d] is the position
+// disk d's superblock records, which stops being d once a mirror being synced is
+// moved last. mountEvents is what this mount raised the disks' events to.
+int identity = 0;
+int *diskIndex = NULL;
+uint64_t mountEvents = 0;
+struct mount_stats {
+    int dirty;            // the last unmount wasn't clean
+    int reordered;        // the disks were given out of order
+    int stale;            // disk found to have missed mounts, or -1
+    long recovered;       // regions brought back in line after an unclean shutdown
+    double msecs;         // time wfs_mount took
+} mountStats = { .stale = -1 };
+
+// Parity RAID (see raid.h). failedDisk is a member whose data region can't be
+// trusted, either missing (backed by anonymous memory) or being rebuilt; stripes
+// whose member on it has been reconstructed are marked in rebuiltMap.
+int parity = 0;
+int stripeCount = 0;
+// RAID 10 mirror pairs: disks 2p and 2p + 1
+int pairs = 0;
+int failedDisk = -1;
+char *rebuiltMap = NULL;
+
+// Compressed clusters (see wfs.h) decompressed by recent reads and writes, keyed by
+// the address of the cluster's first block and direct-mapped on it
+struct cluster_cache_entry {
+    off_t key;                // 0 when empty
+    char data[CLUSTER_SIZE];
+} clusterCache[CLUSTER_CACHE];
+struct compress_stats {
+    long long bytesIn;        // cluster bytes stored in FS_COMPR_FL files
+    long long bytesOut;       // block bytes they were stored in
+    long hits, misses;        // cluster cache lookups
+} compressStats;
+
+// Delayed allocation: writes to a file collect in a write-back buffer holding one
+// contiguous byte range, and only get blocks when the buffer is flushed (on close,
+// fsync, a write elsewhere in the file, or eviction). Blocks the buffered data may
+// need are reserved, so the flush can't run out of space.
+struct wb_buffer {
+    int inode;                // -1 when free
+    off_t start, end;         // bytes [start, end) of the file are held here
+    int reserved;             // data blocks set aside for flushing them
+    unsigned long lastUse;    // for evicting the least recently used buffer
+    char data[WB_SIZE];
+} wbBuffers[WB_BUFFERS];
+int wbReserved = 0;           // sum of reserved over all buffers
+int wbFlushing = 0, wbMapDirty = 0;
+unsigned long wbClock = 0;
+struct wb_stats {
+    long buffered;            // writes taken by a buffer
+    long flushes;
+    long long bytes;          // bytes flushed
+} wbStats;
+
+// Readahead: reads of each file are followed, and once they run sequentially the
+// blocks ahead of the reader are hinted to the backend (see disk_willneed), with the
+// window doubling up to -o readahead blocks while the run lasts. Direct-mapped on
+// the inode.
+struct readahead {
+    int inode;                // -1 when free
+    off_t next;               // where a sequential read would start
+    int window;               // blocks to keep hinted ahead, 0 while reads are random
+    off_t ahead;              // hinted up to here
+} readaheads[RA_FILES];
+struct readahead_stats {
+    long streams;             // sequential runs detected
+    long blocks;              // blocks hinted
+} raStats;
+
+// Block groups: the inode bitmap and table and the data bitmap and region are cut
+// into groupCount slices, group g owning inodes [g * groupInodes, (g + 1) * groupInodes)
+// and data blocks [g * groupBlocks, (g + 1) * groupBlocks). Nothing about them is
+// stored; they only steer allocation (see allocInode and dataGoal).
+int groupCount = 1, groupBlocks, groupInodes;
+
+// Shared blocks (mkfs -R, and -D for deduplication, see wfs.h). Both regions live on
+// disk 0's map and are replicated entry by entry. indexedMap has a bit per data block
+// in the fingerprint table, filled in on first use (see indexed).
+uint16_t *refCounts = NULL;
+struct wfs_fingerprint *fingerprints = NULL;
+char *indexedMap = NULL;
+int indexedReady = 0;
+struct dedup_stats {
+    long shared;              // whole-block writes that took a reference instead of a block
+    long copied;              // shared blocks copied before being written
+} dedupStats;
+
+// Metadata cache (-o metacache): the bitmaps and inode table are moved to anonymous
+// memory, on huge pages where the system has them, laid out as on disk from offset
+// 0. The replicate_* calls mark the pages they cover dirty instead of copying, and
+// metaWriteback copies dirty pages to every disk, periodically and on fsync.
+char *metaCache = NULL;
+size_t metaCacheSize = 0;       // bytes of metadata held, d_blocks_ptr
+size_t metaArenaSize = 0;       // rounded up to whole huge pages
+unsigned char *metaDirtyMap = NULL;  // a byte per META_PAGE, set while it differs from the disks
+struct metacache_stats {
+    int hugetlb;              // on reserved huge pages, else transparent ones were asked for
+    long writebacks;          // write-backs that found dirty pages
+    long long bytes;          // written back, over all disks
+} metaStats;
+
+// Background write-back under the pwrite and io_uring backends (see disk.h), which
+// only get changes to the images when written back, and of the metadata cache
+pthread_cond_t writebackCond;
+pthread_t writebackThread;
+int writebackRunning = 0, writebackStop = 0;
+
+// Mount options (-o name=value), see wfs_usage()
+struct wfs_options {
+    int scrubRate;      // KiB/s the scrubber may read over all disks; 0 turns it off
+    int scrubInterval;  // seconds between scrub passes
+    int degraded;       // RAID 1 mounted with one mirror missing
+    int missing;        // RAID 5/6 member (by position) that is absent
+    int resync;         // disk (by position) to bring up to date from the dirty regions
+    int rebuild;        // disk (by position) to copy in full
+    int compress;       // new files and directories get FS_COMPR_FL
+    int nodelalloc;     // write every write to its blocks right away
+    char *backend;      // storage backend name, see disk.h
+    int direct;         // O_DIRECT write-back
+    int writebackInterval;  // seconds between write-backs, without mmap
+    int resident;       // MiB of image pages kept loaded, without mmap; 0 for no limit
+    int readahead;      // largest readahead window in blocks; 0 turns it off
+    int groupBlocks;    // data blocks per block group
+    int metacache;      // keep the bitmaps and inode table in memory, see metaCache
+    char *trace;        // file the operation trace goes to, see trace.h
+    int traceStream;    // drain the trace every second rather than on SIGUSR1
+} options = {
+    .scrubRate = 4096,
+    .writebackInterval = 5,
+    .resident = 256,
+    .readahead = 64,
+    .groupBlocks = 8 * BLOCK_SIZE,  // what one block of bitmap covers, as in ext2
+    .scrubInterval = 24 * 60 * 60,
+    .missing = -1,
+    .resync = -1,
+    .rebuild = -1,
+};
+
+#define WFS_OPT(templ, field) { templ, offsetof(struct wfs_options, field), 1 }
+
+static const struct fuse_opt wfsOpts[] = {
+    WFS_OPT("scrub_rate=%d", scrubRate),
+    WFS_OPT("scrub_interval=%d", scrubInterval),
+    WFS_OPT("degraded", degraded),
+    WFS_OPT("missing=%d", missing),
+    WFS_OPT("resync=%d", resync),
+    WFS_OPT("rebuild=%d", rebuild),
+    WFS_OPT("compress", compress),
+    WFS_OPT("nodelalloc", nodelalloc),
+    WFS_OPT("backend=%s", backend),
+    WFS_OPT("direct", direct),
+    WFS_OPT("writeback_interval=%d", writebackInterval),
+    WFS_OPT("resident=%d", resident),
+    WFS_OPT("readahead=%d", readahead),
+    WFS_OPT("group_blocks=%d", groupBlocks),
+    WFS_OPT("metacache", metacache),
+    WFS_OPT("trace=%s", trace),
+    WFS_OPT("trace_stream", traceStream),
+    FUSE_OPT_END
+};
+
+char *blockPtr(off_t blockAddr);
+char *pairMember(off_t blockAddr, int member);
+off_t dataGoal(struct wfs_inode *inode, int blockIndex);
 
 // Helper function to parse path
 int parsePath (const char* path) {
@@ -34,9 +277,17 @@ int parsePath (const char* path) {
         perror("strdup");
     }
 
+    struct thread_stats *st = stats();
+    long depth = 0;
+    st->lookups++;
+
     char *tok = strtok(dup,"/");
     int iNodeIndex = 0;
     while (tok) {
+        st->lookupDepth++;
+        if (++depth > st->lookupMax) {
+            st->lookupMax = depth;
+        }
         struct wfs_inode *curr = (struct wfs_inode *) (inodeStart + iNodeIndex * BLOCK_SIZE);
         if (!(curr->mode & S_IFDIR)) {
             free(dup);
@@ -46,7 +297,7 @@ int parsePath (const char* path) {
         int found = 0;
         int blockIter = 0;
         while (curr->blocks[blockIter] != 0 && blockIter < IND_BLOCK) {
-            struct wfs_dentry *entries = (struct wfs_dentry*)(memStart + curr->blocks[blockIter]);
+            struct wfs_dentry *entries = (struct wfs_dentry*)blockPtr(curr->blocks[blockIter]);
             int k = -1;
             while (entries->name[0] != 0 && ++k < BLOCK_SIZE / sizeof(struct wfs_dentry)) {
                 if (strcmp(entries->name, tok) == 0) {
@@ -67,23 +318,73 @@ int parsePath (const char* path) {
         tok = strtok(NULL,"/");
     }
     free(dup);
+    trace_inode(iNodeIndex);
     return iNodeIndex;
 }
 
-void debugSignal(int signal) {
-    if (signal == SIGUSR1) {
-        printf("Inode Map: ");
-        for (int i=0; i<sb->num_inodes/8; i++) {
-            printf("%x ", (int) *(inodeMap + i));
+// Counters and state of the mounted filesystem, as served in STATS_FILE
+void writeStats(FILE *f) {
+    fprintf(f, "Scrub: pass %ld, %ld/%ld blocks, %ld repaired, %lld bytes read\n",
+            scrubStats.passes + 1, scrubStats.scanned, scrubStats.total,
+            scrubStats.repaired, scrubStats.bytesRead);
+
+    if (syncStats.regions) {
+        struct timespec now = syncStats.end;
+        if (!now.tv_sec) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
         }
-        printf("\n");
+        double secs = (now.tv_sec - syncStats.start.tv_sec) + (now.tv_nsec - syncStats.start.tv_nsec) / 1e9;
+        fprintf(f, "Resync: %ld/%ld %s, %lld bytes, %.1f MiB/s%s\n",
+                syncStats.done, syncStats.regions, parity ? "stripes" : "regions", syncStats.bytes,
+                secs > 0 ? syncStats.bytes / secs / (1 << 20) : 0.0,
+                syncStats.end.tv_sec ? ", done" : "");
+    }
+
+    if (identity) {
+        fprintf(f, "Mount: %s, %ld regions recovered, %.2f ms%s",
+                mountStats.dirty ? "after an unclean shutdown" : "clean", mountStats.recovered,
+                mountStats.msecs, mountStats.reordered ? ", disks reordered" : "");
+        if (mountStats.stale >= 0) {
+            fprintf(f, ", disk %d was stale", mountStats.stale);
+        }
+        fprintf(f, "\n");
+    }
 
-        printf("Data Map: ");
-        for (int i=0; i<sb->num_data_blocks/8; i++) {
-            printf("%x ", (int) *(dataMap + i));
+    if (metaCache) {
+        long dirty = 0;
+        for (size_t i = 0; i < metaArenaSize / META_PAGE; i++) {
+            dirty += metaDirtyMap[i];
         }
-        printf("\n");
+        fprintf(f, "Metadata cache: %zu bytes on %s huge pages, %ld pages dirty, %ld write-backs of %lld bytes\n",
+                metaCacheSize, metaStats.hugetlb ? "reserved" : "transparent", dirty,
+                metaStats.writebacks, metaStats.bytes);
+    }
+
+    if (fingerprints) {
+        fprintf(f, "Dedup: %ld blocks shared, %ld copied on write\n", dedupStats.shared, dedupStats.copied);
+    }
+
+    if (wbStats.buffered) {
+        fprintf(f, "Write-back: %ld writes buffered, %ld flushes of %lld bytes, %d blocks reserved\n",
+                wbStats.buffered, wbStats.flushes, wbStats.bytes, wbReserved);
     }
+
+    if (raStats.streams) {
+        fprintf(f, "Readahead: %ld sequential runs, %ld blocks hinted\n", raStats.streams, raStats.blocks);
+    }
+
+    if (diskStats.backend != DISK_MMAP) {
+        fprintf(f, "Disk: %s, %ld pages read, %ld dropped, %ld written in %ld write-backs, %ld batches\n",
+                disk_backend_name(diskStats.backend), diskStats.pagesRead, diskStats.pagesDropped,
+                diskStats.pagesWritten, diskStats.writebacks, diskStats.batches);
+    }
+
+    if (compressStats.bytesIn) {
+        fprintf(f, "Compression: %lld bytes stored in %lld, cache %ld hits %ld misses\n",
+                compressStats.bytesIn, compressStats.bytesOut, compressStats.hits, compressStats.misses);
+    }
+
+    stats_write(f, disk_count);
 }
 
 int findAndAllocFromMap (char *bitmap, int len) {
@@ -105,298 +406,1722 @@ void freeBitFromMap(char *bitmap, int index) {
     *byte_off &= ~(1 << bit_off);
 }
 
-// Since metadata must be mirrored in both RAID 0 and RAID 1 if multiple disks, we just check disk_count > 1
-void replicate_dataMap() {
-    if (disk_count > 1) {
-        off_t dataMapOffset = dataMap - memStart;
-        size_t dataMapSize = sb->num_data_blocks / 8;
-        for (int d = 1; d < disk_count; d++) {
-            memcpy(disk_maps[d] + dataMapOffset, memStart + dataMapOffset, dataMapSize);
-        }
-    }
+void setBitInMap(char *bitmap, int index) {
+    *(bitmap + index / 8) |= 1 << (index % 8);
 }
 
-void replicate_block(off_t blockAddr) {
-    if (disk_count > 1) {
-        for (int d = 1; d < disk_count; d++) {
-            memcpy(disk_maps[d] + blockAddr, memStart + blockAddr, BLOCK_SIZE);
+int isBitSet(char *bitmap, int index) {
+    return (*(bitmap + index / 8) >> (index % 8)) & 1;
+}
+
+// Like findAndAllocFromMap, but start at from, wrapping around, and also pass over
+// bits that are set in skip (if not NULL)
+int findAndAllocSkipping(char *bitmap, char *skip, int len, int from) {
+    struct thread_stats *st = stats();
+    int n;
+    int found = -1;
+    for (n=0; n<len; n++) {
+        int i = (from + n) % len;
+        char *byte_off = (bitmap + i/8);
+        int bit_off = i % 8;
+        int bit = ((*byte_off | (skip ? skip[i/8] : 0)) >> bit_off) & 1;
+        if(!bit) {
+            *byte_off |= 1 << bit_off;
+            found = i;
+            n++;
+            break;
         }
     }
+    st->allocs++;
+    st->allocScanned += n;
+    if (n > st->allocMax) {
+        st->allocMax = n;
+    }
+    return found;
 }
 
-void replicate_partial_block(off_t start, size_t len, const char *src) {
-    if (disk_count > 1) {
-        for (int d = 1; d < disk_count; d++) {
-            memcpy(disk_maps[d] + start, src, len);
-        }
+struct cluster_cache_entry *cacheEntry(off_t key) {
+    return &clusterCache[(key / BLOCK_SIZE) % CLUSTER_CACHE];
+}
+
+// Forget the cluster starting at blockAddr, whose blocks are being freed or reused
+void cacheDrop(off_t blockAddr) {
+    struct cluster_cache_entry *entry = cacheEntry(blockAddr);
+    if (entry->key == blockAddr) {
+        entry->key = 0;
     }
 }
 
-void replicate_inode(struct wfs_inode *inode) {
-    if (disk_count > 1) {
-        off_t inodeOff = (char*)inode - memStart;
-        for (int d = 1; d < disk_count; d++) {
-            memcpy(disk_maps[d] + inodeOff, inode, BLOCK_SIZE);
+struct wb_buffer *findBuffer(int inodeIndex) {
+    for (int i = 0; i < WB_BUFFERS; i++) {
+        if (wbBuffers[i].inode == inodeIndex) {
+            return &wbBuffers[i];
         }
     }
+    return NULL;
 }
 
-void parseParentChild (const char* path, char* child, char* parent) {
-    char *copy = strdup(path);
-    if (copy == NULL) {
-        perror("strdup");
-        exit(2);
+// Throw away a file's buffered writes, for a file that is being freed
+void dropBuffer(int inodeIndex) {
+    struct wb_buffer *b = findBuffer(inodeIndex);
+    if (b) {
+        wbReserved -= b->reserved;
+        b->inode = -1;
     }
+}
 
-    int len = strlen(copy);
-    child[0] = '\0';
-    parent[0] = '\0';
+// A file's size counting writes still in its buffer
+off_t fileSize(struct wfs_inode *inode) {
+    struct wb_buffer *b = findBuffer(inode->num);
+    return b && b->end > inode->size ? b->end : inode->size;
+}
 
-    for (int i=len-1; i>=0; i--) {
-        if (copy[i] == '/') {
-            if (i == len - 1) {
-                free(copy);
-                return;
-            }
-            copy[i] = '\0';
-            strncpy(parent, copy, MAX_NAME);
-            strncpy(child, copy + i + 1, MAX_NAME);
-            break;
+void lockFs() {
+    pthread_mutex_lock(&fsLock);
+}
+
+void unlockFs() {
+    pthread_mutex_unlock(&fsLock);
+}
+
+// Hand a freed block to the reclaimer. The bitmap bit is cleared right away; the
+// pendingMap bit keeps the allocator off the block until it has been punched.
+void deferFree(off_t blockAddr) {
+    int index = (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    freeBitFromMap(dataMap, index);
+    freeBitFromMap(verifiedMap, index);
+    setBitInMap(pendingMap, index);
+    cacheDrop(blockAddr);
+
+    if (reclaimCount == reclaimCap) {
+        int cap = reclaimCap ? reclaimCap * 2 : 64;
+        int *grown = realloc(reclaimQueue, cap * sizeof(int));
+        if (!grown) {
+            // Never punched, but the allocator can still take it back once space runs out
+            return;
         }
+        reclaimQueue = grown;
+        reclaimCap = cap;
     }
-    free(copy);
+    reclaimQueue[reclaimCount++] = index;
+    pthread_cond_signal(&reclaimCond);
 }
 
-int handleRemove(const char* path, int isDir) {
-    int inodeIndex = parsePath(path);
-    if (inodeIndex < 0) {
-        return -ENOENT;
-    }
+int compareInts(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
 
-    struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + inodeIndex * BLOCK_SIZE);
-    if (isDir && inode->size > 0) {
-        return -ENOTEMPTY;
+int regionDirty(off_t blockAddr) {
+    return isBitSet(wiMap, (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE / WI_REGION);
+}
+
+// This thread's byte counters for the disk whose view p points into
+struct disk_counters *diskCounters(const char *p) {
+    static __thread struct disk_counters untracked;
+    for (int d = 0; d < disk_count && d < STATS_DISKS; d++) {
+        if (p >= disk_maps[d] && p < disk_maps[d] + mapSize) {
+            return &stats()->disks[d];
+        }
     }
+    return &untracked;
+}
 
-    char curr[MAX_NAME];
-    char parentPath[MAX_NAME];
-    parseParentChild(path, curr, parentPath);
+// memcpy to offset off of disk d, to keep it a copy of disk 0
+void copyToDisk(int d, off_t off, const void *src, size_t len) {
+    memcpy(disk_maps[d] + off, src, len);
+    if (d < STATS_DISKS) {
+        stats()->disks[d].replicated += len;
+    }
+}
 
-    int parentInodeIndex = parsePath(parentPath);
-    if (parentInodeIndex < 0) {
-        return -ENOENT;
+// Copy bytes [first, last] of the write-intent bitmap from disk 0 to the other disks
+void replicate_wiMap(int first, int last) {
+    if (!wiOnDisk) {
+        return;
+    }
+    off_t wiMapOffset = wiMap - memStart;
+    for (int d = 1; d < disk_count; d++) {
+        copyToDisk(d, wiMapOffset + first, wiMap + first, last - first + 1);
     }
+}
 
-    struct wfs_inode *parentInode = (struct wfs_inode *)(inodeStart + parentInodeIndex * BLOCK_SIZE);
+// Record that data in [off, off + len) may differ between the copies: until the next
+// clean unmount (see WFS_DIRTY), and while degraded until the missing mirror is
+// resynced. Only bits that change are replicated.
+void markDirty(off_t off, size_t len) {
+    if (!wiOnDisk || !(identity || options.degraded) || off < sb->d_blocks_ptr) {
+        return;
+    }
+    int first = (off - sb->d_blocks_ptr) / BLOCK_SIZE / WI_REGION;
+    int last = (off + len - 1 - sb->d_blocks_ptr) / BLOCK_SIZE / WI_REGION;
+    int changed = 0;
+    for (int r = first; r <= last; r++) {
+        if (!isBitSet(wiMap, r)) {
+            setBitInMap(wiMap, r);
+            changed = 1;
+        }
+    }
+    if (changed) {
+        replicate_wiMap(first / 8, last / 8);
+    }
+}
 
-    if (isDir) {
-        parentInode->nlinks--;
+// Deallocate [off, off + len) on every image. Falls back to writing zeros when the
+// backing filesystem cannot punch holes.
+void punchRange(off_t off, size_t len) {
+    // Under parity a freed block still counts towards its stripe's parity, so it is
+    // left alone; allocation zeroes it and updates the parity when it is reused
+    if (parity) {
+        return;
+    }
+    markDirty(off, len);
+    // RAID 10 rows are contiguous per pair, not across the logical range
+    if (pairs) {
+        for (off_t b = off; b < off + (off_t) len; b += BLOCK_SIZE) {
+            for (int member = 0; member < 2; member++) {
+                char *block = pairMember(b, member);
+                int d = 2 * (((b - sb->d_blocks_ptr) / BLOCK_SIZE) % pairs) + member;
+                if (disk_punch(d, block - disk_maps[d], BLOCK_SIZE) < 0) {
+                    memset(block, 0, BLOCK_SIZE);
+                }
+            }
+        }
+        return;
+    }
+    for (int d = 0; d < disk_count; d++) {
+        if (disk_punch(d, off, len) < 0) {
+            memset(disk_maps[d] + off, 0, len);
+        }
     }
+}
 
-    // Locate and remove directory entry
-    int blockIter = 0, index = -1;
-    while (parentInode->blocks[blockIter] != 0 && blockIter < IND_BLOCK) {
-        struct wfs_dentry *entries = (struct wfs_dentry *)(memStart + parentInode->blocks[blockIter]);
-        for (int i = 0; i < BLOCK_SIZE / sizeof(struct wfs_dentry); i++) {
-            if (strcmp(entries[i].name, curr) == 0) {
-                index = i;
-                goto found;
+// Punch out everything queued so far, coalescing adjacent blocks into one range.
+// Runs under fsLock in batches of RECLAIM_BATCH so foreground operations interleave.
+void reclaimBatch() {
+    int n = reclaimCount < RECLAIM_BATCH ? reclaimCount : RECLAIM_BATCH;
+    int batch[RECLAIM_BATCH];
+    reclaimCount -= n;
+    memcpy(batch, reclaimQueue + reclaimCount, n * sizeof(int));
+    qsort(batch, n, sizeof(int), compareInts);
+
+    int runStart = -1, runLen = 0;
+    for (int i = 0; i <= n; i++) {
+        // Blocks taken back by the allocator are no longer pending and must be left alone
+        int index = i < n ? batch[i] : -1;
+        int pending = index >= 0 && isBitSet(pendingMap, index);
+        if (pending && runLen && index == runStart + runLen) {
+            runLen++;
+        } else {
+            if (runLen) {
+                punchRange(sb->d_blocks_ptr + (off_t) runStart * BLOCK_SIZE, (size_t) runLen * BLOCK_SIZE);
             }
+            runStart = pending ? index : -1;
+            runLen = pending ? 1 : 0;
+        }
+        if (pending) {
+            freeBitFromMap(pendingMap, index);
         }
-        blockIter++;
     }
-    return -ENOENT; // Entry not found
+}
 
-found:
-    parentInode->size -= sizeof(struct wfs_dentry);
+void *reclaimMain(void *arg) {
+    lockFs();
+    while (1) {
+        while (!reclaimCount && !reclaimStop) {
+            pthread_cond_wait(&reclaimCond, &fsLock);
+        }
+        if (!reclaimCount) {
+            break;
+        }
+        reclaimBatch();
 
-    int lastBlock = parentInode->size / BLOCK_SIZE;
-    int lastOffset = parentInode->size % BLOCK_SIZE;
+        // Let foreground operations in between batches
+        unlockFs();
+        sched_yield();
+        lockFs();
+    }
+    unlockFs();
+    return NULL;
+}
 
-    if (lastBlock == blockIter && lastOffset == index * sizeof(struct wfs_dentry)) {
-        memset(memStart + parentInode->blocks[blockIter] + index * sizeof(struct wfs_dentry), 0, sizeof(struct wfs_dentry));
-    } else {
-        struct wfs_dentry *lastEntry = (struct wfs_dentry *)(memStart + parentInode->blocks[lastBlock] + lastOffset);
-        memcpy(memStart + parentInode->blocks[blockIter] + index * sizeof(struct wfs_dentry), lastEntry, sizeof(struct wfs_dentry));
-        memset(lastEntry, 0, sizeof(struct wfs_dentry));
+void startReclaimer() {
+    if (pthread_create(&reclaimThread, NULL, reclaimMain, NULL) != 0) {
+        perror("pthread_create");
+        return;
     }
+    reclaimRunning = 1;
+}
 
-    // Free file's data blocks (direct and indirect)
-    if (inode->blocks[IND_BLOCK]) {
-        off_t *indirectBlocks = (off_t *)(memStart + inode->blocks[IND_BLOCK]);
-        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
-            if (indirectBlocks[i] != 0) {
-                off_t dataBlockAddr = indirectBlocks[i];
-                memset(memStart + dataBlockAddr, 0, BLOCK_SIZE); // Zero out the block
-                freeBitFromMap(dataMap, (dataBlockAddr - sb->d_blocks_ptr) / BLOCK_SIZE);
-
-                // Replicate the zeroed block to RAID 1 disks
-                if (disk_count > 1 && sb->raid_mode == 1) {
-                    for (int d = 1; d < disk_count; d++) {
-                        memcpy(disk_maps[d] + dataBlockAddr, memStart + dataBlockAddr, BLOCK_SIZE);
-                    }
-                }
-            }
-        }
+// Stop the reclaimer after it has drained its queue
+void stopReclaimer() {
+    if (!reclaimRunning) {
+        return;
+    }
+    lockFs();
+    reclaimStop = 1;
+    pthread_cond_signal(&reclaimCond);
+    unlockFs();
+    pthread_join(reclaimThread, NULL);
+    reclaimRunning = 0;
+}
+
+// Whether metadata changes have to be passed to the replicate_* calls: always with
+// the metadata cache, which writes them back, otherwise when there are redundant
+// copies to keep up
+int metaReplicated() {
+    return metaCache || (disk_count > 1 && sb->raid_mode != RAID0);
+}
 
-        // Zero out and free the indirect block itself
-        off_t indirectBlockAddr = inode->blocks[IND_BLOCK];
-        memset(memStart + indirectBlockAddr, 0, BLOCK_SIZE);
-        freeBitFromMap(dataMap, (indirectBlockAddr - sb->d_blocks_ptr) / BLOCK_SIZE);
+// Mark the metadata cache pages holding [p, p + len) dirty
+void metaDirty(const void *p, size_t len) {
+    size_t first = ((const char *) p - metaCache) / META_PAGE;
+    size_t last = ((const char *) p - metaCache + len - 1) / META_PAGE;
+    memset(metaDirtyMap + first, 1, last - first + 1);
+}
 
-        // Replicate the zeroed indirect block to RAID 1 disks
-        if (disk_count > 1 && sb->raid_mode == 1) {
-            for (int d = 1; d < disk_count; d++) {
-                memcpy(disk_maps[d] + indirectBlockAddr, memStart + indirectBlockAddr, BLOCK_SIZE);
+// Copy the dirty pages of the metadata cache to every disk, a run of pages at a
+// time. The superblock in front of the bitmaps is left alone: it doesn't change
+// while mounted, except for the per-disk fields written through each disk's view.
+void metaWriteback() {
+    if (!metaCache) {
+        return;
+    }
+    size_t pages = metaArenaSize / META_PAGE;
+    int wrote = 0;
+    for (size_t first = 0; first < pages; first++) {
+        if (!metaDirtyMap[first]) {
+            continue;
+        }
+        size_t last = first;
+        while (last + 1 < pages && metaDirtyMap[last + 1]) {
+            last++;
+        }
+        memset(metaDirtyMap + first, 0, last - first + 1);
+        off_t from = first * META_PAGE > (size_t) sb->i_bitmap_ptr ? first * META_PAGE : sb->i_bitmap_ptr;
+        off_t to = (last + 1) * META_PAGE < metaCacheSize ? (last + 1) * META_PAGE : metaCacheSize;
+        for (int d = 0; d < disk_count && from < to; d++) {
+            if (fds[d] < 0) {
+                continue;
             }
+            if (d == 0) {
+                memcpy(disk_maps[0] + from, metaCache + from, to - from);
+            } else {
+                copyToDisk(d, from, metaCache + from, to - from);
+            }
+            metaStats.bytes += to - from;
         }
+        wrote = 1;
+        first = last;
     }
+    metaStats.writebacks += wrote;
+}
 
-    // Free direct blocks
-    for (int i = 0; i < IND_BLOCK; i++) {
-        if (inode->blocks[i]) {
-            off_t dataBlockAddr = inode->blocks[i];
-            memset(memStart + dataBlockAddr, 0, BLOCK_SIZE); // Zero out the block
-            freeBitFromMap(dataMap, (dataBlockAddr - sb->d_blocks_ptr) / BLOCK_SIZE);
-
-            // Replicate the zeroed block to RAID 1 disks
-            if (disk_count > 1 && sb->raid_mode == 1) {
-                for (int d = 1; d < disk_count; d++) {
-                    memcpy(disk_maps[d] + dataBlockAddr, memStart + dataBlockAddr, BLOCK_SIZE);
-                }
-            }
+// Since metadata must be mirrored in both RAID 0 and RAID 1 if multiple disks, we just check disk_count > 1
+void replicate_dataMap() {
+    if (metaCache) {
+        metaDirty(dataMap, sb->num_data_blocks / 8);
+        return;
+    }
+    if (disk_count > 1) {
+        off_t dataMapOffset = dataMap - memStart;
+        size_t dataMapSize = sb->num_data_blocks / 8;
+        for (int d = 1; d < disk_count; d++) {
+            copyToDisk(d, dataMapOffset, memStart + dataMapOffset, dataMapSize);
         }
     }
+}
 
-    // Zero out and free the inode itself
-    memset(inode, 0, BLOCK_SIZE);
-    freeBitFromMap(inodeMap, inodeIndex);
-
-    // Replicate changes (metadata)
+void replicate_inodeMap() {
+    if (metaCache) {
+        metaDirty(inodeMap, sb->num_inodes / 8);
+        return;
+    }
     if (disk_count > 1) {
         off_t inodeMapOffset = inodeMap - memStart;
-        size_t inodeMapSize = iCount / 8;
+        size_t inodeMapSize = sb->num_inodes / 8;
+        for (int d = 1; d < disk_count; d++) {
+            copyToDisk(d, inodeMapOffset, memStart + inodeMapOffset, inodeMapSize);
+        }
+    }
+}
 
-        off_t dataMapOffset = dataMap - memStart;
-        size_t dataMapSize = dCount / 8;
+void replicate_block(off_t blockAddr) {
+    markDirty(blockAddr, BLOCK_SIZE);
+    if (disk_count > 1) {
+        for (int d = 1; d < disk_count; d++) {
+            copyToDisk(d, blockAddr, memStart + blockAddr, BLOCK_SIZE);
+        }
+    }
+}
 
-        off_t parentOff = (char *)parentInode - memStart;
-        off_t inodeOff = (char *)inode - memStart;
-        off_t dirBlockOff = parentInode->blocks[blockIter];
-        off_t lastBlockOff = parentInode->blocks[lastBlock];
+void replicate_partial_block(off_t start, size_t len, const char *src) {
+    markDirty(start, len);
+    if (disk_count > 1) {
+        for (int d = 1; d < disk_count; d++) {
+            copyToDisk(d, start, src, len);
+        }
+    }
+}
 
+void replicate_inode(struct wfs_inode *inode) {
+    if (metaCache) {
+        metaDirty(inode, BLOCK_SIZE);
+        return;
+    }
+    if (disk_count > 1) {
+        off_t inodeOff = (char*)inode - memStart;
         for (int d = 1; d < disk_count; d++) {
-            // Replicate inodeMap (always metadata)
-            memcpy(disk_maps[d] + inodeMapOffset, memStart + inodeMapOffset, inodeMapSize);
+            copyToDisk(d, inodeOff, inode, BLOCK_SIZE);
+        }
+    }
+}
 
-            // Replicate dataMap (only in RAID 1 mode)
-            if (sb->raid_mode == 1) {
-                memcpy(disk_maps[d] + dataMapOffset, memStart + dataMapOffset, dataMapSize);
-            }
+// Record on every disk where it sits and whether the filesystem is in use. A disk
+// still being synced keeps events at 0, so it is found stale, and synced again, if
+// the sync doesn't finish.
+void stampDisks(int state) {
+    if (!identity) {
+        return;
+    }
+    for (int d = 0; d < disk_count; d++) {
+        if (fds[d] < 0) {
+            continue;
+        }
+        struct wfs_sb *disk = (struct wfs_sb *) disk_maps[d];
+        disk->disk_index = diskIndex[d];
+        disk->state = state;
+        disk->events = d == syncDisk || d == failedDisk ? 0 : mountEvents;
+    }
+}
 
-            // Replicate parent inode
-            memcpy(disk_maps[d] + parentOff, parentInode, BLOCK_SIZE);
+// Data block access. Block addresses (inode blocks[], indirect entries) are logical:
+// d_blocks_ptr + index * BLOCK_SIZE. In the mirrored modes that is also the block's
+// offset on every disk and disk 0's copy is used. Under parity the block sits on one
+// disk of its stripe, and changes must be committed so the stripe's parity follows.
 
-            // Replicate directory blocks
-            memcpy(disk_maps[d] + dirBlockOff, memStart + dirBlockOff, BLOCK_SIZE);
-            if (lastBlock != blockIter) {
-                memcpy(disk_maps[d] + lastBlockOff, memStart + lastBlockOff, BLOCK_SIZE);
-            }
+int blockStripe(off_t blockAddr) {
+    return (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE / (disk_count - parity);
+}
+
+// Point members at the blocks of stripe s: the data blocks in order, then P and Q
+void stripeMembers(int s, char **members) {
+    off_t off = sb->d_blocks_ptr + (off_t) s * BLOCK_SIZE;
+    int ndata = disk_count - parity;
+    for (int i = 0; i < ndata; i++) {
+        members[i] = disk_maps[raid_data_disk(disk_count, parity, s, i)] + off;
+    }
+    members[ndata] = disk_maps[raid_p_disk(disk_count, s)] + off;
+    if (parity == 2) {
+        members[ndata + 1] = disk_maps[raid_q_disk(disk_count, s)] + off;
+    }
+}
 
-            // Replicate zeroed inode
-            memcpy(disk_maps[d] + inodeOff, memStart + inodeOff, BLOCK_SIZE);
+// Reconstruct failedDisk's block of stripe s from the others, the first time the
+// stripe is touched. XOR of everything but Q restores a data block or P; a lost Q
+// is generated again.
+void ensureStripe(int s) {
+    if (failedDisk < 0 || isBitSet(rebuiltMap, s)) {
+        return;
+    }
+    char *members[disk_count];
+    stripeMembers(s, members);
+    int ndata = disk_count - parity;
+    char *lost = disk_maps[failedDisk] + sb->d_blocks_ptr + (off_t) s * BLOCK_SIZE;
+
+    if (parity == 2 && lost == members[ndata + 1]) {
+        char p[BLOCK_SIZE];
+        raid_gen_pq(ndata, members, p, lost, BLOCK_SIZE);
+    } else {
+        memset(lost, 0, BLOCK_SIZE);
+        for (int m = 0; m <= ndata; m++) {
+            if (members[m] != lost) {
+                raid_xor(lost, members[m], BLOCK_SIZE);
+            }
         }
     }
+    setBitInMap(rebuiltMap, s);
+}
 
-    return OK;
+// Recompute the parity of stripe s from its data blocks
+void updateParity(int s) {
+    ensureStripe(s);
+    char *members[disk_count];
+    stripeMembers(s, members);
+    int ndata = disk_count - parity;
+    if (parity == 2) {
+        raid_gen_pq(ndata, members, members[ndata], members[ndata + 1], BLOCK_SIZE);
+        diskCounters(members[ndata + 1])->replicated += BLOCK_SIZE;
+    } else {
+        raid_gen_p(ndata, members, members[ndata], BLOCK_SIZE);
+    }
+    diskCounters(members[ndata])->replicated += BLOCK_SIZE;
 }
 
-int wfs_getattr(const char* path, struct stat* stbuf) {
-    int inodeIndex = parsePath(path);
-    if (inodeIndex < 0) return -ENOENT;
+// Check stripe s against its parity and repair it (see raid5_repair). Returns -1 if
+// the damage can't be located. There is nothing to check against while a member
+// is being reconstructed.
+int checkStripe(int s) {
+    if (failedDisk >= 0) {
+        return 0;
+    }
+    char *members[disk_count];
+    stripeMembers(s, members);
+    int ndata = disk_count - parity;
+    int repaired;
+    if (parity == 2) {
+        repaired = raid6_repair(ndata, members, members[ndata], members[ndata + 1], BLOCK_SIZE);
+    } else {
+        repaired = raid5_repair(ndata, members, members[ndata], BLOCK_SIZE);
+    }
+    if (repaired > 0) {
+        stats()->repairs += repaired;
+    }
+    return repaired;
+}
 
-    struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + inodeIndex*BLOCK_SIZE);
-    // Update atime
-    inode->atim = time(NULL);
+// RAID 10: block i lives on pair i % pairs, row i / pairs, of both disks in the pair
+char *pairMember(off_t blockAddr, int member) {
+    int index = (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    int pair = index % pairs;
+    return disk_maps[2 * pair + member] + sb->d_blocks_ptr + (off_t) (index / pairs) * BLOCK_SIZE;
+}
 
-    // Replicate inode changes in RAID 1
-    if (disk_count > 1 && sb->raid_mode == 1) {
-        replicate_inode(inode);
+char *blockPtr(off_t blockAddr) {
+    if (pairs) {
+        return pairMember(blockAddr, 0);
     }
+    if (!parity) {
+        return memStart + blockAddr;
+    }
+    int index = (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    int ndata = disk_count - parity;
+    int s = index / ndata;
+    ensureStripe(s);
+    return disk_maps[raid_data_disk(disk_count, parity, s, index % ndata)] + sb->d_blocks_ptr + (off_t) s * BLOCK_SIZE;
+}
 
-    // Fill stbuf with inode metadata
-    stbuf->st_uid = inode->uid;
-    stbuf->st_gid = inode->gid;
-    stbuf->st_mode = inode->mode;
-    stbuf->st_nlink = inode->nlinks;
-    stbuf->st_atim.tv_sec = inode->atim;
-    stbuf->st_ctim.tv_sec = inode->ctim;
-    stbuf->st_mtim.tv_sec = inode->mtim;
-    stbuf->st_size = inode->size;
-    stbuf->st_ino = inode->num;
+// Where to read a block that is known to be consistent. RAID 10 alternates between
+// the two members row by row, so sequential reads are spread over both disks.
+char *readPtr(off_t blockAddr) {
+    if (pairs) {
+        int index = (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE;
+        return pairMember(blockAddr, (index / pairs) & 1);
+    }
+    return blockPtr(blockAddr);
+}
 
-    return OK;
+// Publish a change to the whole block at blockAddr
+void commitBlock(off_t blockAddr) {
+    diskCounters(blockPtr(blockAddr))->written += BLOCK_SIZE;
+    if (pairs) {
+        markDirty(blockAddr, BLOCK_SIZE);
+        memcpy(pairMember(blockAddr, 1), pairMember(blockAddr, 0), BLOCK_SIZE);
+        diskCounters(pairMember(blockAddr, 1))->replicated += BLOCK_SIZE;
+        return;
+    }
+    if (parity) {
+        markDirty(blockAddr, BLOCK_SIZE);
+        updateParity(blockStripe(blockAddr));
+        return;
+    }
+    replicate_block(blockAddr);
 }
 
-int wfs_mknod (const char* path, mode_t mode, dev_t rdev) {
-    if (parsePath(path) >= 0) {
-        return -EEXIST;
+// Publish a change to [start, start + len), which lies within one block
+void commitRange(off_t start, size_t len) {
+    if (pairs) {
+        off_t blockOff = (start - sb->d_blocks_ptr) % BLOCK_SIZE;
+        diskCounters(pairMember(start, 0))->written += len;
+        markDirty(start, len);
+        memcpy(pairMember(start, 1) + blockOff, pairMember(start, 0) + blockOff, len);
+        diskCounters(pairMember(start, 1))->replicated += len;
+        return;
+    }
+    diskCounters(blockPtr(start))->written += len;
+    if (parity) {
+        markDirty(start, len);
+        updateParity(blockStripe(start));
+        return;
     }
+    replicate_partial_block(start, len, memStart + start);
+}
 
-    char name[MAX_NAME];
-    char parentPath[MAX_NAME];
-    parseParentChild(path, name, parentPath);
+int freeDataBlocks() {
+    int used = 0;
+    for (int i = 0; i < dCount / 8; i++) {
+        used += __builtin_popcount((unsigned char) dataMap[i]);
+    }
+    return dCount - used;
+}
 
-    if (name[0] == '\0') {
-        return -EBADF;
+// Allocate a zeroed data block and return its address, or 0 if the disk is full.
+// The first free block at or after goal (a block address, see dataGoal) is taken,
+// wrapping around to the start of the region. Blocks are not scrubbed when freed,
+// so stale contents are cleared here.
+off_t allocDataBlock(off_t goal) {
+    // Blocks reserved for buffered writes only go to the flush that needs them
+    if (wbReserved && !wbFlushing && freeDataBlocks() <= wbReserved) {
+        return 0;
     }
 
-    int parentInodeIndex = parsePath(parentPath);
-    if (parentInodeIndex < 0) {
-        return -ENOENT;
+    int from = goal >= sb->d_blocks_ptr ? (goal - sb->d_blocks_ptr) / BLOCK_SIZE % dCount : 0;
+    int ind = findAndAllocSkipping(dataMap, pendingMap, dCount, from);
+    if (ind < 0) {
+        // Only blocks waiting for the reclaimer are left: take one back from it
+        ind = findAndAllocSkipping(dataMap, NULL, dCount, from);
+        if (ind < 0) {
+            return 0;
+        }
+        freeBitFromMap(pendingMap, ind);
     }
 
-    int index = findAndAllocFromMap(inodeMap, iCount);
-    if (index < 0) {
-        return -ENOSPC;
+    // Only replicate dataMap in the redundant modes (RAID 1 and parity), or into
+    // the metadata cache. A flush replicates it once, after all of its allocations.
+    if (wbFlushing) {
+        wbMapDirty = 1;
+    } else if (metaReplicated()) {
+        replicate_dataMap();
     }
 
-    struct wfs_inode *parentInode = (struct wfs_inode *) (inodeStart + parentInodeIndex * BLOCK_SIZE);
-    int blockNum = parentInode->size / BLOCK_SIZE;
-    int off = parentInode->size % BLOCK_SIZE;
+    trace_alloc();
+    off_t addr = sb->d_blocks_ptr + (off_t) BLOCK_SIZE * ind;
+    memset(blockPtr(addr), 0, BLOCK_SIZE);
+    commitBlock(addr);
+    setBitInMap(verifiedMap, ind);
+    return addr;
+}
 
-    parentInode->mtim = time(NULL);
-    parentInode->atim = time(NULL);
+// FNV-1a over a block's contents. Matches are compared in full before a block is
+// shared, so this only has to spread blocks over the fingerprint table.
+uint64_t blockHash(const char *data) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-    if (!off && !parentInode->blocks[blockNum]) {
-       if (blockNum == IND_BLOCK) {
-           freeBitFromMap(inodeMap, index);
-           return -ENOSPC;
-       }
+void replicate_refCount(int index) {
+    off_t off = (char *) &refCounts[index] - memStart;
+    for (int d = 1; d < disk_count; d++) {
+        copyToDisk(d, off, &refCounts[index], sizeof(uint16_t));
+    }
+}
 
-       int ind = findAndAllocFromMap(dataMap, dCount);
-       if (ind < 0) {
-           freeBitFromMap(inodeMap, index);
-           return -ENOSPC;
-       }
-       parentInode->blocks[blockNum] = sb->d_blocks_ptr + BLOCK_SIZE * ind;
+void replicate_fingerprint(struct wfs_fingerprint *fp) {
+    off_t off = (char *) fp - memStart;
+    for (int d = 1; d < disk_count; d++) {
+        copyToDisk(d, off, fp, sizeof(*fp));
     }
+}
 
-    char *dirBlock = (char*)memStart + parentInode->blocks[blockNum] + off;
-    struct wfs_dentry *loc = (struct wfs_dentry *)dirBlock;
-    strncpy(loc->name, name, MAX_NAME);
-    loc->num = index;
+int refCount(off_t blockAddr) {
+    return refCounts ? refCounts[(blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE] : 0;
+}
 
-    parentInode->mtim = time(NULL);
-    parentInode->size += sizeof(struct wfs_dentry);
+void setRefCount(off_t blockAddr, int refs) {
+    int index = (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    refCounts[index] = refs;
+    replicate_refCount(index);
+}
 
-    struct wfs_inode *node = (struct wfs_inode *) (inodeStart + BLOCK_SIZE * index);
-    node->num = index;
-    node->mode = mode;
-    node->uid = getuid();
-    node->gid = getgid();
+// Take one more reference to a block. A count of 0 means the block has one owner.
+void shareBlock(off_t blockAddr) {
+    int refs = refCount(blockAddr);
+    setRefCount(blockAddr, refs ? refs + 1 : 2);
+}
+
+// indexedMap, built from the fingerprint table the first time it is needed rather
+// than at mount, where reading the whole table would hold up the mount
+char *indexed() {
+    if (!indexedReady) {
+        for (size_t i = 0; i < sb->num_fingerprints; i++) {
+            if (fingerprints[i].block > 0) {
+                setBitInMap(indexedMap, fingerprints[i].block - 1);
+            }
+        }
+        indexedReady = 1;
+    }
+    return indexedMap;
+}
+
+// Return a block in the fingerprint table holding exactly data, or 0
+off_t findDuplicate(const char *data, uint64_t hash) {
+    size_t mask = sb->num_fingerprints - 1;
+    size_t n = hash & mask;
+    for (size_t i = 0; i <= mask && fingerprints[n].block; i++, n = (n + 1) & mask) {
+        struct wfs_fingerprint *fp = &fingerprints[n];
+        if (fp->block == FP_DELETED || fp->hash != hash) {
+            continue;
+        }
+        off_t addr = sb->d_blocks_ptr + (off_t) (fp->block - 1) * BLOCK_SIZE;
+        if (refCount(addr) < UINT16_MAX && memcmp(blockPtr(addr), data, BLOCK_SIZE) == 0) {
+            return addr;
+        }
+    }
+    return 0;
+}
+
+// Enter a block whose contents hash to hash in the fingerprint table. Nothing
+// happens if the table is full; the block just can't be shared.
+void indexBlock(off_t blockAddr, uint64_t hash) {
+    int index = (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    if (isBitSet(indexed(), index)) {
+        return;
+    }
+    size_t mask = sb->num_fingerprints - 1;
+    size_t n = hash & mask;
+    for (size_t i = 0; i <= mask; i++, n = (n + 1) & mask) {
+        struct wfs_fingerprint *fp = &fingerprints[n];
+        if (fp->block <= 0) {
+            fp->hash = hash;
+            fp->block = index + 1;
+            replicate_fingerprint(fp);
+            setBitInMap(indexedMap, index);
+            return;
+        }
+    }
+}
+
+// Take a block out of the fingerprint table before it is modified or freed. Its
+// contents still hash to where it was entered, so the probe starts there.
+void unindexBlock(off_t blockAddr) {
+    int index = (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    if (!fingerprints || !isBitSet(indexed(), index)) {
+        return;
+    }
+    size_t mask = sb->num_fingerprints - 1;
+    size_t n = blockHash(blockPtr(blockAddr)) & mask;
+    for (size_t i = 0; i <= mask; i++, n = (n + 1) & mask) {
+        if (fingerprints[n].block == index + 1) {
+            fingerprints[n].block = FP_DELETED;
+            replicate_fingerprint(&fingerprints[n]);
+            break;
+        }
+    }
+    freeBitFromMap(indexedMap, index);
+}
+
+// Drop one block slot's reference to a block, freeing the block with the last one.
+// Returns 1 if it was freed; the caller replicates the data bitmap.
+int releaseBlock(off_t blockAddr) {
+    int refs = refCount(blockAddr);
+    if (refs > 1) {
+        setRefCount(blockAddr, refs - 1);
+        return 0;
+    }
+    if (refs) {
+        setRefCount(blockAddr, 0);
+    }
+    unindexBlock(blockAddr);
+    deferFree(blockAddr);
+    return 1;
+}
+
+// Make the block in *slot safe to modify in place: a shared block is copied to a
+// new one first, and any block leaves the fingerprint table. Returns the block, or
+// 0 if there is no room for the copy. The caller commits the slot if it changed.
+off_t ownBlock(off_t *slot) {
+    off_t addr = *slot;
+    int refs = refCount(addr);
+    if (refs <= 1) {
+        unindexBlock(addr);
+        return addr;
+    }
+
+    off_t copy = allocDataBlock(addr);
+    if (!copy) {
+        return 0;
+    }
+    memcpy(blockPtr(copy), blockPtr(addr), BLOCK_SIZE);
+    commitBlock(copy);
+    setRefCount(addr, refs - 1);
+    dedupStats.copied++;
+    *slot = copy;
+    return copy;
+}
+
+// Free the file's blocks from logical block `first` onward, and the indirect block
+// once nothing is left under it. Shared blocks just lose a reference. All bits are
+// cleared before the data bitmap and the indirect block are replicated, once each, for
+// the whole batch; the blocks themselves go to the reclaimer. The caller replicates the
+// inode.
+void releaseFileBlocks(struct wfs_inode *inode, int first) {
+    int freed = 0;
+
+    // CLUSTER_MARK slots hold no block and are just cleared
+    for (int i = first; i < IND_BLOCK; i++) {
+        if (inode->blocks[i] && inode->blocks[i] != CLUSTER_MARK) {
+            freed += releaseBlock(inode->blocks[i]);
+        }
+        inode->blocks[i] = 0;
+    }
+
+    if (inode->blocks[IND_BLOCK]) {
+        off_t *indirectBlock = (off_t *)blockPtr(inode->blocks[IND_BLOCK]);
+        int start = first > IND_BLOCK ? first - IND_BLOCK : 0;
+        int changed = 0, remaining = 0;
+
+        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+            if (!indirectBlock[i]) {
+                continue;
+            }
+            if (i < start) {
+                remaining++;
+                continue;
+            }
+            if (indirectBlock[i] != CLUSTER_MARK) {
+                freed += releaseBlock(indirectBlock[i]);
+            }
+            // An indirect block freed whole is left as it is, like any freed block:
+            // changing it without a commit would leave its stripe's parity stale
+            if (remaining) {
+                indirectBlock[i] = 0;
+                changed = 1;
+            }
+        }
+
+        if (!remaining) {
+            deferFree(inode->blocks[IND_BLOCK]);
+            inode->blocks[IND_BLOCK] = 0;
+            freed++;
+        } else if (changed) {
+            commitBlock(inode->blocks[IND_BLOCK]);
+        }
+    }
+
+    if (freed && metaReplicated()) {
+        replicate_dataMap();
+    }
+}
+
+// Return the slot holding the address of a file's blockIndex-th block, or NULL when
+// the index is past the indirect block. Without alloc, a missing indirect block also
+// gives NULL, since the whole indirect range is then a hole.
+off_t *blockSlot(struct wfs_inode *inode, int blockIndex, int alloc) {
+    if (blockIndex < 0 || blockIndex >= MAX_FILE_BLOCKS) {
+        return NULL;
+    }
+    if (blockIndex < IND_BLOCK) {
+        return &inode->blocks[blockIndex];
+    }
+
+    if (!inode->blocks[IND_BLOCK]) {
+        if (!alloc) {
+            return NULL;
+        }
+        off_t addr = allocDataBlock(dataGoal(inode, IND_BLOCK));
+        if (!addr) {
+            return NULL;
+        }
+        inode->blocks[IND_BLOCK] = addr;
+    }
+
+    off_t *indirectBlock = (off_t *)blockPtr(inode->blocks[IND_BLOCK]);
+    return &indirectBlock[blockIndex - IND_BLOCK];
+}
+
+// Block slots in cluster c; the last cluster is cut short by MAX_FILE_BLOCKS
+int clusterSlots(int c) {
+    int slots = MAX_FILE_BLOCKS - c * CLUSTER_BLOCKS;
+    return slots < CLUSTER_BLOCKS ? slots : CLUSTER_BLOCKS;
+}
+
+// Return how many blocks hold cluster c's compressed stream, or 0 if the cluster is
+// stored as plain blocks
+int clusterCompressed(struct wfs_inode *inode, int c) {
+    for (int i = 1; i < clusterSlots(c); i++) {
+        off_t *slot = blockSlot(inode, c * CLUSTER_BLOCKS + i, 0);
+        if (!slot) {
+            return 0;
+        }
+        if (*slot == CLUSTER_MARK) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// Find the first data (wantData) or hole offset at or after off by walking the
+// block map. The end of file counts as a hole; -ENXIO if off is not inside the file.
+off_t seekDataHole(struct wfs_inode *inode, off_t off, int wantData) {
+    if (off < 0 || off >= inode->size) {
+        return -ENXIO;
+    }
+
+    int last = (inode->size - 1) / BLOCK_SIZE;
+    for (int blockIndex = off / BLOCK_SIZE; blockIndex <= last; blockIndex++) {
+        off_t *slot = blockSlot(inode, blockIndex, 0);
+        int isData = (slot && *slot) || clusterCompressed(inode, blockIndex / CLUSTER_BLOCKS);
+        if (isData == wantData) {
+            off_t pos = (off_t) blockIndex * BLOCK_SIZE;
+            return pos > off ? pos : off;
+        }
+    }
+    return wantData ? -ENXIO : inode->size;
+}
+
+// Point replicas at every copy of a mirrored data block that can be trusted, the
+// primary first, and return how many there are. RAID 10 keeps a block on one pair of
+// disks. A mirror still being resynced has no say in regions it has not caught up on.
+int blockReplicas(off_t blockAddr, char **replicas) {
+    if (pairs) {
+        replicas[0] = pairMember(blockAddr, 0);
+        replicas[1] = pairMember(blockAddr, 1);
+        return 2;
+    }
+    int voters = (syncDisk >= 0 && regionDirty(blockAddr)) ? disk_count - 1 : disk_count;
+    for (int d = 0; d < voters; d++) {
+        replicas[d] = disk_maps[d] + blockAddr;
+    }
+    return voters;
+}
+
+// Majority-vote the replicas of a block and rewrite any replica that disagrees with
+// the winner. Returns the winning copy; ties go to the earliest replica.
+char *voteBlock(off_t blockAddr, int *repaired) {
+    char *replicas[disk_count];
+    int voters = blockReplicas(blockAddr, replicas);
+    int bestDisk = 0;
+    int bestCount = 1;
+    // Find the block that has the highest count of matching replicas
+    for (int d = 0; d < voters; d++) {
+        int count = 1;
+        for (int d2 = d+1; d2 < voters; d2++) {
+            if (memcmp(replicas[d], replicas[d2], BLOCK_SIZE) == 0) {
+                count++;
+            }
+        }
+        if (count > bestCount) {
+            bestCount = count;
+            bestDisk = d;
+        }
+    }
+
+    // Repair any corrupted disks if found
+    for (int d = 0; d < voters; d++) {
+        if (d != bestDisk && memcmp(replicas[bestDisk], replicas[d], BLOCK_SIZE) != 0) {
+            memcpy(replicas[d], replicas[bestDisk], BLOCK_SIZE);
+            (*repaired)++;
+            stats()->repairs++;
+        }
+    }
+    return replicas[bestDisk];
+}
+
+// Return where to read a data block from. Blocks the scrubber (or an earlier read)
+// has checked are known to match their replicas or parity and are served as is.
+// Others are voted on or checked against parity, and repaired, first. NULL if the
+// damage can't be located.
+char *verifiedBlock(off_t blockAddr) {
+    int index = (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    char *src = readPtr(blockAddr);
+    if (!isBitSet(verifiedMap, index)) {
+        int repaired = 0;
+        if (parity) {
+            if (checkStripe(blockStripe(blockAddr)) < 0) {
+                return NULL;
+            }
+        } else {
+            src = voteBlock(blockAddr, &repaired);
+        }
+        setBitInMap(verifiedMap, index);
+    }
+    return src;
+}
+
+int isZero(const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Return compressed cluster c of the file, decompressed and zero-filled to
+// CLUSTER_SIZE, from the cache when possible. NULL if it can't be read or decoded.
+char *clusterData(struct wfs_inode *inode, int c) {
+    int blocks = clusterCompressed(inode, c);
+    off_t key = *blockSlot(inode, c * CLUSTER_BLOCKS, 0);
+    struct cluster_cache_entry *entry = cacheEntry(key);
+    if (entry->key == key) {
+        compressStats.hits++;
+        return entry->data;
+    }
+    compressStats.misses++;
+
+    char stream[CLUSTER_SIZE];
+    for (int i = 0; i < blocks; i++) {
+        char *src = verifiedBlock(*blockSlot(inode, c * CLUSTER_BLOCKS + i, 0));
+        if (!src) {
+            return NULL;
+        }
+        memcpy(stream + i * BLOCK_SIZE, src, BLOCK_SIZE);
+    }
+
+    struct wfs_cluster *header = (struct wfs_cluster *) stream;
+    if (header->length < 0 || header->length > blocks * BLOCK_SIZE - (int) sizeof(*header) ||
+        header->size < 0 || header->size > CLUSTER_SIZE) {
+        return NULL;
+    }
+    entry->key = 0;
+    if (lz4_decompress(stream + sizeof(*header), header->length, entry->data, header->size) != header->size) {
+        return NULL;
+    }
+    memset(entry->data + header->size, 0, CLUSTER_SIZE - header->size);
+    entry->key = key;
+    return entry->data;
+}
+
+// Copy cluster c of the file into buf, decompressing it if need be. Holes and
+// everything past the end of the data read as zeros.
+int loadCluster(struct wfs_inode *inode, int c, char *buf) {
+    if (clusterCompressed(inode, c)) {
+        char *data = clusterData(inode, c);
+        if (!data) {
+            return -EIO;
+        }
+        memcpy(buf, data, CLUSTER_SIZE);
+        return OK;
+    }
+
+    memset(buf, 0, CLUSTER_SIZE);
+    for (int i = 0; i < clusterSlots(c); i++) {
+        off_t *slot = blockSlot(inode, c * CLUSTER_BLOCKS + i, 0);
+        if (slot && *slot) {
+            char *src = verifiedBlock(*slot);
+            if (!src) {
+                return -EIO;
+            }
+            memcpy(buf + i * BLOCK_SIZE, src, BLOCK_SIZE);
+        }
+    }
+    return OK;
+}
+
+// Store the first len bytes of buf (zero past len) as cluster c of the file:
+// compressed if that saves at least a block, otherwise as plain blocks with
+// all-zero blocks left as holes. The cluster's current blocks are reused, and new
+// ones are taken before anything changes, so running out of space leaves the
+// cluster as it was.
+int storeCluster(struct wfs_inode *inode, int c, const char *buf, int len) {
+    int first = c * CLUSTER_BLOCKS;
+    int slots = clusterSlots(c);
+    int rawBlocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    char stream[CLUSTER_SIZE];
+    struct wfs_cluster *header = (struct wfs_cluster *) stream;
+    int room = (rawBlocks - 1) * BLOCK_SIZE - (int) sizeof(*header);
+    int length = room > 0 ? lz4_compress(buf, len, stream + sizeof(*header), room) : 0;
+
+    // What each slot gets: a block's contents, CLUSTER_MARK or nothing
+    const char *contents[CLUSTER_BLOCKS] = { NULL };
+    int needed = 0, markSlot = -1;
+    if (length) {
+        header->length = length;
+        header->size = len;
+        needed = (sizeof(*header) + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        memset(stream + sizeof(*header) + length, 0, needed * BLOCK_SIZE - sizeof(*header) - length);
+        for (int i = 0; i < needed; i++) {
+            contents[i] = stream + i * BLOCK_SIZE;
+        }
+        markSlot = needed;
+    } else {
+        for (int i = 0; i < rawBlocks; i++) {
+            if (!isZero(buf + i * BLOCK_SIZE, BLOCK_SIZE)) {
+                contents[i] = buf + i * BLOCK_SIZE;
+                needed++;
+            }
+        }
+    }
+
+    int lastUsed = markSlot;
+    for (int i = 0; i < slots; i++) {
+        if (contents[i]) {
+            lastUsed = i > lastUsed ? i : lastUsed;
+        }
+    }
+    if (lastUsed >= 0 && !blockSlot(inode, first + lastUsed, 1)) {
+        return -ENOSPC;
+    }
+
+    // Blocks shared with other files (dedup) are let go of rather than reused
+    off_t blocks[CLUSTER_BLOCKS], shared[CLUSTER_BLOCKS];
+    int have = 0, nShared = 0;
+    for (int i = 0; i < slots; i++) {
+        off_t *slot = blockSlot(inode, first + i, 0);
+        if (slot && *slot && *slot != CLUSTER_MARK) {
+            if (refCount(*slot) > 1) {
+                shared[nShared++] = *slot;
+            } else {
+                blocks[have++] = *slot;
+            }
+        }
+    }
+    if (have) {
+        cacheDrop(blocks[0]);
+    }
+    for (int n = have; n < needed; n++) {
+        blocks[n] = allocDataBlock(n ? blocks[n - 1] + BLOCK_SIZE : dataGoal(inode, c * CLUSTER_BLOCKS));
+        if (!blocks[n]) {
+            while (n-- > have) {
+                deferFree(blocks[n]);
+            }
+            if (metaReplicated()) {
+                replicate_dataMap();
+            }
+            return -ENOSPC;
+        }
+    }
+
+    int used = 0;
+    for (int i = 0; i < slots; i++) {
+        off_t addr = 0;
+        if (contents[i]) {
+            addr = blocks[used++];
+            unindexBlock(addr);
+            memcpy(blockPtr(addr), contents[i], BLOCK_SIZE);
+            commitBlock(addr);
+            setBitInMap(verifiedMap, (addr - sb->d_blocks_ptr) / BLOCK_SIZE);
+        } else if (i == markSlot) {
+            addr = CLUSTER_MARK;
+        }
+        off_t *slot = blockSlot(inode, first + i, 0);
+        if (slot) {
+            *slot = addr;
+        }
+    }
+    for (int n = needed; n < have; n++) {
+        releaseBlock(blocks[n]);
+    }
+    for (int n = 0; n < nShared; n++) {
+        releaseBlock(shared[n]);
+    }
+    if (have > needed && metaReplicated()) {
+        replicate_dataMap();
+    }
+    if (first + slots > IND_BLOCK && inode->blocks[IND_BLOCK]) {
+        commitBlock(inode->blocks[IND_BLOCK]);
+    }
+
+    // Written through, so the next read of the cluster needn't decompress it
+    if (length) {
+        struct cluster_cache_entry *entry = cacheEntry(blocks[0]);
+        memcpy(entry->data, buf, CLUSTER_SIZE);
+        entry->key = blocks[0];
+    }
+    compressStats.bytesIn += len;
+    compressStats.bytesOut += (long long) needed * BLOCK_SIZE;
+    return OK;
+}
+
+// Write up to size bytes at offset, stopping at the end of cluster c, through a
+// decompressed copy of the cluster. Returns the bytes written or a negative errno.
+int writeCluster(struct wfs_inode *inode, int c, const char *buf, size_t size, off_t offset) {
+    off_t start = (off_t) c * CLUSTER_SIZE;
+    off_t end = start + (off_t) clusterSlots(c) * BLOCK_SIZE;
+    if (offset >= end) {
+        return -EFBIG;
+    }
+    int n = size < end - offset ? size : end - offset;
+
+    char data[CLUSTER_SIZE];
+    int rc = loadCluster(inode, c, data);
+    if (rc < 0) {
+        return rc;
+    }
+    memcpy(data + (offset - start), buf, n);
+
+    off_t dataEnd = offset + n > inode->size ? offset + n : inode->size;
+    rc = storeCluster(inode, c, data, (dataEnd < end ? dataEnd : end) - start);
+    return rc < 0 ? rc : n;
+}
+
+// Sleep, with fsLock released, until reading `bytes` since `start` fits under the
+// scrub_rate cap. Returns early if the scrubber is being stopped.
+void scrubThrottle(struct timespec *start, long long bytes) {
+    long long rate = (long long) options.scrubRate * 1024;
+    long long ns = bytes * 1000000000LL / rate;
+
+    struct timespec deadline = *start;
+    deadline.tv_sec += ns / 1000000000LL;
+    deadline.tv_nsec += ns % 1000000000LL;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+        // Under the cap: still step aside for foreground operations
+        unlockFs();
+        sched_yield();
+        lockFs();
+        return;
+    }
+    while (!scrubStop && pthread_cond_timedwait(&scrubCond, &fsLock, &deadline) != ETIMEDOUT) {
+    }
+}
+
+// Walk every allocated data block, vote its replicas and repair the losers, then
+// sleep scrub_interval seconds and start over. Checked blocks are marked in
+// verifiedMap so reads can skip the vote.
+void *scrubMain(void *arg) {
+    lockFs();
+    while (!scrubStop) {
+        scrubStats.scanned = 0;
+        scrubStats.total = 0;
+        for (int i = 0; i < dCount; i++) {
+            scrubStats.total += isBitSet(dataMap, i);
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long long passBytes = 0;
+
+        int lastStripe = -1;
+        for (int i = 0; i < dCount && !scrubStop; i++) {
+            // Bits are re-read each time: the lock is dropped between chunks
+            if (!isBitSet(dataMap, i)) {
+                continue;
+            }
+
+            int repaired = 0;
+            off_t blockAddr = sb->d_blocks_ptr + (off_t) i * BLOCK_SIZE;
+            if (!parity) {
+                voteBlock(blockAddr, &repaired);
+            } else if (blockStripe(blockAddr) != lastStripe) {
+                // One check covers every block of the stripe
+                lastStripe = blockStripe(blockAddr);
+                repaired = checkStripe(lastStripe);
+            }
+            if (repaired < 0) {
+                repaired = 0;
+            } else {
+                setBitInMap(verifiedMap, i);
+            }
+
+            scrubStats.repaired += repaired;
+            scrubStats.scanned++;
+            passBytes += (long long) BLOCK_SIZE * disk_count;
+            scrubStats.bytesRead += (long long) BLOCK_SIZE * disk_count;
+
+            if (scrubStats.scanned % SCRUB_CHUNK == 0) {
+                scrubThrottle(&start, passBytes);
+            }
+        }
+        if (scrubStop) {
+            break;
+        }
+        scrubStats.passes++;
+        scrubStats.lastPass = time(NULL);
+
+        struct timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        next.tv_sec += options.scrubInterval;
+        while (!scrubStop && pthread_cond_timedwait(&scrubCond, &fsLock, &next) != ETIMEDOUT) {
+        }
+    }
+    unlockFs();
+    return NULL;
+}
+
+void startScrubber() {
+    // A single disk has no replicas or parity to compare against
+    if (disk_count < 2 || options.scrubRate <= 0) {
+        return;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&scrubCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&scrubThread, NULL, scrubMain, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    scrubRunning = 1;
+}
+
+void stopScrubber() {
+    if (!scrubRunning) {
+        return;
+    }
+    lockFs();
+    scrubStop = 1;
+    pthread_cond_signal(&scrubCond);
+    unlockFs();
+    pthread_join(scrubThread, NULL);
+    scrubRunning = 0;
+}
+
+// Copy each dirty region from disk 0 to syncDisk and clear its bit, SYNC_BATCH
+// regions per hold of fsLock. Writes landing meanwhile go to every mirror, so a
+// region stays in sync once copied. Stopping early leaves the remaining bits set
+// for the next resync.
+void *syncMain(void *arg) {
+    lockFs();
+    clock_gettime(CLOCK_MONOTONIC, &syncStats.start);
+    int r = 0;
+    while (r < wiRegions && !syncStop) {
+        for (int n = 0; n < SYNC_BATCH && r < wiRegions; r++) {
+            if (!isBitSet(wiMap, r)) {
+                continue;
+            }
+            off_t off = sb->d_blocks_ptr + (off_t) r * WI_REGION * BLOCK_SIZE;
+            int blocks = dCount - r * WI_REGION < WI_REGION ? dCount - r * WI_REGION : WI_REGION;
+            copyToDisk(syncDisk, off, memStart + off, (size_t) blocks * BLOCK_SIZE);
+            freeBitFromMap(wiMap, r);
+            replicate_wiMap(r / 8, r / 8);
+
+            syncStats.done++;
+            syncStats.bytes += (long long) blocks * BLOCK_SIZE;
+            n++;
+        }
+
+        unlockFs();
+        sched_yield();
+        lockFs();
+    }
+    if (!syncStop) {
+        clock_gettime(CLOCK_MONOTONIC, &syncStats.end);
+        syncDisk = -1;
+        stampDisks(WFS_DIRTY);
+    }
+    unlockFs();
+    return NULL;
+}
+
+// Rebuild a parity member: reconstruct its block of every stripe in order, as one
+// long sequential write. Stripes that foreground I/O has touched are already done.
+void *rebuildMain(void *arg) {
+    lockFs();
+    clock_gettime(CLOCK_MONOTONIC, &syncStats.start);
+    int s = 0;
+    while (s < stripeCount && !syncStop) {
+        for (int n = 0; n < SYNC_BATCH * WI_REGION && s < stripeCount; n++, s++) {
+            ensureStripe(s);
+            syncStats.done++;
+            syncStats.bytes += BLOCK_SIZE;
+        }
+
+        unlockFs();
+        sched_yield();
+        lockFs();
+    }
+    if (!syncStop) {
+        clock_gettime(CLOCK_MONOTONIC, &syncStats.end);
+        failedDisk = -1;
+        stampDisks(WFS_DIRTY);
+    }
+    unlockFs();
+    return NULL;
+}
+
+void startSync() {
+    // A missing parity member has nowhere to be rebuilt to
+    int rebuild = failedDisk >= 0 && fds[failedDisk] >= 0;
+    if (syncDisk < 0 && !rebuild) {
+        return;
+    }
+    if (pthread_create(&syncThread, NULL, rebuild ? rebuildMain : syncMain, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    syncRunning = 1;
+}
+
+void stopSync() {
+    if (!syncRunning) {
+        return;
+    }
+    lockFs();
+    syncStop = 1;
+    unlockFs();
+    pthread_join(syncThread, NULL);
+    syncRunning = 0;
+}
+
+// Write dirty pages back every writeback_interval seconds. Buffered file writes
+// (see wb_buffer) stay in their buffers until flushed as usual.
+void *writebackMain(void *arg) {
+    lockFs();
+    while (!writebackStop) {
+        struct timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        next.tv_sec += options.writebackInterval;
+        while (!writebackStop && pthread_cond_timedwait(&writebackCond, &fsLock, &next) != ETIMEDOUT) {
+        }
+        metaWriteback();
+        if (disk_writeback() < 0) {
+            perror("write-back");
+        }
+    }
+    unlockFs();
+    return NULL;
+}
+
+void startWriteback() {
+    if ((diskStats.backend == DISK_MMAP && !metaCache) || options.writebackInterval <= 0) {
+        return;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&writebackCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&writebackThread, NULL, writebackMain, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    writebackRunning = 1;
+}
+
+void stopWriteback() {
+    if (!writebackRunning) {
+        return;
+    }
+    lockFs();
+    writebackStop = 1;
+    pthread_cond_signal(&writebackCond);
+    unlockFs();
+    pthread_join(writebackThread, NULL);
+    writebackRunning = 0;
+}
+
+// Split path into its parent directory (a PATH_MAX buffer) and final component (a
+// MAX_NAME buffer). Returns -ENAMETOOLONG if the final component does not fit in a
+// directory entry.
+int parseParentChild (const char* path, char* child, char* parent) {
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        perror("strdup");
+        exit(2);
+    }
+
+    int len = strlen(copy);
+    child[0] = '\0';
+    parent[0] = '\0';
+
+    for (int i=len-1; i>=0; i--) {
+        if (copy[i] == '/') {
+            if (i == len - 1) {
+                free(copy);
+                return OK;
+            }
+            copy[i] = '\0';
+            if (strlen(copy + i + 1) >= MAX_NAME) {
+                free(copy);
+                return -ENAMETOOLONG;
+            }
+            strcpy(parent, copy);
+            strcpy(child, copy + i + 1);
+            break;
+        }
+    }
+    free(copy);
+    return OK;
+}
+
+// Whether path is SNAPSHOT_DIR or lies under it, where nothing may change
+int inSnapshot(const char *path) {
+    size_t len = strlen(SNAPSHOT_DIR);
+    return strncmp(path, SNAPSHOT_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// STATS_DIR and everything under it, which exists only in memory
+int inStats(const char *path) {
+    size_t len = strlen(STATS_DIR);
+    return strncmp(path, STATS_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// writeStats into a malloced string, or NULL
+char *renderStats() {
+    char *text = NULL;
+    size_t len;
+    FILE *f = open_memstream(&text, &len);
+    if (!f) {
+        return NULL;
+    }
+    writeStats(f);
+    if (fclose(f) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+// Find name in a directory. When found, blockIter and index (if given) say where
+// the entry lives.
+struct wfs_dentry *findDentry(struct wfs_inode *dir, const char *name, int *blockIter, int *index) {
+    for (int b = 0; b < IND_BLOCK && dir->blocks[b] != 0; b++) {
+        struct wfs_dentry *entries = (struct wfs_dentry *)blockPtr(dir->blocks[b]);
+        for (int i = 0; i < BLOCK_SIZE / sizeof(struct wfs_dentry); i++) {
+            if (entries[i].name[0] != 0 && strncmp(entries[i].name, name, MAX_NAME) == 0) {
+                if (blockIter) *blockIter = b;
+                if (index) *index = i;
+                return &entries[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+// Append an entry to a directory, allocating a new directory block when the last one
+// is full. Replicates the directory block; the caller replicates the directory inode.
+int addDentry(struct wfs_inode *dir, const char *name, int num) {
+    int blockNum = dir->size / BLOCK_SIZE;
+    int off = dir->size % BLOCK_SIZE;
+
+    if (blockNum >= IND_BLOCK) {
+        return -ENOSPC;
+    }
+    if (!off && !dir->blocks[blockNum]) {
+        off_t addr = allocDataBlock(dataGoal(dir, blockNum));
+        if (!addr) {
+            return -ENOSPC;
+        }
+        dir->blocks[blockNum] = addr;
+    }
+
+    struct wfs_dentry *loc = (struct wfs_dentry *)(blockPtr(dir->blocks[blockNum]) + off);
+    strncpy(loc->name, name, MAX_NAME);
+    loc->num = num;
+
+    dir->size += sizeof(struct wfs_dentry);
+    dir->mtim = time(NULL);
+    commitBlock(dir->blocks[blockNum]);
+    return OK;
+}
+
+// Remove the entry at (blockIter, index) by moving the directory's last entry into
+// its slot so entries stay packed. Replicates the directory blocks it touches.
+void removeDentry(struct wfs_inode *dir, int blockIter, int index) {
+    dir->size -= sizeof(struct wfs_dentry);
+
+    int lastBlock = dir->size / BLOCK_SIZE;
+    int lastOffset = dir->size % BLOCK_SIZE;
+
+    struct wfs_dentry *entry = (struct wfs_dentry *)blockPtr(dir->blocks[blockIter]) + index;
+    struct wfs_dentry *lastEntry = (struct wfs_dentry *)(blockPtr(dir->blocks[lastBlock]) + lastOffset);
+    if (entry != lastEntry) {
+        memcpy(entry, lastEntry, sizeof(struct wfs_dentry));
+    }
+    memset(lastEntry, 0, sizeof(struct wfs_dentry));
+
+    dir->mtim = time(NULL);
+    commitBlock(dir->blocks[blockIter]);
+    if (lastBlock != blockIter) {
+        commitBlock(dir->blocks[lastBlock]);
+    }
+}
+
+// Release an inode no directory refers to anymore, together with its blocks
+void freeInode(struct wfs_inode *inode, int inodeIndex) {
+    // Data blocks are only unmarked in the bitmap here; the reclaimer punches them
+    // out of the images later, off the unlink path.
+    releaseFileBlocks(inode, 0);
+    dropBuffer(inodeIndex);
+
+    memset(inode, 0, BLOCK_SIZE);
+    freeBitFromMap(inodeMap, inodeIndex);
+
+    replicate_inode(inode);
+    replicate_inodeMap();
+}
+
+int handleRemove(const char* path, int isDir) {
+    int inodeIndex = parsePath(path);
+    if (inodeIndex < 0) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + inodeIndex * BLOCK_SIZE);
+    if (isDir && inode->size > 0) {
+        return -ENOTEMPTY;
+    }
+
+    char curr[MAX_NAME];
+    char parentPath[PATH_MAX];
+    parseParentChild(path, curr, parentPath);
+
+    int parentInodeIndex = parsePath(parentPath);
+    if (parentInodeIndex < 0) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode *parentInode = (struct wfs_inode *)(inodeStart + parentInodeIndex * BLOCK_SIZE);
+
+    // Locate and remove directory entry
+    int blockIter, index;
+    if (!findDentry(parentInode, curr, &blockIter, &index)) {
+        return -ENOENT;
+    }
+    removeDentry(parentInode, blockIter, index);
+
+    if (isDir) {
+        parentInode->nlinks--;
+    }
+    replicate_inode(parentInode);
+
+    freeInode(inode, inodeIndex);
+    return OK;
+}
+
+int getattrLocked(const char* path, struct stat* stbuf) {
+    if (inStats(path)) {
+        if (strcmp(path, STATS_DIR) == 0) {
+            stbuf->st_mode = S_IFDIR | 0555;
+            stbuf->st_nlink = 2;
+            stbuf->st_ino = iCount + 1;
+        } else if (strcmp(path, STATS_FILE) == 0) {
+            char *text = renderStats();
+            stbuf->st_mode = S_IFREG | 0444;
+            stbuf->st_nlink = 1;
+            stbuf->st_size = text ? strlen(text) : 0;
+            stbuf->st_ino = iCount + 2;
+            free(text);
+        } else {
+            return -ENOENT;
+        }
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        stbuf->st_atim.tv_sec = stbuf->st_mtim.tv_sec = stbuf->st_ctim.tv_sec = time(NULL);
+        return OK;
+    }
+
+    int inodeIndex = parsePath(path);
+    if (inodeIndex < 0) return -ENOENT;
+
+    struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + inodeIndex*BLOCK_SIZE);
+    // Update atime
+    inode->atim = time(NULL);
+
+    // Replicate inode changes in the redundant modes
+    if (metaReplicated()) {
+        replicate_inode(inode);
+    }
+
+    // Fill stbuf with inode metadata
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->nlinks;
+    stbuf->st_atim.tv_sec = inode->atim;
+    stbuf->st_ctim.tv_sec = inode->ctim;
+    stbuf->st_mtim.tv_sec = inode->mtim;
+    stbuf->st_size = fileSize(inode);
+    stbuf->st_ino = inode->num;
+
+    return OK;
+}
+
+int freeInGroup(char *bitmap, int first, int count, int len) {
+    int n = 0;
+    for (int i = first; i < first + count && i < len; i++) {
+        n += !isBitSet(bitmap, i);
+    }
+    return n;
+}
+
+// Allocate an inode for a new child of parent. Files go in their directory's group.
+// Directories spread out, Orlov style: one under the root goes to the group with
+// the most free data blocks (then inodes), a deeper one stays with its parent
+// unless the parent's group has less than the average free. Either way the next
+// groups are tried in turn when the chosen one has no inode left.
+int allocInode(int parent, mode_t mode) {
+    int group = parent / groupInodes;
+    if (mode & S_IFDIR) {
+        int best = -1, bestFree = -1, bestInodes = 0, total = 0;
+        for (int g = 0; g < groupCount; g++) {
+            int free = freeInGroup(dataMap, g * groupBlocks, groupBlocks, dCount);
+            int inodes = freeInGroup(inodeMap, g * groupInodes, groupInodes, iCount);
+            total += free;
+            if (inodes && (free > bestFree || (free == bestFree && inodes > bestInodes))) {
+                best = g;
+                bestFree = free;
+                bestInodes = inodes;
+            }
+        }
+        int parentFree = freeInGroup(dataMap, group * groupBlocks, groupBlocks, dCount);
+        if (best >= 0 && (parent == 0 || parentFree * groupCount < total)) {
+            group = best;
+        }
+    }
+    int from = group * groupInodes < iCount ? group * groupInodes : 0;
+    int num = findAndAllocSkipping(inodeMap, NULL, iCount, from);
+    if (num >= 0) {
+        trace_inode(num);
+    }
+    return num;
+}
+
+// Where to look for a block for the file's blockIndex: just past the nearest block
+// before it, so files stay contiguous, or failing that the start of the inode's group
+off_t dataGoal(struct wfs_inode *inode, int blockIndex) {
+    for (int i = blockIndex - 1; i >= 0; i--) {
+        off_t *slot = blockSlot(inode, i, 0);
+        if (slot && *slot && *slot != CLUSTER_MARK) {
+            return *slot + BLOCK_SIZE;
+        }
+    }
+    int group = inode->num / groupInodes;
+    return sb->d_blocks_ptr + (off_t) (group < groupCount ? group : 0) * groupBlocks * BLOCK_SIZE;
+}
+
+// Create an empty file or directory. Returns its inode number or an error.
+int createNode(const char *path, mode_t mode) {
+    if (parsePath(path) >= 0 || strcmp(path, STATS_DIR) == 0 || strcmp(path, STATS_FILE) == 0) {
+        return -EEXIST;
+    }
+    if (inStats(path)) {
+        return -EROFS;
+    }
+
+    char name[MAX_NAME];
+    char parentPath[PATH_MAX];
+    if (parseParentChild(path, name, parentPath) < 0) {
+        return -ENAMETOOLONG;
+    }
+
+    if (name[0] == '\0') {
+        return -EBADF;
+    }
+
+    int parentInodeIndex = parsePath(parentPath);
+    if (parentInodeIndex < 0) {
+        return -ENOENT;
+    }
+
+    int index = allocInode(parentInodeIndex, mode);
+    if (index < 0) {
+        return -ENOSPC;
+    }
+
+    struct wfs_inode *parentInode = (struct wfs_inode *) (inodeStart + parentInodeIndex * BLOCK_SIZE);
+    parentInode->atim = time(NULL);
+
+    if (addDentry(parentInode, name, index) < 0) {
+        freeBitFromMap(inodeMap, index);
+        return -ENOSPC;
+    }
+
+    struct wfs_inode *node = (struct wfs_inode *) (inodeStart + BLOCK_SIZE * index);
+    node->num = index;
+    node->mode = mode;
+    node->uid = getuid();
+    node->gid = getgid();
     node->size = 0;
     node->nlinks = 1;
+    // Compression is inherited from the directory, as in btrfs
+    node->flags = (options.compress || (parentInode->flags & FS_COMPR_FL)) ? FS_COMPR_FL : 0;
 
     time_t amct = time(NULL);
     node->atim = amct;
@@ -407,223 +2132,899 @@ int wfs_mknod (const char* path, mode_t mode, dev_t rdev) {
         parentInode->nlinks++;
     }
 
-    // Replicate metadata if multiple disks
-    if (disk_count > 1) {
-        off_t inodeMapOffset = inodeMap - memStart;
-        size_t inodeMapSize = iCount / 8;
+    // Inode bitmap, parent inode and child's inode are metadata, always replicate
+    replicate_inodeMap();
+    replicate_inode(parentInode);
+    replicate_inode(node);
 
-        off_t dataMapOffset = dataMap - memStart;
-        size_t dataMapSize = dCount / 8;
+    return index;
+}
 
-        off_t parentOff = (char*)parentInode - memStart;
-        off_t childOff = (char*)node - memStart;
-        off_t dirBlockOff = parentInode->blocks[blockNum];
+int mknodLocked(const char* path, mode_t mode, dev_t rdev) {
+    if (inSnapshot(path)) {
+        return -EROFS;
+    }
+    int rc = createNode(path, mode);
+    return rc < 0 ? rc : OK;
+}
 
-        for (int d = 1; d < disk_count; d++) {
-            // Inode bitmap is metadata, always replicate
-            memcpy(disk_maps[d] + inodeMapOffset, memStart + inodeMapOffset, inodeMapSize);
+int renameLocked(const char *from, const char *to) {
+    int srcIndex = parsePath(from);
+    if (srcIndex < 0) {
+        return -ENOENT;
+    }
+    if (srcIndex == 0) {
+        return -EBUSY;
+    }
+    if (inSnapshot(from) || inSnapshot(to) || inStats(to)) {
+        return -EROFS;
+    }
 
-            // Data bitmap (dataMap) is only replicated in RAID 1 mode
-            if (sb->raid_mode == 1) {
-                memcpy(disk_maps[d] + dataMapOffset, memStart + dataMapOffset, dataMapSize);
-            }
+    char fromName[MAX_NAME], toName[MAX_NAME];
+    char fromParentPath[PATH_MAX], toParentPath[PATH_MAX];
+    parseParentChild(from, fromName, fromParentPath);
+    if (parseParentChild(to, toName, toParentPath) < 0) {
+        return -ENAMETOOLONG;
+    }
+    if (toName[0] == '\0') {
+        return -EINVAL;
+    }
+
+    struct wfs_inode *src = (struct wfs_inode *)(inodeStart + srcIndex * BLOCK_SIZE);
+    int isDir = src->mode & S_IFDIR;
+
+    // A directory cannot be moved into its own subtree
+    size_t fromLen = strlen(from);
+    if (isDir && strncmp(to, from, fromLen) == 0 && to[fromLen] == '/') {
+        return -EINVAL;
+    }
+
+    int fromParentIndex = parsePath(fromParentPath);
+    int toParentIndex = parsePath(toParentPath);
+    if (fromParentIndex < 0 || toParentIndex < 0) {
+        return -ENOENT;
+    }
+    struct wfs_inode *fromParent = (struct wfs_inode *)(inodeStart + fromParentIndex * BLOCK_SIZE);
+    struct wfs_inode *toParent = (struct wfs_inode *)(inodeStart + toParentIndex * BLOCK_SIZE);
+    if (!(toParent->mode & S_IFDIR)) {
+        return -ENOTDIR;
+    }
 
-            // Parent inode, directory block, and child's inode are metadata, always replicate
-            memcpy(disk_maps[d] + parentOff, parentInode, BLOCK_SIZE);
-            memcpy(disk_maps[d] + dirBlockOff, memStart + dirBlockOff, BLOCK_SIZE);
-            memcpy(disk_maps[d] + childOff, node, BLOCK_SIZE);
+    int targetBlock, targetIndex;
+    struct wfs_dentry *target = findDentry(toParent, toName, &targetBlock, &targetIndex);
+    if (target) {
+        if (target->num == srcIndex) {
+            return OK;
+        }
+
+        int oldIndex = target->num;
+        struct wfs_inode *old = (struct wfs_inode *)(inodeStart + oldIndex * BLOCK_SIZE);
+        if (isDir && !(old->mode & S_IFDIR)) {
+            return -ENOTDIR;
+        }
+        if (!isDir && (old->mode & S_IFDIR)) {
+            return -EISDIR;
+        }
+        if ((old->mode & S_IFDIR) && old->size > 0) {
+            return -ENOTEMPTY;
+        }
+
+        // Repoint the existing entry, so the target name never goes missing
+        target->num = srcIndex;
+        commitBlock(toParent->blocks[targetBlock]);
+
+        if (old->mode & S_IFDIR) {
+            toParent->nlinks--;
+        }
+        freeInode(old, oldIndex);
+    } else {
+        int rc = addDentry(toParent, toName, srcIndex);
+        if (rc < 0) {
+            return rc;
         }
     }
 
+    int blockIter, index;
+    if (findDentry(fromParent, fromName, &blockIter, &index)) {
+        removeDentry(fromParent, blockIter, index);
+    }
+
+    if (isDir) {
+        fromParent->nlinks--;
+        toParent->nlinks++;
+    }
+
+    time_t now = time(NULL);
+    src->ctim = now;
+    fromParent->ctim = now;
+    toParent->ctim = now;
+
+    replicate_inode(src);
+    replicate_inode(fromParent);
+    if (toParent != fromParent) {
+        replicate_inode(toParent);
+    }
+
     return OK;
 }
 
-int wfs_mkdir (const char* path, mode_t mode) {
-    return wfs_mknod(path, mode | S_IFDIR, 0);
+// Every copy a read of blockAddr will touch: all replicas, or the whole stripe,
+// until the block is verified, then only the copy it is read from
+int readCopies(off_t blockAddr, char **copies) {
+    int index = (blockAddr - sb->d_blocks_ptr) / BLOCK_SIZE;
+    int verified = isBitSet(verifiedMap, index);
+    if (parity) {
+        stripeMembers(blockStripe(blockAddr), copies);
+        if (verified) {
+            copies[0] = copies[index % (disk_count - parity)];
+            return 1;
+        }
+        return disk_count;
+    }
+    if (verified) {
+        copies[0] = readPtr(blockAddr);
+        return 1;
+    }
+    return blockReplicas(blockAddr, copies);
+}
+
+// Hint the file's blocks in [from, to) to the backend, merging blocks that sit next
+// to each other on a disk into one hint. Compressed clusters and holes are skipped.
+void hintBlocks(struct wfs_inode *inode, int from, int to) {
+    char *runStart[disk_count];
+    size_t runLen[disk_count];
+    int runs = 0;
+    for (int blockIndex = from; blockIndex < to; blockIndex++) {
+        off_t *slot = blockSlot(inode, blockIndex, 0);
+        if (!slot || !*slot || clusterCompressed(inode, blockIndex / CLUSTER_BLOCKS)) {
+            continue;
+        }
+        char *copies[disk_count];
+        int n = readCopies(*slot, copies);
+        for (int i = 0; i < n; i++) {
+            if (i < runs && runStart[i] + runLen[i] == copies[i]) {
+                runLen[i] += BLOCK_SIZE;
+                continue;
+            }
+            if (i < runs) {
+                disk_willneed(runStart[i], runLen[i]);
+            }
+            runStart[i] = copies[i];
+            runLen[i] = BLOCK_SIZE;
+        }
+        runs = n > runs ? n : runs;
+        raStats.blocks++;
+    }
+    for (int i = 0; i < runs; i++) {
+        disk_willneed(runStart[i], runLen[i]);
+    }
 }
 
-int wfs_unlink (const char* path) {
-    return handleRemove(path, 0);
+// Called before each read of [offset, offset + size). A read starting where the last
+// one ended, or at the start of the file, continues a sequential run and widens the
+// window; anything else ends it.
+void readAhead(int inodeIndex, struct wfs_inode *inode, off_t offset, size_t size, off_t fileEnd) {
+    if (options.readahead <= 0) {
+        return;
+    }
+    struct readahead *r = &readaheads[inodeIndex % RA_FILES];
+    if (r->inode != inodeIndex) {
+        *r = (struct readahead) { .inode = inodeIndex, .next = -1 };
+    }
+
+    if (offset == r->next || offset == 0) {
+        if (!r->window) {
+            raStats.streams++;
+            r->ahead = offset;
+        }
+        r->window = r->window ? 2 * r->window : RA_MIN;
+        if (r->window > options.readahead) {
+            r->window = options.readahead;
+        }
+    } else {
+        r->window = 0;
+    }
+    r->next = offset + size;
+
+    if (r->window) {
+        off_t from = r->ahead > offset ? r->ahead : offset;
+        off_t to = offset + size + (off_t) r->window * BLOCK_SIZE;
+        if (to > fileEnd) {
+            to = fileEnd;
+        }
+        if (from < to) {
+            hintBlocks(inode, from / BLOCK_SIZE, (to + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            r->ahead = to;
+        }
+    }
 }
 
-int wfs_rmdir (const char* path) {
-    return handleRemove(path, 1);
+// STATS_FILE reads from the text rendered when it was opened, so a reader that
+// takes it in pieces sees one consistent set of counters
+int readStats(char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    char *text = fi && fi->fh ? (char *) fi->fh : renderStats();
+    if (!text) {
+        return -ENOMEM;
+    }
+    size_t len = strlen(text);
+    int n = 0;
+    if (offset < len) {
+        n = len - offset < size ? len - offset : size;
+        memcpy(buf, text + offset, n);
+    }
+    if (!fi || !fi->fh) {
+        free(text);
+    }
+    return n;
 }
 
-int wfs_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+int readLocked(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    if (strcmp(path, STATS_FILE) == 0) {
+        return readStats(buf, size, offset, fi);
+    }
     int inodeIndex = parsePath(path);
     if (inodeIndex < 0) return -ENOENT;
 
     struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * inodeIndex);
-    if (offset >= inode->size) return 0;
+    off_t fileEnd = fileSize(inode);
+    if (offset >= fileEnd) return 0;
 
     // Update atime
     inode->atim = time(NULL);
-    // If RAID1 or RAID1v mode (we treat mode==1 as RAID1/1v), replicate inode after atime change
-    if (disk_count > 1 && sb->raid_mode == 1) {
+    // In the redundant modes (RAID1/1v is mode==1, then parity), replicate inode after atime change
+    if (metaReplicated()) {
         replicate_inode(inode);
     }
 
+    readAhead(inodeIndex, inode, offset, size, fileEnd);
+
+    // Buffered writes are laid over what the blocks hold; past the blocks' EOF
+    // they only hold zeros
     int bytesRead = 0;
-    while (bytesRead < size && bytesRead + offset < inode->size) {
+    while (bytesRead < size && bytesRead + offset < fileEnd) {
         off_t curOffset = bytesRead + offset;
         int blockIndex = curOffset / BLOCK_SIZE;
         int blockOff = curOffset % BLOCK_SIZE;
 
-        off_t blockAddr = 0;
-        if (blockIndex >= IND_BLOCK) {
-            if (!inode->blocks[IND_BLOCK]) break;  // No indirect block allocated
-            int indirectIndex = blockIndex - IND_BLOCK;
-            off_t *indirectBlock = (off_t *)(memStart + inode->blocks[IND_BLOCK]);
-            blockAddr = indirectBlock[indirectIndex];
-            if (!blockAddr) break; // No block allocated
+        int chunk = size - bytesRead;
+        int available = BLOCK_SIZE - blockOff;
+        if (chunk > available) chunk = available;
+        if (chunk > fileEnd - curOffset) chunk = fileEnd - curOffset;
+
+        char *src;
+        if (clusterCompressed(inode, blockIndex / CLUSTER_BLOCKS)) {
+            src = clusterData(inode, blockIndex / CLUSTER_BLOCKS);
+            if (src) {
+                src += (blockIndex % CLUSTER_BLOCKS) * BLOCK_SIZE;
+            }
         } else {
-            blockAddr = inode->blocks[blockIndex];
-            if (!blockAddr) break; // No block allocated
+            off_t *slot = blockSlot(inode, blockIndex, 0);
+            if (!slot || !*slot) {
+                // Hole: nothing was ever written here, so serve zeros without touching the disks
+                memset(buf + bytesRead, 0, chunk);
+                bytesRead += chunk;
+                continue;
+            }
+            src = verifiedBlock(*slot);
+        }
+        if (!src) {
+            return bytesRead ? bytesRead : -EIO;
+        }
+
+        memcpy(buf + bytesRead, src + blockOff, chunk);
+        diskCounters(src)->read += chunk;
+        bytesRead += chunk;
+    }
+
+    struct wb_buffer *b = findBuffer(inodeIndex);
+    if (b) {
+        off_t from = b->start > offset ? b->start : offset;
+        off_t to = b->end < offset + bytesRead ? b->end : offset + bytesRead;
+        if (from < to) {
+            memcpy(buf + (from - offset), b->data + (from - b->start), to - from);
+        }
+    }
+
+    return bytesRead;
+}
+
+// The blocks [*first, *last] a write to bytes [start, end) of a file may allocate
+// in. A cluster that goes through writeCluster is stored again as a whole.
+void writeSpan(struct wfs_inode *inode, off_t start, off_t end, int *first, int *last) {
+    *first = start / BLOCK_SIZE;
+    *last = (end - 1) / BLOCK_SIZE;
+    int c = *first / CLUSTER_BLOCKS;
+    if ((inode->flags & FS_COMPR_FL) || clusterCompressed(inode, c)) {
+        *first = c * CLUSTER_BLOCKS;
+    }
+    c = *last / CLUSTER_BLOCKS;
+    if ((inode->flags & FS_COMPR_FL) || clusterCompressed(inode, c)) {
+        *last = c * CLUSTER_BLOCKS + clusterSlots(c) - 1;
+    }
+}
+
+// Blocks a write to bytes [start, end) of a file may allocate: holes, shared blocks
+// it has to copy, and the indirect block. storeCluster reuses the blocks a cluster
+// has of its own, so it takes one new block for each of the others.
+int blocksNeeded(struct wfs_inode *inode, off_t start, off_t end) {
+    int first, last;
+    writeSpan(inode, start, end, &first, &last);
+    int need = last >= IND_BLOCK && !inode->blocks[IND_BLOCK];
+    for (int i = first; i <= last; i++) {
+        off_t *slot = blockSlot(inode, i, 0);
+        if (!slot || !*slot || *slot == CLUSTER_MARK || refCount(*slot) > 1) {
+            need++;
+        }
+    }
+    return need;
+}
+
+// blockAddr, which has one owner, is about to be shared. If a buffered write is going
+// to land on it, the flush will have to copy it: reserve a block for that. Returns
+// -1 if there is none left to reserve.
+int reserveCopy(off_t blockAddr) {
+    if (refCount(blockAddr) > 1) {
+        return 0;
+    }
+    for (int i = 0; i < WB_BUFFERS; i++) {
+        struct wb_buffer *b = &wbBuffers[i];
+        if (b->inode < 0) {
+            continue;
+        }
+        struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * b->inode);
+        int first, last;
+        writeSpan(inode, b->start, b->end, &first, &last);
+        for (int k = first; k <= last; k++) {
+            off_t *slot = blockSlot(inode, k, 0);
+            if (slot && *slot == blockAddr) {
+                if (freeDataBlocks() <= wbReserved) {
+                    return -1;
+                }
+                b->reserved++;
+                wbReserved++;
+                return 0;
+            }
         }
+    }
+    return 0;
+}
+
+// Write straight to the file's blocks, allocating them as needed. Returns the bytes
+// written, or an error if there were none.
+int writeBlocks(struct wfs_inode *inode, const char *buf, size_t size, off_t offset) {
+    int bytesWritten = 0;
+    int err = -ENOSPC;
+
+    // Only the blocks covered by [offset, offset + size) are allocated; anything
+    // skipped over stays a hole
+    while (bytesWritten < size) {
+        off_t curOffset = bytesWritten + offset;
+        int blockIndex = curOffset / BLOCK_SIZE;
+        int blockOff = curOffset % BLOCK_SIZE;
 
-        // Read from all disks into blockBuf
-        char blockBuf[disk_count][BLOCK_SIZE];
-        for (int d = 0; d < disk_count; d++) {
-            memcpy(blockBuf[d], disk_maps[d] + blockAddr, BLOCK_SIZE);
+        // Compressed clusters, and anything in a file that wants them, go through the
+        // cluster as a whole
+        int c = blockIndex / CLUSTER_BLOCKS;
+        if ((inode->flags & FS_COMPR_FL) || clusterCompressed(inode, c)) {
+            int rc = writeCluster(inode, c, buf + bytesWritten, size - bytesWritten, curOffset);
+            if (rc < 0) {
+                err = rc;
+                break;
+            }
+            bytesWritten += rc;
+            continue;
         }
 
-        // Majority voting logic
-        int bestDisk = 0;
-        int bestCount = 1;
-        // Find the block that has the highest count of matching replicas
-        for (int d = 0; d < disk_count; d++) {
-            int count = 1;
-            for (int d2 = d+1; d2 < disk_count; d2++) {
-                if (memcmp(blockBuf[d], blockBuf[d2], BLOCK_SIZE) == 0) {
-                    count++;
+        off_t *slot = blockSlot(inode, blockIndex, 1);
+        if (!slot) break;
+
+        int spaceInBlock = BLOCK_SIZE - blockOff;
+        int remain = size - bytesWritten;
+        int toWrite = (remain < spaceInBlock) ? remain : spaceInBlock;
+
+        // With dedup, a whole block that is stored already is shared instead of
+        // written: only the block pointer changes on the disks
+        int whole = toWrite == BLOCK_SIZE;
+        uint64_t hash = 0;
+        if (fingerprints && whole) {
+            hash = blockHash(buf + bytesWritten);
+            off_t same = findDuplicate(buf + bytesWritten, hash);
+            if (same && same != *slot && reserveCopy(same) < 0) {
+                same = 0;
+            }
+            if (same) {
+                if (same != *slot) {
+                    if (*slot && releaseBlock(*slot) && metaReplicated()) {
+                        replicate_dataMap();
+                    }
+                    shareBlock(same);
+                    *slot = same;
+                    if (blockIndex >= IND_BLOCK) {
+                        commitBlock(inode->blocks[IND_BLOCK]);
+                    }
                 }
+                dedupStats.shared++;
+                bytesWritten += toWrite;
+                continue;
+            }
+        }
+
+        // A shared block is copied before it is changed, unless it is replaced whole
+        off_t old = *slot;
+        if (!*slot || (whole && refCount(*slot) > 1)) {
+            off_t addr = allocDataBlock(dataGoal(inode, blockIndex));
+            if (!addr) break;
+            if (*slot) {
+                releaseBlock(*slot);
+            }
+            *slot = addr;
+        } else if (refCounts && !ownBlock(slot)) {
+            break;
+        }
+        if (*slot != old && blockIndex >= IND_BLOCK) {
+            commitBlock(inode->blocks[IND_BLOCK]);
+        }
+
+        char *block = blockPtr(*slot);
+
+        memcpy(block + blockOff, buf + bytesWritten, toWrite);
+        commitRange(*slot + blockOff, toWrite);
+
+        // A whole-block write leaves every replica identical
+        if (whole) {
+            setBitInMap(verifiedMap, (*slot - sb->d_blocks_ptr) / BLOCK_SIZE);
+            if (fingerprints) {
+                indexBlock(*slot, hash);
+            }
+        }
+
+        bytesWritten += toWrite;
+    }
+
+    // Overwrites and writes into holes must not grow the file
+    if (offset + bytesWritten > inode->size) {
+        inode->size = offset + bytesWritten;
+    }
+    replicate_inode(inode);
+
+    return bytesWritten ? bytesWritten : err;
+}
+
+// Write a buffer out to the file's blocks and free it. The data bitmap is replicated
+// once for all the blocks allocated. If only part of it can be written, the rest
+// stays buffered with as many blocks as are left reserved for it, and the error is
+// returned.
+int flushBuffer(struct wb_buffer *b) {
+    struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * b->inode);
+    size_t len = b->end - b->start;
+
+    wbFlushing = 1;
+    int rc = writeBlocks(inode, b->data, len, b->start);
+    wbFlushing = 0;
+    if (wbMapDirty && metaReplicated()) {
+        replicate_dataMap();
+    }
+    wbMapDirty = 0;
+
+    int done = rc > 0 ? rc : 0;
+    wbStats.bytes += done;
+    wbReserved -= b->reserved;
+    if (done < (int) len) {
+        // Out of blocks after all, or a read error in a compressed cluster
+        b->start += done;
+        memmove(b->data, b->data + done, len - done);
+        int need = blocksNeeded(inode, b->start, b->end);
+        int left = freeDataBlocks() - wbReserved;
+        b->reserved = need < left ? need : (left > 0 ? left : 0);
+        wbReserved += b->reserved;
+        return rc < 0 ? rc : -ENOSPC;
+    }
+    wbStats.flushes++;
+    b->inode = -1;
+    return OK;
+}
+
+int flushInode(int inodeIndex) {
+    struct wb_buffer *b = findBuffer(inodeIndex);
+    return b ? flushBuffer(b) : OK;
+}
+
+// Returns the first error; every buffer is still tried
+int flushAll() {
+    int err = OK;
+    for (int i = 0; i < WB_BUFFERS; i++) {
+        if (wbBuffers[i].inode >= 0) {
+            int rc = flushBuffer(&wbBuffers[i]);
+            err = err < 0 ? err : rc;
+        }
+    }
+    return err;
+}
+
+// Take a write into the file's write-back buffer, flushing and replacing the buffer
+// if the write doesn't extend its range. Returns 0 if the write has to go to the
+// blocks right away instead: it's too big, or there's no room to reserve blocks for.
+// Returns an error if the file's earlier writes could not be flushed.
+int bufferWrite(struct wfs_inode *inode, const char *buf, size_t size, off_t offset) {
+    if (options.nodelalloc || size == 0 || size > WB_SIZE ||
+        offset + size > (off_t) MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        return flushInode(inode->num);
+    }
+
+    struct wb_buffer *b = findBuffer(inode->num);
+    if (b && (offset < b->start || offset > b->end || offset + size - b->start > WB_SIZE)) {
+        int rc = flushBuffer(b);
+        if (rc < 0) {
+            return rc;
+        }
+        b = NULL;
+    }
+    if (!b) {
+        struct wb_buffer *oldest = &wbBuffers[0];
+        for (int i = 0; i < WB_BUFFERS && !b; i++) {
+            if (wbBuffers[i].inode < 0) {
+                b = &wbBuffers[i];
+            } else if (wbBuffers[i].lastUse < oldest->lastUse) {
+                oldest = &wbBuffers[i];
+            }
+        }
+        if (!b) {
+            // Another file's buffer that can't be flushed keeps its place
+            if (flushBuffer(oldest) < 0) {
+                return 0;
+            }
+            b = oldest;
+        }
+        b->inode = inode->num;
+        b->start = b->end = offset;
+        b->reserved = 0;
+    }
+
+    off_t end = offset + size > b->end ? offset + size : b->end;
+    int need = blocksNeeded(inode, b->start, end);
+    if (need > b->reserved) {
+        if (need - b->reserved > freeDataBlocks() - wbReserved) {
+            return flushBuffer(b);
+        }
+        wbReserved += need - b->reserved;
+        b->reserved = need;
+    }
+
+    memcpy(b->data + (offset - b->start), buf, size);
+    b->end = end;
+    b->lastUse = ++wbClock;
+    wbStats.buffered++;
+    return 1;
+}
+
+int writeLocked(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    int inodeIndex = parsePath(path);
+    if (inodeIndex < 0) {
+        return -ENOENT;
+    }
+    if (inSnapshot(path)) {
+        return -EROFS;
+    }
+
+    struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * inodeIndex);
+    inode->atim = time(NULL);
+    inode->mtim = time(NULL);
+
+    int rc = bufferWrite(inode, buf, size, offset);
+    if (rc) {
+        return rc < 0 ? rc : size;
+    }
+    return writeBlocks(inode, buf, size, offset);
+}
+
+// close() and fsync(): the file's buffered writes get their blocks now
+int flushLocked(const char *path) {
+    if (inStats(path)) {
+        return OK;
+    }
+    int inodeIndex = parsePath(path);
+    if (inodeIndex < 0) {
+        return -ENOENT;
+    }
+    return flushInode(inodeIndex);
+}
+
+int truncateLocked(const char *path, off_t length) {
+    if (inStats(path)) {
+        return -EACCES;
+    }
+    int inodeIndex = parsePath(path);
+    if (inodeIndex < 0) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * inodeIndex);
+    if (inode->mode & S_IFDIR) {
+        return -EISDIR;
+    }
+    if (inSnapshot(path)) {
+        return -EROFS;
+    }
+    if (length < 0) {
+        return -EINVAL;
+    }
+    if (length > (off_t) MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+    int rc = flushInode(inodeIndex);
+    if (rc < 0) {
+        return rc;
+    }
+
+    if (length < inode->size) {
+        int first = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int c = length / CLUSTER_SIZE;
+        int clusterOff = length % CLUSTER_SIZE;
+        if (clusterOff && clusterCompressed(inode, c)) {
+            // A compressed cluster can only be cut by storing it again
+            char data[CLUSTER_SIZE];
+            rc = loadCluster(inode, c, data);
+            if (rc < 0) {
+                return rc;
+            }
+            memset(data + clusterOff, 0, CLUSTER_SIZE - clusterOff);
+            rc = storeCluster(inode, c, data, clusterOff);
+            if (rc < 0) {
+                return rc;
+            }
+            first = (c + 1) * CLUSTER_BLOCKS;
+        } else {
+            // Zero the rest of the new last block so that growing the file again reads zeros
+            int tailOff = length % BLOCK_SIZE;
+            off_t *slot = tailOff ? blockSlot(inode, length / BLOCK_SIZE, 0) : NULL;
+            off_t old = slot ? *slot : 0;
+            if (old && refCounts && !ownBlock(slot)) {
+                return -ENOSPC;
             }
-            if (count > bestCount) {
-                bestCount = count;
-                bestDisk = d;
-            } else if (count == bestCount && d < bestDisk) {
-                // tie break with lowest disk index
-                bestDisk = d;
+            if (old && *slot != old && length / BLOCK_SIZE >= IND_BLOCK) {
+                commitBlock(inode->blocks[IND_BLOCK]);
             }
+            if (slot && *slot) {
+                memset(blockPtr(*slot) + tailOff, 0, BLOCK_SIZE - tailOff);
+                commitRange(*slot + tailOff, BLOCK_SIZE - tailOff);
+            }
+        }
+
+        releaseFileBlocks(inode, first);
+    }
+
+    // Growing only moves EOF; the new range is a hole until written
+    inode->size = length;
+    inode->mtim = time(NULL);
+    inode->ctim = inode->mtim;
+    replicate_inode(inode);
+
+    return OK;
+}
+
+// Point file dst at src's data by taking a reference to each of its blocks. dst gets
+// its own copy of the indirect block. The caller replicates dst.
+int shareFileBlocks(struct wfs_inode *src, struct wfs_inode *dst) {
+    for (int i = 0; i < MAX_FILE_BLOCKS; i++) {
+        off_t *slot = blockSlot(src, i, 0);
+        if (slot && *slot && *slot != CLUSTER_MARK && refCount(*slot) == UINT16_MAX) {
+            return -EMLINK;
+        }
+    }
+
+    if (src->blocks[IND_BLOCK]) {
+        off_t copy = allocDataBlock(dataGoal(dst, IND_BLOCK));
+        if (!copy) {
+            return -ENOSPC;
+        }
+        memcpy(blockPtr(copy), blockPtr(src->blocks[IND_BLOCK]), BLOCK_SIZE);
+        commitBlock(copy);
+        dst->blocks[IND_BLOCK] = copy;
+    }
+    memcpy(dst->blocks, src->blocks, IND_BLOCK * sizeof(off_t));
+
+    for (int i = 0; i < MAX_FILE_BLOCKS; i++) {
+        off_t *slot = blockSlot(src, i, 0);
+        if (slot && *slot && *slot != CLUSTER_MARK) {
+            shareBlock(*slot);
+        }
+    }
+    dst->size = src->size;
+    dst->flags = src->flags;
+    return OK;
+}
+
+// Create path as a copy-on-write clone of file src: only the inode and the block map
+// are written
+int cloneLocked(struct wfs_inode *src, const char *name) {
+    if (src->mode & S_IFDIR) {
+        return -EISDIR;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    if (inSnapshot(path)) {
+        return -EROFS;
+    }
+
+    int index = createNode(path, src->mode);
+    if (index < 0) {
+        return index;
+    }
+    struct wfs_inode *node = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * index);
+    int rc = shareFileBlocks(src, node);
+    if (rc < 0) {
+        handleRemove(path, 0);
+        return rc;
+    }
+    replicate_inode(node);
+    return OK;
+}
+
+// Free a directory together with everything under it
+void freeTree(struct wfs_inode *dir, int index) {
+    int perBlock = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    for (int k = 0; k < dir->size / sizeof(struct wfs_dentry); k++) {
+        struct wfs_dentry *entry = (struct wfs_dentry *)blockPtr(dir->blocks[k / perBlock]) + k % perBlock;
+        struct wfs_inode *child = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * entry->num);
+        if (child->mode & S_IFDIR) {
+            freeTree(child, entry->num);
+        } else {
+            freeInode(child, entry->num);
+        }
+    }
+    freeInode(dir, index);
+}
+
+// Fill the empty directory dst with clones of everything in src, recursively. The
+// root's SNAPSHOT_DIR is left out, so snapshots don't contain each other.
+int cloneTree(struct wfs_inode *src, struct wfs_inode *dst) {
+    int perBlock = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    for (int k = 0; k < src->size / sizeof(struct wfs_dentry); k++) {
+        struct wfs_dentry *entry = (struct wfs_dentry *)blockPtr(src->blocks[k / perBlock]) + k % perBlock;
+        if (src->num == 0 && strcmp(entry->name, SNAPSHOT_DIR + 1) == 0) {
+            continue;
         }
 
-        // Repair any corrupted disks if found
-        for (int d = 0; d < disk_count; d++) {
-            if (d != bestDisk && memcmp(blockBuf[bestDisk], blockBuf[d], BLOCK_SIZE) != 0) {
-                // Write the correct block to the corrupted disk
-                memcpy(disk_maps[d] + blockAddr, blockBuf[bestDisk], BLOCK_SIZE);
-            }
+        struct wfs_inode *child = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * entry->num);
+        int index = allocInode(dst->num, child->mode);
+        if (index < 0) {
+            return -ENOSPC;
+        }
+        replicate_inodeMap();
+        if (addDentry(dst, entry->name, index) < 0) {
+            freeBitFromMap(inodeMap, index);
+            replicate_inodeMap();
+            return -ENOSPC;
         }
 
-        // Serve the correct data from bestDisk
-        int chunk = size - bytesRead;
-        int available = BLOCK_SIZE - blockOff;
-        if (chunk > available) chunk = available;
+        struct wfs_inode *node = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * index);
+        memcpy(node, child, sizeof(struct wfs_inode));
+        node->num = index;
+        node->size = 0;
+        node->nlinks = 1;
+        memset(node->blocks, 0, sizeof(node->blocks));
+
+        int rc;
+        if (child->mode & S_IFDIR) {
+            dst->nlinks++;
+            rc = cloneTree(child, node);
+        } else {
+            rc = shareFileBlocks(child, node);
+        }
+        replicate_inode(node);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    return OK;
+}
 
-        memcpy(buf + bytesRead, blockBuf[bestDisk] + blockOff, chunk);
-        bytesRead += chunk;
+// Snapshot the whole tree as SNAPSHOT_DIR/name. Every file is cloned, so this costs
+// an inode per file and directory plus directory and indirect blocks, but no data.
+int snapshotLocked(const char *name) {
+    if (name[0] == '\0' || strchr(name, '/')) {
+        return -EINVAL;
+    }
+    if (strlen(name) >= MAX_NAME) {
+        return -ENAMETOOLONG;
+    }
+    if (parsePath(SNAPSHOT_DIR) < 0) {
+        int rc = createNode(SNAPSHOT_DIR, S_IFDIR | 0755);
+        if (rc < 0) {
+            return rc;
+        }
     }
 
-    return bytesRead;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", SNAPSHOT_DIR, name);
+    struct wfs_inode *root = (struct wfs_inode *)inodeStart;
+    int index = createNode(path, root->mode);
+    if (index < 0) {
+        return index;
+    }
+    struct wfs_inode *snap = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * index);
+    int rc = cloneTree(root, snap);
+    replicate_inode(snap);
+    if (rc < 0) {
+        // Out of inodes or blocks: take back what was made so far
+        struct wfs_inode *dir = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * parsePath(SNAPSHOT_DIR));
+        int blockIter, entry;
+        findDentry(dir, name, &blockIter, &entry);
+        removeDentry(dir, blockIter, entry);
+        dir->nlinks--;
+        replicate_inode(dir);
+        freeTree(snap, index);
+    }
+    return rc;
 }
 
-int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+int ioctlLocked(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    if (flags & FUSE_IOCTL_COMPAT) {
+        return -ENOSYS;
+    }
+
     int inodeIndex = parsePath(path);
     if (inodeIndex < 0) {
         return -ENOENT;
     }
-
     struct wfs_inode *inode = (struct wfs_inode *)(inodeStart + BLOCK_SIZE * inodeIndex);
-    inode->atim = time(NULL);
-    inode->mtim = time(NULL);
-
-    int bytesWritten = 0;
+    int rc = flushInode(inodeIndex);
+    if (rc < 0) {
+        return rc;
+    }
 
-    while (bytesWritten < size) {
-        off_t curOffset = bytesWritten + offset;
-        int blockOff;
-        char *block;
-        off_t *actualBlockOff = NULL;
-        char *indirectBlock = NULL;
-        int useIndirect = (curOffset >= IND_BLOCK * BLOCK_SIZE);
-
-        if (useIndirect) {
-            int indirectOff = curOffset - IND_BLOCK * BLOCK_SIZE;
-            int byteIndex = indirectOff / BLOCK_SIZE;
-            blockOff = indirectOff % BLOCK_SIZE;
-
-            if (byteIndex >= BLOCK_SIZE / sizeof(off_t)) {
-                break;
+    switch ((unsigned int) cmd) {
+        case WFS_IOC_SEEK_DATA:
+        case WFS_IOC_SEEK_HOLE: {
+            off_t res = seekDataHole(inode, *(off_t *)data, (unsigned int) cmd == WFS_IOC_SEEK_DATA);
+            if (res < 0) {
+                return res;
             }
-
-            if (!inode->blocks[IND_BLOCK]) {
-                int ind = findAndAllocFromMap(dataMap, dCount);
-                if (ind < 0) break;
-                inode->blocks[IND_BLOCK] = sb->d_blocks_ptr + BLOCK_SIZE * ind;
-
-                // Only replicate dataMap if RAID 1
-                if (disk_count > 1 && sb->raid_mode == 1) {
-                    replicate_dataMap();
-                }
-
-                replicate_block(inode->blocks[IND_BLOCK]);
+            *(off_t *)data = res;
+            return OK;
+        }
+        // As used by lsattr and chattr; setting FS_COMPR_FL affects data written from now on
+        case FS_IOC_GETFLAGS:
+            *(int *)data = inode->flags;
+            return OK;
+        case FS_IOC_SETFLAGS: {
+            int newFlags = *(int *)data;
+            if (newFlags & ~FS_COMPR_FL) {
+                return -EOPNOTSUPP;
             }
-
-            indirectBlock = memStart + inode->blocks[IND_BLOCK];
-            actualBlockOff = (off_t *)(indirectBlock + sizeof(off_t) * byteIndex);
-
-            if (!*actualBlockOff) {
-                int ind = findAndAllocFromMap(dataMap, dCount);
-                if (ind < 0) break;
-                *actualBlockOff = sb->d_blocks_ptr + BLOCK_SIZE * ind;
-
-                if (disk_count > 1 && sb->raid_mode == 1) {
-                    replicate_dataMap();
-                }
-
-                replicate_block(inode->blocks[IND_BLOCK]);
+            if (inSnapshot(path)) {
+                return -EROFS;
             }
-
-            block = memStart + *actualBlockOff;
-        } else {
-            int blockIndex = curOffset / BLOCK_SIZE;
-            blockOff = curOffset % BLOCK_SIZE;
-
-            if (!inode->blocks[blockIndex]) {
-                int ind = findAndAllocFromMap(dataMap, dCount);
-                if (ind < 0) break;
-                inode->blocks[blockIndex] = sb->d_blocks_ptr + BLOCK_SIZE * ind;
-
-                // Only replicate dataMap if RAID 1
-                if (disk_count > 1 && sb->raid_mode == 1) {
-                    replicate_dataMap();
-                }
+            inode->flags = newFlags;
+            inode->ctim = time(NULL);
+            replicate_inode(inode);
+            return OK;
+        }
+        case WFS_IOC_CLONE:
+        case WFS_IOC_SNAPSHOT: {
+            struct wfs_clone_arg *clone = data;
+            clone->name[sizeof(clone->name) - 1] = '\0';
+            if (!refCounts) {
+                return -EOPNOTSUPP;  // made without mkfs -R
             }
-
-            block = memStart + inode->blocks[blockIndex];
+            if ((unsigned int) cmd == WFS_IOC_SNAPSHOT) {
+                rc = flushAll();
+                return rc < 0 ? rc : snapshotLocked(clone->name);
+            }
+            return cloneLocked(inode, clone->name);
         }
-
-        int spaceInBlock = BLOCK_SIZE - blockOff;
-        int remain = size - bytesWritten;
-        int toWrite = (remain < spaceInBlock) ? remain : spaceInBlock;
-
-        memcpy(block + blockOff, buf + bytesWritten, toWrite);
-
-        off_t blockAddr = useIndirect ? (*actualBlockOff) : (inode->blocks[(curOffset / BLOCK_SIZE)]);
-        replicate_partial_block(blockAddr + blockOff, toWrite, block + blockOff);
-
-        bytesWritten += toWrite;
     }
-
-    inode->size += bytesWritten;
-    replicate_inode(inode);
-
-    return bytesWritten ? bytesWritten : -ENOSPC;
+    return -ENOTTY;
 }
 
 
-int wfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
+int readdirLocked(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
+    if (strcmp(path, STATS_DIR) == 0) {
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        filler(buf, STATS_FILE + strlen(STATS_DIR) + 1, NULL, 0);
+        return OK;
+    }
     int inodeNum = parsePath(path);
     if (inodeNum < 0) return -ENOENT;
 
@@ -633,8 +3034,8 @@ int wfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offse
     // Update atime
     inode->atim = time(NULL);
 
-    // Replicate inode changes in RAID 1
-    if (disk_count > 1 && sb->raid_mode == 1) {
+    // Replicate inode changes in the redundant modes
+    if (metaReplicated()) {
         replicate_inode(inode);
     }
 
@@ -645,7 +3046,7 @@ int wfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offse
     // Iterate over directory entries
     int blockIter = 0;
     while (inode->blocks[blockIter] != 0 && blockIter < IND_BLOCK) {
-        struct wfs_dentry *entries = (struct wfs_dentry *)(memStart + inode->blocks[blockIter]);
+        struct wfs_dentry *entries = (struct wfs_dentry *)blockPtr(inode->blocks[blockIter]);
         int k = -1;
         while (entries->name[0] != 0 && ++k < BLOCK_SIZE / sizeof(struct wfs_dentry)) {
             struct wfs_inode *curr = (struct wfs_inode *)(inodeStart + entries->num * BLOCK_SIZE);
@@ -671,31 +3072,266 @@ int wfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offse
     return OK;
 }
 
-static struct fuse_operations ops = {
-    .getattr = wfs_getattr,
-    .mknod   = wfs_mknod,
-    .mkdir   = wfs_mkdir,
-    .unlink  = wfs_unlink,
-    .rmdir   = wfs_rmdir,
-    .read    = wfs_read,
-    .write   = wfs_write,
-    .readdir = wfs_readdir,
-};
+// FUSE entry points. Background threads (reclaim, scrub, resync) touch the same metadata,
+// so every operation runs with fsLock held.
+int openLocked(const char *path, struct fuse_file_info *fi) {
+    if (strcmp(path, STATS_FILE) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        char *text = renderStats();
+        if (!text) {
+            return -ENOMEM;
+        }
+        // The size getattr gave is stale by the time it is read
+        fi->direct_io = 1;
+        fi->fh = (uintptr_t) text;
+        return OK;
+    }
+    if (strcmp(path, STATS_DIR) == 0) {
+        return OK;
+    }
+    return parsePath(path) < 0 ? -ENOENT : OK;
+}
 
-void usage(char *name) {
-   printf("Usage: %s disk1 [disk2 ... diskN] [FUSE options] mount_point\n",name);
+int wfs_getattr(const char* path, struct stat* stbuf) {
+    long long start = stats_clock();
+    trace_begin(path, 0, 0);
+    lockFs();
+    int rc = getattrLocked(path, stbuf);
+    unlockFs();
+    return stats_op(OP_GETATTR, start, rc);
 }
 
-void free_resources() {
-    // Unmap all disk maps and close file descriptors
-    if (disk_maps) {
-        for (int i = 0; i < disk_count; i++) {
-            if (disk_maps[i]) {
-                munmap(disk_maps[i], 0);  // 0 indicates freeing the entire mapping
+int wfs_mknod(const char* path, mode_t mode, dev_t rdev) {
+    long long start = stats_clock();
+    trace_begin(path, 0, 0);
+    lockFs();
+    int rc = mknodLocked(path, mode, rdev);
+    unlockFs();
+    return stats_op(OP_MKNOD, start, rc);
+}
+
+int wfs_mkdir(const char* path, mode_t mode) {
+    long long start = stats_clock();
+    trace_begin(path, 0, 0);
+    lockFs();
+    int rc = mknodLocked(path, mode | S_IFDIR, 0);
+    unlockFs();
+    return stats_op(OP_MKDIR, start, rc);
+}
+
+int wfs_unlink(const char* path) {
+    long long start = stats_clock();
+    trace_begin(path, 0, 0);
+    lockFs();
+    int rc = handleRemove(path, 0);
+    unlockFs();
+    return stats_op(OP_UNLINK, start, rc);
+}
+
+int wfs_rmdir(const char* path) {
+    long long start = stats_clock();
+    trace_begin(path, 0, 0);
+    lockFs();
+    int rc = handleRemove(path, 1);
+    unlockFs();
+    return stats_op(OP_RMDIR, start, rc);
+}
+
+int wfs_rename(const char *from, const char *to) {
+    long long start = stats_clock();
+    trace_begin(from, 0, 0);
+    lockFs();
+    int rc = renameLocked(from, to);
+    unlockFs();
+    return stats_op(OP_RENAME, start, rc);
+}
+
+int wfs_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    long long start = stats_clock();
+    trace_begin(path, offset, size);
+    lockFs();
+    int rc = readLocked(path, buf, size, offset, fi);
+    unlockFs();
+    return stats_op(OP_READ, start, rc);
+}
+
+int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    long long start = stats_clock();
+    trace_begin(path, offset, size);
+    lockFs();
+    int rc = writeLocked(path, buf, size, offset, fi);
+    unlockFs();
+    return stats_op(OP_WRITE, start, rc);
+}
+
+int wfs_truncate(const char *path, off_t length) {
+    long long start = stats_clock();
+    trace_begin(path, length, 0);
+    lockFs();
+    int rc = truncateLocked(path, length);
+    unlockFs();
+    return stats_op(OP_TRUNCATE, start, rc);
+}
+
+int wfs_ftruncate(const char *path, off_t length, struct fuse_file_info *fi) {
+    return wfs_truncate(path, length);
+}
+
+int wfs_flush(const char *path, struct fuse_file_info *fi) {
+    long long start = stats_clock();
+    trace_begin(path, 0, 0);
+    lockFs();
+    int rc = flushLocked(path);
+    unlockFs();
+    return stats_op(OP_FLUSH, start, rc);
+}
+
+int wfs_open(const char *path, struct fuse_file_info *fi) {
+    long long start = stats_clock();
+    trace_begin(path, 0, 0);
+    lockFs();
+    int rc = openLocked(path, fi);
+    unlockFs();
+    return stats_op(OP_OPEN, start, rc);
+}
+
+int wfs_release(const char *path, struct fuse_file_info *fi) {
+    if (fi && fi->fh) {
+        free((char *) fi->fh);
+        fi->fh = 0;
+        return OK;
+    }
+    return wfs_flush(path, fi);
+}
+
+int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    long long start = stats_clock();
+    trace_begin(path, 0, 0);
+    lockFs();
+    int rc = flushLocked(path);
+    if (rc == OK) {
+        metaWriteback();
+    }
+    if (rc == OK && disk_sync() < 0) {
+        rc = -EIO;
+    }
+    unlockFs();
+    return stats_op(OP_FSYNC, start, rc);
+}
+
+int wfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    long long start = stats_clock();
+    trace_begin(path, 0, 0);
+    lockFs();
+    int rc = ioctlLocked(path, cmd, arg, fi, flags, data);
+    unlockFs();
+    return stats_op(OP_IOCTL, start, rc);
+}
+
+int wfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
+    long long start = stats_clock();
+    trace_begin(path, offset, 0);
+    lockFs();
+    int rc = readdirLocked(path, buf, filler, offset, fi);
+    unlockFs();
+    return stats_op(OP_READDIR, start, rc);
+}
+
+void *wfs_init(struct fuse_conn_info *conn) {
+    startReclaimer();
+    startScrubber();
+    startSync();
+    startWriteback();
+    trace_start();
+    return NULL;
+}
+
+void wfs_destroy(void *private_data) {
+    lockFs();
+    if (flushAll() < 0) {
+        // There is no one left to return the error to
+        for (int i = 0; i < WB_BUFFERS; i++) {
+            if (wbBuffers[i].inode >= 0) {
+                fprintf(stderr, "Error: lost %lld buffered bytes of inode %d\n",
+                        (long long) (wbBuffers[i].end - wbBuffers[i].start), wbBuffers[i].inode);
             }
         }
-        free(disk_maps);
     }
+    unlockFs();
+    stopWriteback();
+    stopSync();
+    stopScrubber();
+    stopReclaimer();
+    trace_stop();
+    metaWriteback();
+    if (disk_sync() < 0) {
+        perror("sync");
+        return;
+    }
+
+    // Everything has reached the disks: the next mount can trust them, and the
+    // write-intent bits only matter to a mirror that is out or still being synced
+    if (identity) {
+        if (!options.degraded && syncDisk < 0) {
+            memset(wiMap, 0, (wiRegions + 7) / 8);
+            replicate_wiMap(0, (wiRegions - 1) / 8);
+        }
+        stampDisks(WFS_CLEAN);
+        if (disk_sync() < 0) {
+            perror("sync");
+        }
+    }
+}
+
+struct fuse_operations wfs_ops = {
+    .getattr   = wfs_getattr,
+    .mknod     = wfs_mknod,
+    .mkdir     = wfs_mkdir,
+    .unlink    = wfs_unlink,
+    .rmdir     = wfs_rmdir,
+    .rename    = wfs_rename,
+    .open      = wfs_open,
+    .read      = wfs_read,
+    .write     = wfs_write,
+    .truncate  = wfs_truncate,
+    .ftruncate = wfs_ftruncate,
+    .flush     = wfs_flush,
+    .release   = wfs_release,
+    .fsync     = wfs_fsync,
+    .readdir   = wfs_readdir,
+    .ioctl     = wfs_ioctl,
+    .init      = wfs_init,
+    .destroy   = wfs_destroy,
+};
+
+void wfs_usage(char *name) {
+   printf("Usage: %s disk1 [disk2 ... diskN] [FUSE options] mount_point\n",name);
+   printf("wfs options:\n");
+   printf("\t-o scrub_rate=KiB/s      read bandwidth cap for background scrubbing, 0 disables it (default 4096)\n");
+   printf("\t-o scrub_interval=secs   pause between scrub passes (default 86400)\n");
+   printf("\t-o degraded              RAID 1 only: mount with one mirror left out, tracking what it misses\n");
+   printf("\t-o missing=N             RAID 5/6 only: mount without the Nth member, reconstructing its blocks from parity\n");
+   printf("\t-o resync=N              bring the Nth disk listed up to date, copying only regions written while it was out\n");
+   printf("\t-o rebuild=N             copy or reconstruct everything onto the Nth disk listed, e.g. a blank replacement image\n");
+   printf("\t-o compress              compress the data of new files (see chattr +c)\n");
+   printf("\t-o nodelalloc            allocate blocks on every write instead of buffering writes until close\n");
+   printf("\t-o backend=NAME          how the disk images are accessed: mmap (default), pwrite or io_uring\n");
+   printf("\t-o direct                pwrite and io_uring only: write back with O_DIRECT\n");
+   printf("\t-o writeback_interval=secs  pwrite, io_uring and metacache only: pause between write-backs (default 5)\n");
+   printf("\t-o resident=MiB          pwrite and io_uring only: image pages kept in memory before clean ones are dropped, 0 for no limit (default 256)\n");
+   printf("\t-o readahead=blocks      largest window read ahead of sequential readers, 0 disables it (default 64)\n");
+   printf("\t-o group_blocks=N        data blocks per block group, which keep files near their directory (default 4096)\n");
+   printf("\t-o metacache             keep the bitmaps and inode table in memory, written back periodically and on fsync\n");
+   printf("\t-o trace=FILE            record recent operations of each thread, written to FILE on SIGUSR1 and at unmount\n");
+   printf("\t-o trace_stream          trace only: write to FILE every second, so the trace has every operation\n");
+}
+
+void wfs_unmount() {
+    // Unmap all disk maps and close file descriptors
+    disk_close();
+    free(disk_maps);
 
     if (fds) {
         for (int i = 0; i < disk_count; i++) {
@@ -705,13 +3341,236 @@ void free_resources() {
         }
         free(fds);
     }
+    free(diskIndex);
+
+    if (metaCache) {
+        munmap(metaCache, metaArenaSize);
+    }
+    free(metaDirtyMap);
+    free(pendingMap);
+    free(verifiedMap);
+    free(indexedMap);
+    free(rebuiltMap);
+    if (!wiOnDisk) {
+        free(wiMap);
+    }
+    free(reclaimQueue);
+    free(options.backend);
+    free(options.trace);
+}
+
+// Whether a superblock has the identity fields (see wfs.h)
+int hasIdentity(const struct wfs_sb *disk) {
+    return disk->i_bitmap_ptr >= (off_t) sizeof(struct wfs_sb) && disk->magic == WFS_MAGIC;
+}
+
+// Check the disks belong together and put each at the position its superblock
+// records. The disks named by position, the one being synced (which may be blank)
+// and the missing member, take the positions no disk claims. A disk that missed
+// mounts is synced as if named with resync or rebuild. Disks without identities are
+// used as given. Returns -1 if the disks can't be used.
+int placeDisks(int *syncArg) {
+    struct wfs_sb sbs[disk_count];
+    int ref = -1, found = 0;
+    for (int d = 0; d < disk_count; d++) {
+        memset(&sbs[d], 0, sizeof(struct wfs_sb));
+        if (fds[d] < 0 || d == *syncArg) {
+            continue;
+        }
+        if (pread(fds[d], &sbs[d], sizeof(struct wfs_sb), 0) < 0) {
+            perror("pread");
+            return -1;
+        }
+        ref = ref < 0 ? d : ref;
+        found += hasIdentity(&sbs[d]);
+    }
+    // A wrong disk count is reported by the caller
+    if (!found || sbs[ref].disk_count != disk_count + options.degraded) {
+        return 0;
+    }
+    int total = sbs[ref].disk_count;
+
+    int owner[total];
+    for (int k = 0; k < total; k++) {
+        owner[k] = -1;
+    }
+    uint64_t newest = 0;
+    for (int d = 0; d < disk_count; d++) {
+        struct wfs_sb *disk = &sbs[d];
+        if (fds[d] < 0 || d == *syncArg) {
+            continue;
+        }
+        if (!hasIdentity(disk) || memcmp(disk->uuid, sbs[ref].uuid, sizeof(disk->uuid)) != 0) {
+            fprintf(stderr, "Error: disk %d is not from the same filesystem as disk %d\n", d, ref);
+            return -1;
+        }
+        if (disk->version > WFS_VERSION) {
+            fprintf(stderr, "Error: disk %d has superblock version %u, newer than this wfs\n", d, disk->version);
+            return -1;
+        }
+        if (disk->disk_index < 0 || disk->disk_index >= total || owner[disk->disk_index] >= 0) {
+            fprintf(stderr, "Error: disk %d claims position %d, which is out of range or taken\n", d, disk->disk_index);
+            return -1;
+        }
+        owner[disk->disk_index] = d;
+        newest = disk->events > newest ? disk->events : newest;
+        mountStats.dirty |= disk->state != WFS_CLEAN;
+    }
+
+    // Positions left over go to the disks named by position; under degraded, the
+    // one left over belongs to the mirror that is out
+    int from[disk_count], placed[disk_count];
+    int n = 0, sync = -1, missing = -1;
+    for (int k = 0; k < total; k++) {
+        int d = owner[k];
+        if (d < 0 && *syncArg >= 0 && sync < 0) {
+            d = *syncArg;
+            sync = n;
+        } else if (d < 0 && options.missing >= 0 && missing < 0) {
+            d = options.missing;
+            missing = n;
+        } else if (d < 0) {
+            continue;
+        }
+        from[n] = d;
+        placed[n] = fds[d];
+        diskIndex[n] = k;
+        mountStats.reordered |= d != n;
+        n++;
+    }
+    memcpy(fds, placed, disk_count * sizeof(int));
+    if (mountStats.reordered) {
+        fprintf(stderr, "wfs: disks given out of order, using the order in their superblocks\n");
+    }
+    if (*syncArg >= 0) {
+        *syncArg = sync;
+        *(options.resync >= 0 ? &options.resync : &options.rebuild) = sync;
+    }
+    if (options.missing >= 0) {
+        options.missing = missing;
+    }
+
+    // Disks left out of earlier mounts have fewer events. One can be brought up to
+    // date the way it would be by hand: a mirror from the write-intent bitmap, a
+    // parity member by reconstruction.
+    int mode = sbs[ref].raid_mode;
+    int offline = options.degraded || options.missing >= 0;
+    for (int i = 0; i < disk_count; i++) {
+        struct wfs_sb *disk = &sbs[from[i]];
+        if (fds[i] < 0 || i == *syncArg || disk->events == newest) {
+            continue;
+        }
+        if (*syncArg >= 0 || offline || (mode != RAID1 && !raid_parity(mode))) {
+            fprintf(stderr, "Error: disk %d missed %llu mounts and can't be brought up to date in this mount\n",
+                    i, (unsigned long long) (newest - disk->events));
+            return -1;
+        }
+        fprintf(stderr, "wfs: disk %d missed %llu mounts, %s it\n", i,
+                (unsigned long long) (newest - disk->events), mode == RAID1 ? "resyncing" : "rebuilding");
+        *syncArg = i;
+        *(mode == RAID1 ? &options.resync : &options.rebuild) = i;
+        mountStats.stale = i;
+    }
+
+    identity = 1;
+    mountEvents = newest + 1;
+    return 0;
+}
+
+// Copy [off, off + len) from disk 0 to disk d, a block at a time and only where the
+// two differ
+void recoverRange(int d, off_t off, size_t len) {
+    for (size_t at = 0; at < len; at += BLOCK_SIZE) {
+        size_t n = len - at < BLOCK_SIZE ? len - at : BLOCK_SIZE;
+        if (memcmp(disk_maps[d] + off + at, memStart + off + at, n) != 0) {
+            copyToDisk(d, off + at, memStart + off + at, n);
+        }
+    }
+}
+
+// After an unclean shutdown, bring the copies back in line where writes may have
+// been in flight: the metadata every disk holds, and the data regions marked in the
+// write-intent bitmap. Disk 0 and the first member of a RAID 10 pair win; parity is
+// recomputed from the data. A block whose bit lost the race with the crash is still
+// caught by the checks on unverified reads and by the scrubber.
+void recoverRegions(off_t metaSize, off_t tailStart, size_t size) {
+    for (int d = 1; d < disk_count; d++) {
+        if (fds[d] >= 0) {
+            recoverRange(d, sizeof(struct wfs_sb), metaSize - sizeof(struct wfs_sb));
+            if (tailStart) {
+                recoverRange(d, tailStart, size - tailStart);
+            }
+        }
+    }
+
+    for (int r = 0; r < wiRegions; r++) {
+        if (!isBitSet(wiMap, r)) {
+            continue;
+        }
+        int blocks = dCount - r * WI_REGION < WI_REGION ? dCount - r * WI_REGION : WI_REGION;
+        off_t off = sb->d_blocks_ptr + (off_t) r * WI_REGION * BLOCK_SIZE;
+        off_t last = off + (off_t) (blocks - 1) * BLOCK_SIZE;
+        if (parity) {
+            for (int s = blockStripe(off); s <= blockStripe(last); s++) {
+                updateParity(s);
+            }
+        } else if (pairs) {
+            for (off_t b = off; b <= last; b += BLOCK_SIZE) {
+                if (memcmp(pairMember(b, 1), pairMember(b, 0), BLOCK_SIZE) != 0) {
+                    memcpy(pairMember(b, 1), pairMember(b, 0), BLOCK_SIZE);
+                }
+            }
+        } else {
+            for (int d = 1; d < disk_count; d++) {
+                if (d != syncDisk) {
+                    recoverRange(d, off, (size_t) blocks * BLOCK_SIZE);
+                }
+            }
+        }
+        mountStats.recovered++;
+    }
+
+    // A missing or resyncing mirror still needs the bits
+    if (!options.degraded && syncDisk < 0) {
+        memset(wiMap, 0, (wiRegions + 7) / 8);
+        replicate_wiMap(0, (wiRegions - 1) / 8);
+    }
+}
+
+// Move the bitmaps and inode table, the first metaSize bytes of disk 0, into the
+// metadata cache. Reserved huge pages are used if there are any, and transparent
+// huge pages are asked for otherwise.
+int openMetaCache(off_t metaSize) {
+    metaArenaSize = (metaSize + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    metaCache = mmap(NULL, metaArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    metaStats.hugetlb = metaCache != MAP_FAILED;
+    if (metaCache == MAP_FAILED) {
+        metaCache = mmap(NULL, metaArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (metaCache == MAP_FAILED) {
+            metaCache = NULL;
+            return -1;
+        }
+        madvise(metaCache, metaArenaSize, MADV_HUGEPAGE);
+    }
+    metaDirtyMap = calloc(metaArenaSize / META_PAGE, 1);
+    if (!metaDirtyMap) {
+        return -1;
+    }
+    metaCacheSize = metaSize;
+    memcpy(metaCache, memStart, metaSize);
+    inodeMap = metaCache + sb->i_bitmap_ptr;
+    inodeStart = metaCache + sb->i_blocks_ptr;
+    dataMap = metaCache + sb->d_bitmap_ptr;
+    return 0;
 }
 
-int main(int argc, char **argv) {
-    signal(SIGUSR1, debugSignal);
+int wfs_mount(int argc, char **argv, struct fuse_args *args) {
+    signal(SIGUSR1, SIG_IGN);
+    struct timespec mountStart, mountEnd;
+    clock_gettime(CLOCK_MONOTONIC, &mountStart);
 
     if (argc < 3) {
-        usage(argv[0]);
+        wfs_usage(argv[0]);
         return 1;
     }
 
@@ -722,15 +3581,17 @@ int main(int argc, char **argv) {
         return 1;
     }
     disk_maps = malloc(argc * sizeof(char *));
-    if (!disk_maps) {
+    diskIndex = malloc(argc * sizeof(int));
+    if (!disk_maps || !diskIndex) {
         perror("malloc disk_maps");
-        free(fds);
+        wfs_unmount();
         return 1;
     }
 
     for (int i = 0; i < argc; i++) {
         fds[i] = -1;  // Initialize file descriptors
         disk_maps[i] = NULL;
+        diskIndex[i] = i;
     }
 
     int argIndex = 1;
@@ -740,7 +3601,7 @@ int main(int argc, char **argv) {
             fds[disk_count] = open(argv[argIndex], O_RDWR);
             if (fds[disk_count] < 0) {
                 perror("open");
-                free_resources();
+                wfs_unmount();
                 return 1;
             }
             disk_count++;
@@ -750,33 +3611,139 @@ int main(int argc, char **argv) {
         }
     }
 
-    sb = mmap(NULL, sizeof(struct wfs_sb), PROT_WRITE | PROT_READ, MAP_SHARED, fds[0], 0);
+    *args = (struct fuse_args) FUSE_ARGS_INIT(argc - disk_count, argv + disk_count);
+    if (fuse_opt_parse(args, &options, wfsOpts, NULL) < 0) {
+        wfs_usage(argv[0]);
+        wfs_unmount();
+        return 1;
+    }
+    if (options.trace && trace_open(options.trace, options.traceStream) < 0) {
+        wfs_unmount();
+        return -1;
+    }
+
+    // The disk being synced may be blank, so the superblock comes from another
+    int syncArg = options.resync >= 0 ? options.resync : options.rebuild;
+    int offline = options.degraded || options.missing >= 0;
+    if ((options.resync >= 0 && options.rebuild >= 0) || (syncArg >= 0 && offline) || (options.degraded && options.missing >= 0)) {
+        fprintf(stderr, "Error: degraded, missing, resync and rebuild cannot be combined\n");
+        wfs_unmount();
+        return -1;
+    }
+    if (syncArg >= disk_count || (syncArg >= 0 && disk_count < 2) || options.missing > disk_count) {
+        fprintf(stderr, "Error: no disk %d\n", syncArg >= 0 ? syncArg : options.missing);
+        wfs_unmount();
+        return -1;
+    }
+    if (options.missing >= 0) {
+        memmove(fds + options.missing + 1, fds + options.missing, (disk_count - options.missing) * sizeof(int));
+        fds[options.missing] = -1;
+        disk_count++;
+    }
+    if (placeDisks(&syncArg) < 0) {
+        wfs_unmount();
+        return -1;
+    }
+    int sbDisk = 0;
+    while (fds[sbDisk] < 0 || sbDisk == syncArg) {
+        sbDisk++;
+    }
+
+    sb = mmap(NULL, sizeof(struct wfs_sb), PROT_WRITE | PROT_READ, MAP_SHARED, fds[sbDisk], 0);
     if (sb == MAP_FAILED) {
         perror("mmap");
-        free_resources();
+        wfs_unmount();
         return 1;
     }
 
-    if (sb->disk_count != disk_count) {
-        fprintf(stderr, "Error: number of disks does not match filesystem metadata. Expected %d got %d\n", (int)sb->disk_count, disk_count);
-        free_resources();
+    if (sb->disk_count != disk_count + options.degraded) {
+        fprintf(stderr, "Error: number of disks does not match filesystem metadata. Expected %d got %d\n", (int)sb->disk_count - offline, disk_count - (options.missing >= 0));
+        wfs_unmount();
+        return -1;
+    }
+    parity = raid_parity(sb->raid_mode);
+    pairs = sb->raid_mode == RAID10 ? disk_count / 2 : 0;
+    if ((options.degraded || options.resync >= 0) && sb->raid_mode != RAID1) {
+        fprintf(stderr, "Error: degraded and resync need RAID 1\n");
+        wfs_unmount();
+        return -1;
+    }
+    if ((options.missing >= 0 && !parity) || (options.rebuild >= 0 && (sb->raid_mode == RAID0 || sb->raid_mode == RAID10))) {
+        fprintf(stderr, "Error: missing needs RAID 5 or 6, rebuild needs RAID 1, 5 or 6\n");
+        wfs_unmount();
+        return -1;
+    }
+    if (options.degraded && !sb->wi_bitmap_ptr) {
+        // Without the region nothing would remember what the missing mirror needs
+        fprintf(stderr, "Error: image has no write-intent bitmap, cannot mount degraded\n");
+        wfs_unmount();
         return -1;
     }
 
-    int size = sizeof(struct wfs_sb) + sb->num_inodes / 8 + sb->num_data_blocks / 8
-        + BLOCK_SIZE * sb->num_inodes
-        + BLOCK_SIZE * sb->num_data_blocks;
+    // Mirrors are synced from disk 0, so the one being synced goes last. Parity members
+    // keep their place in the layout and are reconstructed instead.
+    if (syncArg >= 0 && !parity) {
+        int fd = fds[syncArg], index = diskIndex[syncArg];
+        memmove(fds + syncArg, fds + syncArg + 1, (disk_count - syncArg - 1) * sizeof(int));
+        memmove(diskIndex + syncArg, diskIndex + syncArg + 1, (disk_count - syncArg - 1) * sizeof(int));
+        fds[disk_count - 1] = fd;
+        diskIndex[disk_count - 1] = index;
+        syncDisk = disk_count - 1;
+    }
+    if (parity) {
+        failedDisk = syncArg >= 0 ? syncArg : options.missing;
+    }
+
+    long regionBlocks = raid_region_blocks(sb->raid_mode, disk_count, sb->num_data_blocks);
+    size_t size = sb->d_blocks_ptr + (size_t) BLOCK_SIZE * regionBlocks;
+    wiRegions = (sb->num_data_blocks + WI_REGION - 1) / WI_REGION;
+    if (sb->wi_bitmap_ptr) {
+        size = sb->wi_bitmap_ptr + (wiRegions + 7) / 8;
+    }
+    off_t sharedStart = sb->refcount_ptr;
+    if (sharedStart) {
+        size = sharedStart + sb->num_data_blocks * sizeof(uint16_t);
+    }
+    if (sb->fingerprint_ptr) {
+        size = sb->fingerprint_ptr + sb->num_fingerprints * sizeof(struct wfs_fingerprint);
+    }
+    stripeCount = parity ? regionBlocks : 0;
+    off_t metaSize = sb->d_blocks_ptr;
+    off_t tailStart = sb->wi_bitmap_ptr ? sb->wi_bitmap_ptr : sharedStart;
 
     if (munmap(sb, sizeof(struct wfs_sb)) < 0) {
         perror("munmap");
     }
 
     for (int i = 0; i < disk_count; i++) {
-        disk_maps[i] = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, fds[i], 0);
-        if (disk_maps[i] == MAP_FAILED) {
-            perror("mmap");
-            free_resources();
-            return 1;
+        struct stat st;
+        if (fds[i] >= 0 && (fstat(fds[i], &st) < 0 || (size_t) st.st_size < size)) {
+            fprintf(stderr, "Error: disk %d is smaller than the filesystem\n", i);
+            wfs_unmount();
+            return -1;
+        }
+    }
+    // A missing member gets a stand-in view, filled in as stripes are reconstructed
+    int backend = options.backend ? disk_backend(options.backend) : DISK_MMAP;
+    if (backend < 0 || (options.direct && backend == DISK_MMAP)) {
+        fprintf(stderr, "Error: unknown backend, or direct without pwrite or io_uring\n");
+        wfs_unmount();
+        return -1;
+    }
+    mapSize = size;
+    if (disk_open(backend, disk_count, fds, size, options.direct, (size_t) options.resident << 20, disk_maps) < 0) {
+        perror("disk_open");
+        wfs_unmount();
+        return 1;
+    }
+
+    // Metadata is small enough to copy up front; data follows in the background
+    int target = syncDisk >= 0 ? syncDisk : failedDisk;
+    if (target >= 0) {
+        char *from = disk_maps[target == sbDisk ? 0 : sbDisk];
+        memcpy(disk_maps[target], from, metaSize);
+        if (sharedStart) {
+            memcpy(disk_maps[target] + sharedStart, from + sharedStart, size - sharedStart);
         }
     }
 
@@ -789,7 +3756,96 @@ int main(int argc, char **argv) {
     dataMap = memStart + sb->d_bitmap_ptr;
     dataStart = memStart + sb->d_blocks_ptr;
 
-    int result = fuse_main(argc - disk_count, argv + disk_count, &ops, NULL);
-    free_resources();  // Clean up before exiting
-    return result;
+    wiOnDisk = sb->wi_bitmap_ptr != 0;
+    wiMap = wiOnDisk ? memStart + sb->wi_bitmap_ptr : calloc(wiRegions / 8 + 1, 1);
+
+    if (sharedStart) {
+        refCounts = (uint16_t *) (memStart + sb->refcount_ptr);
+    }
+    if (sb->fingerprint_ptr) {
+        fingerprints = (struct wfs_fingerprint *) (memStart + sb->fingerprint_ptr);
+        indexedMap = calloc(dCount / 8 + 1, 1);
+        if (!indexedMap) {
+            perror("calloc");
+            wfs_unmount();
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < WB_BUFFERS; i++) {
+        wbBuffers[i].inode = -1;
+    }
+    for (int i = 0; i < RA_FILES; i++) {
+        readaheads[i].inode = -1;
+    }
+
+    // Inodes are shared out over the groups in proportion, in whole bitmap bytes
+    groupBlocks = options.groupBlocks > 0 && options.groupBlocks < dCount ? options.groupBlocks : dCount;
+    groupCount = (dCount + groupBlocks - 1) / groupBlocks;
+    groupInodes = ((iCount + groupCount - 1) / groupCount + 7) / 8 * 8;
+
+    // Metadata is touched on every operation: read it in now rather than a fault
+    // at a time, and the tail regions (write-intent, refcounts, fingerprints) too.
+    // After a clean unmount that happens in the background, so mounting doesn't
+    // wait on it. The metadata cache reads disk 0's copy itself, once.
+    if ((identity && !mountStats.dirty) || options.metacache) {
+        if (!options.metacache) {
+            disk_willneed(memStart, metaSize);
+        }
+        if (tailStart) {
+            disk_willneed(memStart + tailStart, size - tailStart);
+        }
+    } else if (disk_populate(0, metaSize) < 0 || (tailStart && disk_populate(tailStart, size - tailStart) < 0)) {
+        perror("populate");
+    }
+
+    pendingMap = calloc(dCount / 8 + 1, 1);
+    verifiedMap = calloc(dCount / 8 + 1, 1);
+    if (!pendingMap || !verifiedMap || !wiMap) {
+        perror("calloc");
+        wfs_unmount();
+        return 1;
+    }
+
+    rebuiltMap = calloc(stripeCount / 8 + 1, 1);
+    if (!rebuiltMap) {
+        perror("calloc");
+        wfs_unmount();
+        return 1;
+    }
+    if (identity && mountStats.dirty) {
+        recoverRegions(metaSize, tailStart, size);
+    }
+    if (failedDisk >= 0 && options.rebuild >= 0) {
+        syncStats.regions = stripeCount;
+    }
+
+    if (syncDisk >= 0) {
+        if (options.rebuild >= 0) {
+            for (int r = 0; r < wiRegions; r++) {
+                setBitInMap(wiMap, r);
+            }
+        }
+        replicate_wiMap(0, (wiRegions - 1) / 8);
+        for (int r = 0; r < wiRegions; r++) {
+            syncStats.regions += isBitSet(wiMap, r);
+        }
+    }
+
+    if (options.metacache && openMetaCache(metaSize) < 0) {
+        perror("metacache");
+        wfs_unmount();
+        return 1;
+    }
+
+    // Mark the disks in use before anything is written to them
+    stampDisks(WFS_DIRTY);
+    if (identity && disk_sync() < 0) {
+        perror("sync");
+        wfs_unmount();
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mountEnd);
+    mountStats.msecs = (mountEnd.tv_sec - mountStart.tv_sec) * 1e3 + (mountEnd.tv_nsec - mountStart.tv_nsec) / 1e6;
+    return 0;
 }
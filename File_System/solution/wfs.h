@@ -1,4 +1,6 @@
+#include <stdint.h>
 #include <time.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 
 #define BLOCK_SIZE (512)
@@ -13,16 +15,51 @@
   `mkfs` writes the superblock to offset 0 of the disk image. 
   The disk image will have this format:
 
-          d_bitmap_ptr       d_blocks_ptr
-               v                  v
-+----+---------+---------+--------+--------------------------+
-| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        |
-+----+---------+---------+--------+--------------------------+
+          d_bitmap_ptr       d_blocks_ptr                          wi_bitmap_ptr
+               v                  v                                        v
++----+---------+---------+--------+--------------------------+-------------+
+| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        | WRITEINTENT |
++----+---------+---------+--------+--------------------------+-------------+
 0    ^                   ^
 i_bitmap_ptr        i_blocks_ptr
 
+  WRITEINTENT has one bit per WI_REGION data blocks. A bit is set while that
+  region holds writes that some mirror has not seen yet (see wfs -o degraded), or
+  that may not have reached every disk (see WFS_DIRTY).
+
+  Images made with mkfs -R or -D follow WRITEINTENT with more regions, at
+  refcount_ptr and (-D only) fingerprint_ptr:
+
+  REFCOUNTS     a uint16_t per data block: how many block slots point at it once it
+                is shared by clones, snapshots or deduplication, 0 for blocks that
+                never were
+  FINGERPRINTS  an open-addressed hash table of num_fingerprints entries mapping
+                the hash of a block's contents to the block
+
 */
 
+#define WI_REGION  (64)
+
+/*
+  Superblocks with magic set to WFS_MAGIC carry the identity fields. Older images
+  have no room for them: their i_bitmap_ptr is below sizeof(struct wfs_sb), and
+  they mount without any of the checks below.
+
+  wfs refuses disks whose uuid differs, and puts the disks at the positions their
+  disk_index records, whatever order they are given in. Every mount sets state to
+  WFS_DIRTY and raises events on the disks it uses; a clean unmount sets WFS_CLEAN.
+  A disk with fewer events than the others missed a mount and is stale.
+
+  While mounted, WRITEINTENT also marks the regions written since the last clean
+  unmount. Mounting a WFS_DIRTY image brings the copies of just those regions back
+  in line; a WFS_CLEAN one is trusted as it is.
+*/
+
+#define WFS_MAGIC    (0x31736677)  /* "wfs1" on disk */
+#define WFS_VERSION  (1)
+#define WFS_CLEAN    (0)
+#define WFS_DIRTY    (1)
+
 // Superblock
 struct wfs_sb {
     size_t num_inodes;
@@ -34,8 +71,30 @@ struct wfs_sb {
     // Extend after this line
     int raid_mode;
     int disk_count;
+    off_t wi_bitmap_ptr;  /* 0 on images made before the region existed */
+    off_t refcount_ptr;   /* 0 unless made with mkfs -R or -D */
+    off_t fingerprint_ptr;  /* 0 unless made with mkfs -D */
+    size_t num_fingerprints;
+    // Identity, on images made since it was added (see WFS_MAGIC). The fields from
+    // disk_index on are each disk's own; the rest is the same on every disk.
+    uint32_t magic;       /* WFS_MAGIC */
+    uint32_t version;     /* WFS_VERSION of the mkfs that made it */
+    unsigned char uuid[16];  /* random, shared by the disks of one filesystem */
+    int disk_index;       /* this disk's position in the array */
+    int state;            /* WFS_CLEAN, or WFS_DIRTY while mounted */
+    uint64_t events;      /* mount count; lower than the others' on a disk left out */
 };
 
+// Fingerprint table entry. block is the data block index + 1: 0 marks a slot that
+// was never used, FP_DELETED one whose block left the table.
+struct wfs_fingerprint {
+    uint64_t hash;
+    int block;
+    int unused;
+};
+
+#define FP_DELETED (-1)
+
 // Inode
 struct wfs_inode {
     int     num;      /* Inode number */
@@ -50,6 +109,23 @@ struct wfs_inode {
     time_t ctim;      /* Time of last status change */
 
     off_t blocks[N_BLOCKS];
+    int     flags;    /* FS_*_FL bits; only FS_COMPR_FL is used */
+};
+
+/*
+  File data is grouped into clusters of CLUSTER_BLOCKS consecutive blocks. In a file
+  with FS_COMPR_FL set, a cluster that compresses into fewer blocks is stored as
+  those blocks, holding a struct wfs_cluster and then the LZ4 stream, followed by
+  CLUSTER_MARK in the next block slot. The cluster's other slots are 0.
+*/
+
+#define CLUSTER_BLOCKS (8)
+#define CLUSTER_SIZE   (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define CLUSTER_MARK   ((off_t) 1)  /* never a block address: those start at d_blocks_ptr */
+
+struct wfs_cluster {
+    int length;       /* Bytes of LZ4 stream after this header */
+    int size;         /* Bytes the stream decompresses to */
 };
 
 // Directory entry
@@ -57,3 +133,22 @@ struct wfs_dentry {
     char name[MAX_NAME];
     int num;
 };
+
+// ioctls understood by wfs (issued on a file inside the mount)
+#define WFS_IOC_SEEK_DATA _IOWR('W', 1, off_t)  /* in: offset, out: start of next data */
+#define WFS_IOC_SEEK_HOLE _IOWR('W', 2, off_t)  /* in: offset, out: start of next hole */
+
+// Copy-on-write clones and snapshots, on images with reference counts (mkfs -R)
+#define SNAPSHOT_DIR "/.snapshots"  /* read-only: its entries can only be removed */
+
+struct wfs_clone_arg {
+    char name[256];   /* clone: path of the new file from the mount root; snapshot: its name */
+};
+
+#define WFS_IOC_CLONE    _IOW('W', 3, struct wfs_clone_arg)  /* on a file: create name sharing its blocks */
+#define WFS_IOC_SNAPSHOT _IOW('W', 4, struct wfs_clone_arg)  /* anywhere: snapshot the tree as SNAPSHOT_DIR/name */
+
+// Counters and state of the mounted filesystem, as text (see wfs's stats.h). Neither
+// path is on the disks, and the root's listing leaves them out.
+#define STATS_DIR  "/.wfs"
+#define STATS_FILE "/.wfs/stats"
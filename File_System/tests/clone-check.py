@@ -0,0 +1,55 @@
+#!/usr/bin/python3
+
+# clone a file and snapshot the tree with the wfs ioctls, then change the file and
+# check the clone and the snapshot still hold what was written, and that the
+# snapshot can't be written to
+# run against a filesystem made with mkfs -R
+
+import errno
+import fcntl
+import os
+import sys
+
+# _IOW('W', n, struct wfs_clone_arg), see wfs.h
+def wfs_iow(n, size):
+    return (1 << 30) | (size << 16) | (ord('W') << 8) | n
+
+WFS_IOC_CLONE = wfs_iow(3, 256)
+WFS_IOC_SNAPSHOT = wfs_iow(4, 256)
+
+def clone_arg(name):
+    return name.encode().ljust(256, b"\0")
+
+size = int(sys.argv[1])
+data = os.urandom(size)
+
+os.chdir("mnt")
+
+with open("file1", "wb") as fh:
+    fh.write(data)
+
+with open("file1", "rb") as fh:
+    fcntl.ioctl(fh, WFS_IOC_CLONE, clone_arg("/file2"))
+    fcntl.ioctl(fh, WFS_IOC_SNAPSHOT, clone_arg("s1"))
+
+with open("file1", "r+b") as fh:
+    fh.write(b"x" * 512)
+
+for name in ["file2", ".snapshots/s1/file1", ".snapshots/s1/file2"]:
+    with open(name, "rb") as fh:
+        if fh.read() != data:
+            print(f"{name} does not match data written before the change")
+            exit(1)
+
+try:
+    with open(".snapshots/s1/file1", "r+b") as fh:
+        fh.write(b"x")
+    print("write to snapshot succeeded")
+    exit(1)
+except OSError as e:
+    if e.errno != errno.EROFS:
+        print(e)
+        exit(1)
+
+print("Correct")
+exit(0)
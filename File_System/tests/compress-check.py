@@ -0,0 +1,29 @@
+#!/usr/bin/python3
+
+# write a highly compressible file in small segments and read it back
+# run against a mount with -o compress, so the file is stored compressed
+
+import os
+import sys
+
+name = sys.argv[1]
+size = int(sys.argv[2])
+segment = 100
+
+line = b"the same line of text, over and over again\n"
+data = (line * (size // len(line) + 1))[:size]
+
+os.chdir("mnt")
+
+with open(name, "wb") as fh:
+    for i in range(0, size, segment):
+        fh.write(data[i:i + segment])
+
+with open(name, "rb") as fh:
+    contents = fh.read()
+    if contents != data:
+        print(f"{name} readback does not match data written")
+        exit(1)
+
+print("Correct")
+exit(0)
@@ -0,0 +1,30 @@
+#!/usr/bin/python3
+
+# write the same data to two files, then change the first file and check the
+# second one still reads back what was written
+# run against a filesystem made with mkfs -D, so the two files share blocks
+
+import os
+import sys
+
+size = int(sys.argv[1])
+data = os.urandom(size)
+
+os.chdir("mnt")
+
+for name in ["file1", "file2"]:
+    with open(name, "wb") as fh:
+        fh.write(data)
+
+with open("file1", "r+b") as fh:
+    fh.write(b"x" * 512)
+
+changed = b"x" * 512 + data[512:]
+for (name, expected) in [("file1", changed), ("file2", data)]:
+    with open(name, "rb") as fh:
+        if fh.read() != expected:
+            print(f"{name} readback does not match data written")
+            exit(1)
+
+print("Correct")
+exit(0)
@@ -0,0 +1,42 @@
+#!/usr/bin/python3
+
+# write two files in small interleaved segments without closing them, checking
+# that sizes and contents are visible before the writes reach the disks
+
+import os
+import sys
+
+size = int(sys.argv[1])
+segment = 100
+names = ["file1", "file2"]
+data = {name: os.urandom(size) for name in names}
+
+os.chdir("mnt")
+
+# unbuffered, so every segment is its own write
+fhs = {name: open(name, "wb", buffering=0) for name in names}
+
+for i in range(0, size, segment):
+    for name in names:
+        fhs[name].write(data[name][i:i + segment])
+
+for name in names:
+    if os.stat(name).st_size != size:
+        print(f"{name} has the wrong size before close")
+        exit(1)
+    with open(name, "rb") as fh:
+        if fh.read() != data[name]:
+            print(f"{name} readback before close does not match data written")
+            exit(1)
+
+for fh in fhs.values():
+    fh.close()
+
+for name in names:
+    with open(name, "rb") as fh:
+        if fh.read() != data[name]:
+            print(f"{name} readback does not match data written")
+            exit(1)
+
+print("Correct")
+exit(0)
@@ -0,0 +1,92 @@
+#!/usr/bin/python3
+
+# check an unmounted filesystem with wfs-fsck, damage it, and check that wfs-fsck
+# finds the damage, repairs it with -y and finds nothing afterwards; or with --stale,
+# that a disk which missed a mount is left alone
+
+import argparse
+import subprocess
+import wfsverify
+
+FSCK = "../solution/wfs-fsck"
+
+def fsck(disks, *opts):
+    """Run wfs-fsck and return its exit status and output."""
+    run = subprocess.run([FSCK, *opts, *disks], capture_output=True, text=True)
+    return run.returncode, run.stdout
+
+def expect(what, disks, status, *opts):
+    found, out = fsck(disks, *opts)
+    if found != status:
+        print(f"{what}: wfs-fsck exited {found}, expected {status}")
+        print(out, end="")
+        exit(1)
+    return out
+
+def patch(disk, offset, data):
+    with open(disk, "r+b") as diskf:
+        diskf.seek(offset)
+        diskf.write(data)
+
+def damage(disks):
+    """Damage metadata the same way on every disk, and one data block on the last."""
+    fs = wfsverify.WfsState(disks[0])
+    blocks = fs.list_allocated_datablocks()
+    inodes = fs.list_allocated_inodes()
+    free_inode = min(set(range(fs.get_sb_inodes())) - set(inodes))
+    root = fs.read_inode(0)
+
+    for disk in disks:
+        with open(disk, "rb") as diskf:
+            diskf.seek(fs.get_dbit() + blocks[-1] // 8)
+            dbit = diskf.read(1)[0]
+            diskf.seek(fs.get_ibit() + free_inode // 8)
+            ibit = diskf.read(1)[0]
+        # an in-use block marked free, a wrong link count, an inode nothing names
+        patch(disk, fs.get_dbit() + blocks[-1] // 8, bytes([dbit & ~(1 << blocks[-1] % 8)]))
+        patch(disk, fs.get_iblock_region() + 24, (root['nlinks'] + 1).to_bytes(4, 'little'))
+        patch(disk, fs.get_ibit() + free_inode // 8, bytes([ibit | 1 << free_inode % 8]))
+
+    # mirrors that disagree
+    patch(disks[-1], fs.get_dblock_region() + blocks[-1] * fs.blksize, b'\xa5' * 16)
+
+def contents(disks):
+    images = []
+    for disk in disks:
+        with open(disk, "rb") as diskf:
+            images.append(diskf.read())
+    return images
+
+def stale(disks):
+    """The first disk missed a mount: wfs-fsck checks against the others and leaves
+    it to wfs, even with -y."""
+    before = contents(disks)
+    out = expect("stale disk", disks, 0)
+    if not out.startswith(f"{disks[0]}: missed"):
+        print(f"stale disk: not reported\n{out}", end="")
+        exit(1)
+    expect("stale disk with -y", disks, 0, "-y")
+    if contents(disks) != before:
+        print("stale disk with -y: disks changed")
+        exit(1)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--disks", nargs="+", help="list of disks")
+    parser.add_argument("--stale", action="store_true", help="the first disk missed a mount")
+    args = parser.parse_args()
+
+    if args.stale:
+        stale(args.disks)
+        print("Correct")
+        exit(0)
+
+    expect("clean filesystem", args.disks, 0)
+    damage(args.disks)
+    out = expect("damaged filesystem", args.disks, 4)
+    if len(out.splitlines()) < 6:
+        print(f"damaged filesystem: expected four problems, found\n{out}", end="")
+        exit(1)
+    expect("repair", args.disks, 1, "-y")
+    expect("repaired filesystem", args.disks, 0)
+    print("Correct")
@@ -503,4 +503,207 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 			  (mount-cmd 3 "mnt")
 			  "diff mnt/file1 file1.test")
 		    "; ")
-		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))))
+		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'filesystem-init-and-workload)
+;;    (desc fs-state op post-state post-extra-blocks raid numdisks output rc)
+    (configs . (("raid1 -- write: sparse file reads zeros in the hole" ,'()
+		 "./sparse-check.py file1 6000" ; one data block plus the indirect block
+		 ,'(("file1" . 0)) 2 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		("raid1 -- truncate: shrink file with indirect block" ,'(("file1" . 8192))
+		 "truncate -s 1000 mnt/file1"
+		 ,'(("file1" . 1000)) 0 "1" 2 "Correct\nCorrect" 0)
+		("raid1 -- rename: move file into a directory" ,'(("file1" . 600) ())
+		 "mv mnt/file1 mnt/d1/file1"
+		 ,'((("file1" . 600))) 0 "1" 2 "Correct\nCorrect" 0)
+		("raid1 -- resync a mirror that missed writes while degraded" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -o degraded -s mnt" (disk-path "test-disk1"))
+			 "./read-write.py 1 10" ; written to disk1 only
+			 "fusermount -u mnt"
+			 (format "../solution/wfs %s %s -o resync=1 -s mnt"
+				 (disk-path "test-disk1") (disk-path "test-disk2"))
+			 ;; wait for the resync to copy the dirty region
+			 "timeout 10 sh -c 'until grep -q \"^Resync:.*, done\" mnt/.wfs/stats; do sleep 0.1; done'")
+		   "; ")
+		 ,'(("file1" . 1000)) 0 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		("raid5 -- readback with a missing disk, then rebuild it" ,'()
+		 ,(string-join
+		   (list "./read-write.py 1 10"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 (format "../solution/wfs %s %s -o missing=1 -s mnt"
+				 (disk-path "test-disk1") (disk-path "test-disk3"))
+			 "diff mnt/file1 file1.test" ; disk2's blocks come from parity
+			 "fusermount -u mnt"
+			 (format "truncate -s 0 %s" (disk-path "test-disk2"))
+			 (format "truncate -s 1M %s" (disk-path "test-disk2"))
+			 (format "../solution/wfs %s -o rebuild=1 -s mnt"
+				 (string-join (gen-disks 3) " "))
+			 ;; disk2 is rebuilt online from parity
+			 "timeout 10 sh -c 'until grep -q \"^Resync:.*, done\" mnt/.wfs/stats; do sleep 0.1; done'"
+			 "diff mnt/file1 file1.test")
+		   "; ")
+		 ,'(("file1" . 1000)) 0 "5" 3 "Correct\nCorrect\nCorrect" 0)
+		("raid10 -- write and read back across two mirror pairs" ,'()
+		 "./read-write.py 1 10"
+		 ,'(("file1" . 1000)) 0 "10" 4 "Correct\nCorrect\nCorrect" 0)
+		("raid1 -- compress: compressible file is stored in one block" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -o compress -s mnt"
+				 (string-join (gen-disks 2) " "))
+			 "./compress-check.py file1 4000")
+		   "; ")
+		 ,'(("file1" . 4000)) -8 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		("raid1 -- dedup: identical files share blocks until one is changed" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (concat "../solution/mkfs -D " (default-fs-mkfs-args "1" 2))
+			 (format "../solution/wfs %s -s mnt"
+				 (string-join (gen-disks 2) " "))
+			 "./dedup-check.py 3072")
+		   "; ")
+		 ,'(("file1" . 3072) ("file2" . 3072)) -5 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		("raid1 -- clone and snapshot share blocks until the file is changed" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (concat "../solution/mkfs -R " (default-fs-mkfs-args "1" 2))
+			 (format "../solution/wfs %s -s mnt"
+				 (string-join (gen-disks 2) " "))
+			 "./clone-check.py 3072")
+		   "; ")
+		 ;; .snapshots/s1 holds both files again
+		 ,'(("file1" . 3072) ("file2" . 3072) ((("file1" . 3072) ("file2" . 3072))))
+		 -17 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		("raid1 -- delayed allocation: interleaved small writes visible before close" ,'()
+		 "./delalloc-check.py 4000"
+		 ,'(("file1" . 4000) ("file2" . 4000)) 0 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		("raid1 -- pwrite backend: interleaved writes reach the images" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -o backend=pwrite -s mnt"
+				 (string-join (gen-disks 2) " "))
+			 "./read-write.py 6 80")
+		   "; ")
+		 ,(n-file-directory 6 8000) 0 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		("raid1 -- readahead: large files read back sequentially" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -o readahead=16 -s mnt"
+				 (string-join (gen-disks 2) " "))
+			 "./read-write.py 2 300")
+		   "; ")
+		 ,(n-file-directory 2 30000) 0 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		("raid1 -- block groups: directories and their files placed together" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -o group_blocks=64 -s mnt"
+				 (string-join (gen-disks 2) " "))
+			 (concat "mkdir mnt/d1 mnt/d2"
+				 " && head -c 3000 /dev/urandom > mnt/d1/file1"
+				 " && head -c 3000 /dev/urandom > mnt/d2/file1"
+				 " && ./read-write.py 2 30")
+			 "fusermount -u mnt"
+			 ;; d1 and d2 in groups of their own, each holding its file
+			 (format "./group-check.py --group-blocks 64 --disks %s"
+				 (string-join (gen-disks 2) " "))
+			 (mount-cmd 2 "mnt"))
+		   "; ")
+		 ,'(("file1" . 3000) ("file2" . 3000) (("file1" . 3000)) (("file1" . 3000)))
+		 0 "1" 2 "Correct\nCorrect\nCorrect\nCorrect" 0)
+		("raid1 -- stats file: operations counted and served read-only" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -s mnt"
+				 (string-join (gen-disks 2) " "))
+			 "./stats-check.py 2000")
+		   "; ")
+		 ,'(("file1" . 2000)) 0 "1" 2 "Correct\nCorrect\nCorrect" 0)
+		("raid1 -- wfs-fsck: damage found and repaired" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -s mnt"
+				 (string-join (gen-disks 2) " "))
+			 "./read-write.py 2 30"
+			 "fusermount -u mnt"
+			 (format "./fsck-check.py --disks %s"
+				 (string-join (gen-disks 2) " "))
+			 (mount-cmd 2 "mnt"))
+		   "; ")
+		 ,'(("file1" . 3000) ("file2" . 3000)) 0 "1" 2 "Correct\nCorrect\nCorrect\nCorrect" 0)
+		("raid1 -- superblock identity: disks given out of order, foreign disk refused" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "./identity-check.py --disks %s"
+				 (string-join (gen-disks 2) " "))
+			 (format "../solution/wfs %s -s mnt"
+				 (string-join (reverse (gen-disks 2)) " "))
+			 "./read-write.py 2 30"
+			 "fusermount -u mnt"
+			 (format "./identity-check.py --disks %s"
+				 (string-join (gen-disks 2) " "))
+			 (mount-cmd 2 "mnt"))
+		   "; ")
+		 ,'(("file1" . 3000) ("file2" . 3000)) 0 "1" 2 "Correct\nCorrect\nCorrect\nCorrect\nCorrect" 0)
+		("raid1 -- metadata cache: bitmaps and inodes written back at unmount" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -o metacache -s mnt"
+				 (string-join (gen-disks 2) " "))
+			 "./read-write.py 2 30"
+			 "fusermount -u mnt"
+			 (format "./identity-check.py --disks %s"
+				 (string-join (gen-disks 2) " "))
+			 (mount-cmd 2 "mnt"))
+		   "; ")
+		 ,'(("file1" . 3000) ("file2" . 3000)) 0 "1" 2 "Correct\nCorrect\nCorrect\nCorrect" 0)
+		("raid1 -- operation trace: written at unmount and decoded" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -o trace=%s -s mnt"
+				 (string-join (gen-disks 2) " ") (disk-path "test-disk.trace"))
+			 "./read-write.py 2 30"
+			 "fusermount -u mnt"
+			 (format "./trace-check.py --trace %s --bytes 6000"
+				 (disk-path "test-disk.trace"))
+			 (mount-cmd 2 "mnt"))
+		   "; ")
+		 ,'(("file1" . 3000) ("file2" . 3000)) 0 "1" 2 "Correct\nCorrect\nCorrect\nCorrect" 0)
+		("raid1 -- wfs-fsck: a mirror that missed a mount is left to wfs" ,'()
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "../solution/wfs %s -o degraded -s mnt" (disk-path "test-disk2"))
+			 "./read-write.py 1 10" ; written to disk2 only
+			 "fusermount -u mnt"
+			 (format "./fsck-check.py --stale --disks %s"
+				 (string-join (gen-disks 2) " "))
+			 (mount-cmd 2 "mnt")
+			 ;; disk1 is resynced from disk2
+			 "timeout 10 sh -c 'until grep -q \"^Resync:.*, done\" mnt/.wfs/stats; do sleep 0.1; done'")
+		   "; ")
+		 ,'(("file1" . 1000)) 0 "1" 2 "Correct\nCorrect\nCorrect\nCorrect" 0)
+		("raid1 -- deferred reclaim: freed blocks reused right away and punched by unmount" ,'()
+		 ,(string-join
+		   (list "./reclaim-check.py"
+			 "fusermount -u mnt"
+			 (format "./reclaim-check.py --disks %s"
+				 (string-join (gen-disks 2) " "))
+			 (mount-cmd 2 "mnt"))
+		   "; ")
+		 ,'(("file1" . 36352) ("file2" . 36352)) 0 "1" 2 "Correct\nCorrect\nCorrect\nCorrect" 0)
+		("raid1 -- scrubber: a damaged mirror block repaired in the background" ,'()
+		 ,(string-join
+		   (list "./read-write.py 1 10"
+			 "fusermount -u mnt"
+			 (format "./scrub-check.py --corrupt %s" (disk-path "test-disk2"))
+			 (format "../solution/wfs %s -o scrub_interval=0,scrub_rate=100000 -s mnt"
+				 (string-join (gen-disks 3) " "))
+			 ;; nothing reads file1, so only the scrubber can repair it
+			 "timeout 10 sh -c 'until grep -Eq \"^Scrub: pass ([2-9]|[0-9]{2,}),\" mnt/.wfs/stats; do sleep 0.1; done'"
+			 "fusermount -u mnt"
+			 (format "./scrub-check.py --disks %s"
+				 (string-join (gen-disks 3) " "))
+			 (mount-cmd 3 "mnt"))
+		   "; ")
+		 ,'(("file1" . 1000)) 0 "1" 3 "Correct\nCorrect\nCorrect\nCorrect" 0))))))
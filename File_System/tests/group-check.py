@@ -0,0 +1,89 @@
+#!/usr/bin/python3
+
+# check an unmounted filesystem mounted with -o group_blocks: every directory under
+# the root is in a group of its own, and its own data and its files' inodes and data
+# lie in that group's slices of the inode table and data region
+
+import argparse
+import sys
+from stat import *
+import wfsverify
+
+entry_size = 32     # name[28] and the inode number
+inode_blocks = 56   # offset of blocks[] in an inode
+n_blocks = 8
+ind_block = 7
+
+def read(fs, offset, size):
+    with open(fs.diskname(), "rb") as diskf:
+        diskf.seek(offset)
+        return diskf.read(size)
+
+def offsets(raw):
+    return [int.from_bytes(raw[i:i + 8], sys.byteorder) for i in range(0, len(raw), 8)]
+
+def data_blocks(fs, inodep):
+    """The data block numbers an inode uses, its indirect block included."""
+    pos = fs.get_iblock_region() + inodep * fs.blksize + inode_blocks
+    slots = offsets(read(fs, pos, n_blocks * 8))
+    addrs = [a for a in slots if a]
+    if slots[ind_block]:
+        addrs += [a for a in offsets(read(fs, slots[ind_block], fs.blksize)) if a]
+    return [(a - fs.get_dblock_region()) // fs.blksize for a in addrs]
+
+def entries(fs, inodep):
+    """The (name, inode) pairs of a directory."""
+    pos = fs.get_iblock_region() + inodep * fs.blksize + inode_blocks
+    found = []
+    for addr in offsets(read(fs, pos, (n_blocks - 1) * 8)):
+        if not addr:
+            continue
+        block = read(fs, addr, fs.blksize)
+        for i in range(0, fs.blksize, entry_size):
+            name = block[i:i + 28].split(b'\0')[0]
+            if name:
+                found.append((name.decode(), int.from_bytes(block[i + 28:i + 32], sys.byteorder)))
+    return found
+
+def check(disk, group_blocks):
+    fs = wfsverify.WfsState(disk)
+    # as wfs cuts the inode table: in proportion, in whole bitmap bytes
+    groups = (fs.get_sb_datablocks() + group_blocks - 1) // group_blocks
+    group_inodes = ((fs.get_sb_inodes() + groups - 1) // groups + 7) // 8 * 8
+
+    seen = {}
+    for name, dirp in entries(fs, 0):
+        if not S_ISDIR(fs.read_inode(dirp)['mode']):
+            continue
+        group = dirp // group_inodes
+        if group in seen:
+            print(f"{name} shares group {group} with {seen[group]}")
+            exit(1)
+        seen[group] = name
+
+        for block in data_blocks(fs, dirp):
+            if block // group_blocks != group:
+                print(f"{name}: data block {block} outside group {group}")
+                exit(1)
+        for child, inodep in entries(fs, dirp):
+            if inodep // group_inodes != group:
+                print(f"{name}/{child}: inode {inodep} outside group {group}")
+                exit(1)
+            for block in data_blocks(fs, inodep):
+                if block // group_blocks != group:
+                    print(f"{name}/{child}: data block {block} outside group {group}")
+                    exit(1)
+    if len(seen) < 2:
+        print(f"expected at least two directories, found {len(seen)}")
+        exit(1)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--group-blocks", type=int, help="group_blocks wfs was mounted with")
+    parser.add_argument("--disks", nargs="+", help="list of disks")
+    args = parser.parse_args()
+
+    for disk in args.disks:
+        check(disk, args.group_blocks)
+    print("Correct")
+    exit(0)
@@ -0,0 +1,64 @@
+#!/usr/bin/python3
+
+# check the superblock identity of an unmounted filesystem: every disk carries the
+# magic number and the same uuid, knows its position, and was left clean with no
+# write-intent bits set. A disk of another filesystem must not mount.
+
+import argparse
+import os
+import shutil
+import struct
+import subprocess
+
+# struct wfs_sb from magic on, after the 88 bytes of the fields before it
+IDENTITY = struct.Struct("<II16siiQ")
+IDENTITY_OFFSET = 88
+WFS_MAGIC = 0x31736677
+WFS_CLEAN = 0
+
+def identity(disk):
+    with open(disk, "rb") as diskf:
+        head = diskf.read(IDENTITY_OFFSET + IDENTITY.size)
+    magic, version, uuid, index, state, events = IDENTITY.unpack_from(head, IDENTITY_OFFSET)
+    wi_bitmap_ptr, = struct.unpack_from("<q", head, 56)
+    return {'magic': magic, 'version': version, 'uuid': uuid, 'index': index,
+            'state': state, 'events': events, 'wi': wi_bitmap_ptr}
+
+def fail(msg):
+    print(msg)
+    exit(1)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--disks", nargs="+", help="list of disks, in the order made")
+    args = parser.parse_args()
+
+    sbs = [identity(disk) for disk in args.disks]
+    for i, sb in enumerate(sbs):
+        if sb['magic'] != WFS_MAGIC:
+            fail(f"disk {i}: magic {sb['magic']:#x}")
+        if sb['uuid'] != sbs[0]['uuid'] or sb['events'] != sbs[0]['events']:
+            fail(f"disk {i}: uuid or events differ from disk 0")
+        if sb['index'] != i:
+            fail(f"disk {i}: records index {sb['index']}")
+        if sb['state'] != WFS_CLEAN:
+            fail(f"disk {i}: not marked clean")
+        with open(args.disks[i], "rb") as diskf:
+            diskf.seek(sb['wi'])
+            if any(diskf.read(8)):
+                fail(f"disk {i}: write-intent bits left set")
+
+    # the same filesystem under another uuid
+    foreign = args.disks[0] + ".foreign"
+    shutil.copyfile(args.disks[0], foreign)
+    with open(foreign, "r+b") as diskf:
+        diskf.seek(IDENTITY_OFFSET + 8)
+        diskf.write(os.urandom(16))
+    os.makedirs("mnt", exist_ok=True)
+    run = subprocess.run(["../solution/wfs", foreign, *args.disks[1:], "-s", "mnt"],
+                         capture_output=True, text=True)
+    os.remove(foreign)
+    if run.returncode == 0:
+        subprocess.run(["fusermount", "-u", "mnt"])
+        fail("a disk from another filesystem was mounted")
+    print("Correct")
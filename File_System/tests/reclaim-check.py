@@ -0,0 +1,60 @@
+#!/usr/bin/python3
+
+# fill the filesystem with large files, remove two and write two new ones right
+# away, so they are given blocks the reclaimer has not punched yet, then remove the
+# third just before unmount; or with --disks, once unmounted, check that every free
+# data block was punched or zeroed on every disk
+
+import argparse
+import os
+import wfsverify
+
+size = 71 * 512     # seven direct blocks and a full indirect block
+
+def write(name, data):
+    with open(name, "wb") as fh:
+        fh.write(data)
+
+def check(name, data):
+    with open(name, "rb") as fh:
+        if fh.read() != data:
+            print(f"{name} readback does not match data written")
+            exit(1)
+
+def workload():
+    data = {name: os.urandom(size) for name in ["big1", "big2", "big3", "file1", "file2"]}
+
+    os.chdir("mnt")
+    for name in ["big1", "big2", "big3"]:
+        write(name, data[name])
+    os.unlink("big1")
+    os.unlink("big2")
+    for name in ["file1", "file2"]:
+        write(name, data[name])
+    for name in ["big3", "file1", "file2"]:
+        check(name, data[name])
+    # left to the reclaimer at unmount
+    os.unlink("big3")
+
+def free_blocks_zero(disks):
+    fs = wfsverify.WfsState(disks[0])
+    allocated = set(fs.list_allocated_datablocks())
+    for disk in disks:
+        region = wfsverify.WfsState(disk).read_datablock_region()
+        for block in range(fs.get_sb_datablocks()):
+            data = region[block * fs.blksize:(block + 1) * fs.blksize]
+            if block not in allocated and data.count(0) != fs.blksize:
+                print(f"free data block {block} not reclaimed [{disk}]")
+                exit(1)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--disks", nargs="+", help="check the unmounted disks")
+    args = parser.parse_args()
+
+    if args.disks:
+        free_blocks_zero(args.disks)
+    else:
+        workload()
+    print("Correct")
+    exit(0)
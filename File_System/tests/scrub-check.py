@@ -0,0 +1,42 @@
+#!/usr/bin/python3
+
+# damage one copy of a data block on an unmounted disk with --corrupt; or with
+# --disks, once the scrubber has run and the filesystem is unmounted again, check
+# that every mirror holds the same data blocks
+
+import argparse
+import wfsverify
+
+def corrupt(disk):
+    """Flip the first bytes of the last allocated data block on this mirror only."""
+    fs = wfsverify.WfsState(disk)
+    block = fs.list_allocated_datablocks()[-1]
+    offset = fs.get_dblock_region() + block * fs.blksize
+    with open(disk, "r+b") as diskf:
+        diskf.seek(offset)
+        data = diskf.read(16)
+        diskf.seek(offset)
+        diskf.write(bytes(b ^ 0xff for b in data))
+
+def mirrors_agree(disks):
+    fs = wfsverify.WfsState(disks[0])
+    regions = [wfsverify.WfsState(disk).read_datablock_region() for disk in disks]
+    for block in fs.list_allocated_datablocks():
+        copies = {region[block * fs.blksize:(block + 1) * fs.blksize] for region in regions}
+        if len(copies) != 1:
+            print(f"data block {block} differs between mirrors")
+            exit(1)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--corrupt", help="disk to damage")
+    parser.add_argument("--disks", nargs="+", help="list of disks")
+    args = parser.parse_args()
+
+    if args.corrupt:
+        corrupt(args.corrupt)
+        exit(0)
+
+    mirrors_agree(args.disks)
+    print("Correct")
+    exit(0)
@@ -0,0 +1,33 @@
+#!/usr/bin/python3
+
+# write past the end of an empty file and read it back
+# the skipped range is a hole and must read as zeros
+
+import os
+import sys
+
+name = sys.argv[1]
+offset = int(sys.argv[2])
+segment = 100
+
+data = os.urandom(segment)
+
+os.chdir("mnt")
+
+with open(name, "wb") as fh:
+    fh.seek(offset)
+    fh.write(data)
+
+size = os.stat(name).st_size
+if size != offset + segment:
+    print(f"{name} size is {size}, expected {offset + segment}")
+    exit(1)
+
+with open(name, "rb") as fh:
+    contents = fh.read()
+    if contents[:offset] != bytes(offset) or contents[offset:] != data:
+        print(f"{name} readback does not match data written")
+        exit(1)
+
+print("Correct")
+exit(0)
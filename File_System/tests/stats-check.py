@@ -0,0 +1,50 @@
+#!/usr/bin/python3
+
+# write and read back a file, then check that .wfs/stats counted it, can't be
+# opened for writing and stays out of the root's listing
+
+import os
+import sys
+
+size = int(sys.argv[1])
+data = os.urandom(size)
+
+os.chdir("mnt")
+
+with open("file1", "wb") as fh:
+    fh.write(data)
+with open("file1", "rb") as fh:
+    if fh.read() != data:
+        print("file1 readback does not match data written")
+        exit(1)
+
+if ".wfs" in os.listdir("."):
+    print(".wfs is listed in the root directory")
+    exit(1)
+if os.listdir(".wfs") != ["stats"]:
+    print(".wfs does not hold just stats")
+    exit(1)
+
+try:
+    open(".wfs/stats", "w")
+    print(".wfs/stats opened for writing")
+    exit(1)
+except PermissionError:
+    pass
+
+with open(".wfs/stats") as fh:
+    lines = fh.read().splitlines()
+
+ops = {line.split()[1]: int(line.split()[2]) for line in lines if line.startswith("op ")}
+for op in ["write", "read", "open"]:
+    if ops.get(op, 0) < 1:
+        print(f"no {op} calls counted")
+        exit(1)
+
+read = sum(int(line.split()[2]) for line in lines if line.startswith("disk "))
+if read < size:
+    print(f"{read} bytes read from the disks, expected at least {size}")
+    exit(1)
+
+print("Correct")
+exit(0)
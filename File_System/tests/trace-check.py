@@ -0,0 +1,45 @@
+#!/usr/bin/python3
+
+# decode the operation trace of a mount with wfs-trace: the writes of read-write.py
+# are all there, on the files written, and the Chrome trace has every event
+
+import argparse
+import json
+import os
+import subprocess
+
+DECODER = "../solution/wfs-trace"
+
+def fail(msg):
+    print(msg)
+    exit(1)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--trace", help="trace file written by wfs -o trace=FILE")
+    parser.add_argument("--bytes", type=int, help="bytes written in all")
+    args = parser.parse_args()
+
+    chrome = args.trace + ".json"
+    run = subprocess.run([DECODER, "-c", chrome, args.trace], capture_output=True, text=True)
+    if run.returncode != 0:
+        fail(f"wfs-trace exited {run.returncode}: {run.stderr}")
+    lines = run.stdout.splitlines()
+    events, lost = int(lines[0].split()[0]), int(lines[0].split()[2])
+    ops = {line.split()[0]: line.split() for line in lines[2:]}
+    if lost:
+        fail(f"{lost} events lost")
+    if "write" not in ops or int(ops["write"][8]) != args.bytes:
+        fail(f"expected {args.bytes} bytes written, found\n{run.stdout}")
+
+    with open(chrome) as f:
+        trace = json.load(f)["traceEvents"]
+    os.remove(chrome)
+    if len(trace) != events:
+        fail(f"{len(trace)} Chrome trace events, expected {events}")
+    for e in trace:
+        if e["ph"] != "X" or e["dur"] < 0 or e["name"] not in ops:
+            fail(f"bad event {e}")
+        if e["name"] == "write" and e["args"]["path"] not in ("/file1", "/file2"):
+            fail(f"write to {e['args']['path']}")
+    print("Correct")
@@ -178,13 +178,101 @@ def verify_raid0(disks, expected_dirs, expected_files, expected_blocks, altblock
     # not a big deal though
     print("Correct")
 
+def gf_mul2(region):
+    """Multiply every byte of region by 2 in GF(2^8) with polynomial 0x11d."""
+    return bytes(((b << 1) ^ 0x1d) & 0xff if b & 0x80 else b << 1 for b in region)
+
+def xor(a, b):
+    return bytes(x ^ y for x, y in zip(a, b))
+
+def verify_parity(disks, parity, expected_dirs, expected_files, expected_blocks):
+    """Verify wfs formatted as raid5 (parity 1) or raid6 (parity 2)."""
+    filesystems = [wfsverify.WfsState(disk) for disk in disks]
+
+    # metadata is mirrored as in raid1
+    for fs in filesystems:
+        test_eq(f"allocated inodes on {fs.diskname()}",
+                len(fs.list_allocated_inodes()), (expected_files + expected_dirs))
+        test_eq(f"allocated datablocks on {fs.diskname()}",
+                len(fs.list_allocated_datablocks()), expected_blocks)
+
+    ref_fs = filesystems[0]
+    verify_inodes(ref_fs.list_allocated_inodes(), ref_fs)
+    ref_region = ref_fs.read_inode_region()
+    for fs in filesystems[1:]:
+        if ref_region != fs.read_inode_region():
+            print(f"raid{parity + 4} inode regions must be identical {ref_fs.diskname()} {fs.diskname()}")
+            exit(1)
+
+    # every stripe must agree with its P (and Q) block, see solution/raid.h for the layout
+    n = len(disks)
+    ndata = n - parity
+    stripes = (ref_fs.get_sb_datablocks() + ndata - 1) // ndata
+    regions = []
+    for fs in filesystems:
+        with open(fs.diskname(), "rb") as diskf:
+            diskf.seek(fs.get_dblock_region())
+            regions.append(diskf.read(stripes * ref_fs.blksize))
+
+    for s in range(stripes):
+        member = lambda d: regions[d][s * ref_fs.blksize:(s + 1) * ref_fs.blksize]
+        p = n - 1 - s % n
+        data = [member((p + parity + i) % n) for i in range(ndata)]
+        pcalc = data[-1]
+        qcalc = data[-1]
+        for block in reversed(data[:-1]):
+            pcalc = xor(pcalc, block)
+            qcalc = xor(gf_mul2(qcalc), block)
+        if pcalc != member(p):
+            print(f"stripe {s}: P does not match the data")
+            exit(1)
+        if parity == 2 and qcalc != member((p + 1) % n):
+            print(f"stripe {s}: Q does not match the data")
+            exit(1)
+
+    print("Correct")
+
+def verify_raid10(disks, expected_dirs, expected_files, expected_blocks):
+    """Verify wfs formatted as raid10: metadata on every disk, data striped over pairs."""
+    filesystems = [wfsverify.WfsState(disk) for disk in disks]
+
+    for fs in filesystems:
+        test_eq(f"allocated inodes on {fs.diskname()}",
+                len(fs.list_allocated_inodes()), (expected_files + expected_dirs))
+        test_eq(f"allocated datablocks on {fs.diskname()}",
+                len(fs.list_allocated_datablocks()), expected_blocks)
+
+    ref_fs = filesystems[0]
+    verify_inodes(ref_fs.list_allocated_inodes(), ref_fs)
+    ref_region = ref_fs.read_inode_region()
+    for fs in filesystems[1:]:
+        if ref_region != fs.read_inode_region():
+            print(f"raid10 inode regions must be identical {ref_fs.diskname()} {fs.diskname()}")
+            exit(1)
+
+    # disks 2p and 2p + 1 mirror each other's share of the data region
+    pairs = len(disks) // 2
+    rows = (ref_fs.get_sb_datablocks() + pairs - 1) // pairs
+    regions = []
+    for fs in filesystems:
+        with open(fs.diskname(), "rb") as diskf:
+            diskf.seek(fs.get_dblock_region())
+            regions.append(diskf.read(rows * ref_fs.blksize))
+
+    for p in range(pairs):
+        if regions[2 * p] != regions[2 * p + 1]:
+            print(f"raid10 datablock regions must be identical {disks[2 * p]} {disks[2 * p + 1]}")
+            exit(1)
+
+    print("Correct")
+
 def unimplemented(mode):
     print(f'{mode} verification not implemented')
     exit()
     
 if __name__ == '__main__':
     parser = argparse.ArgumentParser()
-    parser.add_argument("--mode", help="verify mode: mkfs, raid0, raid1, raid1v")
+    parser.add_argument("--mode", help="verify mode: mkfs, raid0, raid1, raid1v, raid5, raid6, raid10")
     parser.add_argument("--inodes", help="expected number of inodes")
     parser.add_argument("--blocks", help="expected number of data blocks")
     parser.add_argument("--altblocks", help="some tests have an alternate number of acceptable data blocks")
@@ -202,5 +290,9 @@ if __name__ == '__main__':
         verify_raid0(args.disks, int(args.dirs), int(args.files), int(args.blocks), int(args.altblocks))
     elif args.mode == 'raid1v':
         verify_raid1v(args.disks, int(args.dirs), int(args.files), int(args.blocks))
+    elif args.mode in ('raid5', 'raid6'):
+        verify_parity(args.disks, 1 if args.mode == 'raid5' else 2, int(args.dirs), int(args.files), int(args.blocks))
+    elif args.mode == 'raid10':
+        verify_raid10(args.disks, int(args.dirs), int(args.files), int(args.blocks))
     else:
         unimplemented(args.mode)
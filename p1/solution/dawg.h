@@ -0,0 +1,36 @@
+#include <stdint.h>
+
+/*
+ * Compiled dictionary format, written by dict-compile and read by
+ * letter-boxed in place with mmap.
+ *
+ * The words are stored as a DAWG: a trie whose identical subtrees are
+ * shared, so common endings ("-ing", "-ness") are stored once. The file is
+ * a DawgHeader, then node_count DawgNodes, then edge_count edges. Each
+ * node's edges are contiguous and sorted by letter. An edge is a uint32_t
+ * holding the letter in its low 8 bits and the index of the node it leads
+ * to above them. A word is in the dictionary if following its letters from
+ * the root ends at a terminal node.
+ *
+ * Numbers are in host byte order.
+ */
+
+#define DAWG_MAGIC "LBDAWG\0\1"	// the NUL keeps it from being a word list
+#define DAWG_LETTER(edge) ((unsigned char)((edge) & 0xff))
+#define DAWG_TARGET(edge) ((edge) >> 8)
+#define DAWG_EDGE(letter, target) ((uint32_t)(target) << 8 | (unsigned char)(letter))
+#define DAWG_MAX_NODES (1u << 24)
+
+typedef struct{
+	char magic[8];
+	uint32_t node_count;
+	uint32_t edge_count;
+	uint32_t word_count;
+	uint32_t root;
+} DawgHeader;
+
+typedef struct{
+	uint32_t first_edge;
+	uint16_t edge_count;
+	uint16_t terminal;	// a word ends here
+} DawgNode;
@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dawg.h"
+
+/*
+ * dict-compile turns a word list, one word per line, into the compiled
+ * dictionary format of dawg.h, which letter-boxed takes in place of the
+ * word list.
+ *
+ * The words go into a trie first, in any order. The trie is then minimized
+ * bottom up: a node whose terminal flag and edges match a node already
+ * written is replaced by it, so every distinct subtree is written once.
+ */
+
+typedef struct{
+	unsigned char letter;	// on the edge from its parent
+	int terminal;
+	int child;	// first child, -1 if none
+	int sibling;	// next child of the parent, in letter order, -1 if none
+} TrieNode;
+
+typedef struct{
+	TrieNode *nodes;
+	int size;
+	int capacity;
+} Trie;
+
+typedef struct{
+	DawgNode *nodes;
+	uint32_t node_count;
+	uint32_t *edges;
+	uint32_t edge_count;
+	uint32_t *table;	// hash set of written nodes: index + 1, 0 in empty slots
+	uint32_t capacity;	// slots in table, a power of two
+} Dawg;
+
+/*
+ * Add a node for letter to the trie, returns its index or -1
+ */
+int new_node(Trie *trie, unsigned char letter){
+	if (trie->size == trie->capacity){
+		trie->capacity = trie->capacity ? 2 * trie->capacity : 4096;
+		TrieNode *nodes = realloc(trie->nodes, trie->capacity * sizeof(TrieNode));
+		if (nodes == NULL){
+			printf("Memory reallocation failed for trie nodes\n");
+			return -1;
+		}
+		trie->nodes = nodes;
+	}
+	TrieNode *node = &trie->nodes[trie->size];
+	node->letter = letter;
+	node->terminal = 0;
+	node->child = -1;
+	node->sibling = -1;
+	return trie->size++;
+}
+
+/*
+ * Add word to the trie, returns 0 on success
+ */
+int insert_word(Trie *trie, const char *word){
+	int node = 0;
+	for (const char *pt = word; *pt != '\0'; pt++){
+		unsigned char letter = *pt;
+		// Find the child for letter, or where it goes to keep children sorted
+		int prev = -1;
+		int next = trie->nodes[node].child;
+		while (next >= 0 && trie->nodes[next].letter < letter){
+			prev = next;
+			next = trie->nodes[next].sibling;
+		}
+		if (next < 0 || trie->nodes[next].letter != letter){
+			int child = new_node(trie, letter);
+			if (child < 0){
+				return 1;
+			}
+			trie->nodes[child].sibling = next;
+			if (prev < 0){
+				trie->nodes[node].child = child;
+			} else {
+				trie->nodes[prev].sibling = child;
+			}
+			next = child;
+		}
+		node = next;
+	}
+	trie->nodes[node].terminal = 1;
+	return 0;
+}
+
+/*
+ * FNV-1a hash of a node's terminal flag and edges
+ */
+uint32_t hash_node(int terminal, const uint32_t *edges, int count){
+	uint32_t hash = 2166136261u ^ (uint32_t)terminal;
+	for (int i = 0; i < count; i++){
+		for (int shift = 0; shift < 32; shift += 8){
+			hash = (hash ^ ((edges[i] >> shift) & 0xff)) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+/*
+ * Write the trie node's subtree to the DAWG, sharing any node already
+ * written, and return the DAWG node it became. Returns DAWG_MAX_NODES if
+ * the DAWG has too many nodes.
+ */
+uint32_t minimize(Trie *trie, Dawg *dawg, int node){
+	uint32_t edges[256];
+	int count = 0;
+	for (int child = trie->nodes[node].child; child >= 0; child = trie->nodes[child].sibling){
+		uint32_t target = minimize(trie, dawg, child);
+		if (target == DAWG_MAX_NODES){
+			return DAWG_MAX_NODES;
+		}
+		edges[count++] = DAWG_EDGE(trie->nodes[child].letter, target);
+	}
+
+	int terminal = trie->nodes[node].terminal;
+	uint32_t mask = dawg->capacity - 1;
+	uint32_t slot = hash_node(terminal, edges, count) & mask;
+	while (dawg->table[slot] != 0){
+		DawgNode *same = &dawg->nodes[dawg->table[slot] - 1];
+		if (same->terminal == terminal && same->edge_count == count
+			&& memcmp(dawg->edges + same->first_edge, edges, count * sizeof(uint32_t)) == 0){
+			return dawg->table[slot] - 1;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	if (dawg->node_count == DAWG_MAX_NODES - 1){
+		printf("Too many nodes for the compiled dictionary\n");
+		return DAWG_MAX_NODES;
+	}
+	DawgNode *written = &dawg->nodes[dawg->node_count];
+	written->first_edge = dawg->edge_count;
+	written->edge_count = count;
+	written->terminal = terminal;
+	memcpy(dawg->edges + dawg->edge_count, edges, count * sizeof(uint32_t));
+	dawg->edge_count += count;
+	dawg->table[slot] = ++dawg->node_count;
+	return dawg->node_count - 1;
+}
+
+int main(int argc, char *argv[]){
+	if (argc != 3){
+		printf("Usage: %s <word_file> <dawg_file>\n", argv[0]);
+		exit(1);
+	}
+
+	FILE *fp_words = fopen(argv[1], "r");
+	if (fp_words == NULL){
+		printf("Unable to open word file\n");
+		exit(1);
+	}
+
+	Trie trie = {NULL, 0, 0};
+	if (new_node(&trie, '\0') < 0){
+		exit(1);
+	}
+	uint32_t word_count = 0;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	while ((read = getline(&line, &len, fp_words)) != -1){
+		if (read > 0 && line[read - 1] == '\n'){
+			line[read - 1] = '\0';
+		}
+		if (insert_word(&trie, line) != 0){
+			exit(1);
+		}
+		word_count++;
+	}
+	free(line);
+	fclose(fp_words);
+
+	// The DAWG has at most as many nodes and edges as the trie
+	Dawg dawg = {0};
+	dawg.capacity = 16;
+	while (dawg.capacity < 2 * (uint32_t)trie.size){
+		dawg.capacity *= 2;
+	}
+	dawg.nodes = malloc(trie.size * sizeof(DawgNode));
+	dawg.edges = malloc(trie.size * sizeof(uint32_t));
+	dawg.table = calloc(dawg.capacity, sizeof(uint32_t));
+	if (dawg.nodes == NULL || dawg.edges == NULL || dawg.table == NULL){
+		printf("Memory allocation failed for the compiled dictionary\n");
+		exit(1);
+	}
+	uint32_t root = minimize(&trie, &dawg, 0);
+	if (root == DAWG_MAX_NODES){
+		exit(1);
+	}
+
+	DawgHeader header = {
+		.node_count = dawg.node_count,
+		.edge_count = dawg.edge_count,
+		.word_count = word_count,
+		.root = root,
+	};
+	memcpy(header.magic, DAWG_MAGIC, sizeof(header.magic));
+
+	FILE *fp_dawg = fopen(argv[2], "w");
+	if (fp_dawg == NULL){
+		printf("Unable to open dawg file\n");
+		exit(1);
+	}
+	if (fwrite(&header, sizeof(header), 1, fp_dawg) != 1
+		|| fwrite(dawg.nodes, sizeof(DawgNode), dawg.node_count, fp_dawg) != dawg.node_count
+		|| fwrite(dawg.edges, sizeof(uint32_t), dawg.edge_count, fp_dawg) != dawg.edge_count
+		|| fclose(fp_dawg) != 0){
+		printf("Error while writing the dawg file.\n");
+		exit(1);
+	}
+	printf("%u words, %d trie nodes, %u dawg nodes, %u edges\n",
+		word_count, trie.size, dawg.node_count, dawg.edge_count);
+
+	free(trie.nodes);
+	free(dawg.nodes);
+	free(dawg.edges);
+	free(dawg.table);
+	return 0;
+}
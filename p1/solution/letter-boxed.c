@@ -2,10 +2,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dawg.h"
 
+// A dictionary word, in place in the mapped file
 typedef struct{
-	char **words;
+	unsigned int offset;
+	unsigned int length;
+} Word;
+
+typedef struct{
+	const char *data;	// the dictionary file, mapped read-only
+	size_t data_size;
+	const DawgHeader *dawg;	// set if the file is a compiled dictionary (see dawg.h)
+	const DawgNode *nodes;
+	const uint32_t *edges;
+	Word *words;
 	int size;
+	int *table;	// open-addressing hash set of the words: index + 1, 0 in empty slots
+	int capacity;	// slots in table, a power of two
 } Dictionary;
 
 /* Returns 0 if and only if the board is in a valid board state.
@@ -67,61 +83,190 @@ void remove_newline(char *line) {
     }
 }
 
+/*
+ * FNV-1a hash of the length bytes at word
+ */
+unsigned int hash_word(const char *word, size_t length){
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < length; i++){
+		hash = (hash ^ (unsigned char)word[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Build the hash set of the dictionary's words, kept at most half full
+ * so probe sequences stay short. Slots are probed linearly.
+ * Returns 0 on success, 1 if memory allocation failed.
+ */
+int build_word_table(Dictionary *dict){
+	dict->capacity = 16;
+	while (dict->capacity < 2 * dict->size){
+		dict->capacity *= 2;
+	}
+	dict->table = calloc(dict->capacity, sizeof(int));
+	if (dict->table == NULL){
+		printf("Memory allocation failed for dictionary table\n");
+		return 1;
+	}
+
+	unsigned int mask = dict->capacity - 1;
+	for (int i = 0; i < dict->size; i++){
+		const char *word = dict->data + dict->words[i].offset;
+		unsigned int slot = hash_word(word, dict->words[i].length) & mask;
+		while (dict->table[slot] != 0){
+			slot = (slot + 1) & mask;
+		}
+		dict->table[slot] = i + 1;
+	}
+	return 0;
+}
+
+/*
+ * Free the dictionary and unmap its file
+ */
+void free_dictionary(Dictionary *dict){
+	if (dict->data != NULL){
+		munmap((void *)dict->data, dict->data_size);
+	}
+	free(dict->words);
+	free(dict->table);
+	free(dict);
+}
+
+/*
+ * Use the mapped file as a compiled dictionary, after checking that every
+ * node and edge it holds stays inside it.
+ * Returns 0 on success, 1 if the file is damaged.
+ */
+int load_dawg(Dictionary *dict){
+	const DawgHeader *header = (const DawgHeader *)dict->data;
+	size_t size = sizeof(DawgHeader) + (size_t)header->node_count * sizeof(DawgNode)
+		+ (size_t)header->edge_count * sizeof(uint32_t);
+	if (size != dict->data_size || header->root >= header->node_count){
+		printf("Compiled dictionary is damaged\n");
+		return 1;
+	}
+	dict->dawg = header;
+	dict->nodes = (const DawgNode *)(header + 1);
+	dict->edges = (const uint32_t *)(dict->nodes + header->node_count);
+	for (uint32_t i = 0; i < header->node_count; i++){
+		if ((size_t)dict->nodes[i].first_edge + dict->nodes[i].edge_count > header->edge_count){
+			printf("Compiled dictionary is damaged\n");
+			return 1;
+		}
+	}
+	for (uint32_t i = 0; i < header->edge_count; i++){
+		if (DAWG_TARGET(dict->edges[i]) >= header->node_count){
+			printf("Compiled dictionary is damaged\n");
+			return 1;
+		}
+	}
+	dict->size = header->word_count;
+	return 0;
+}
+
 /* 
- * Read dictionary into a dynamically sized array of strings
+ * Map the dictionary file. A compiled dictionary is used as it is; a word
+ * list is indexed in one pass: each line is a word, used in place. The
+ * index grows by doubling.
  */
 Dictionary *read_dictionary(FILE *fp_dict){
-	Dictionary *dict = malloc(sizeof(Dictionary));
+	Dictionary *dict = calloc(1, sizeof(Dictionary));
 	if (dict == NULL){
 		printf("Memory allocation failed for dictionary\n");
 		return NULL;
 	}
 
-	dict->words = NULL;
-	dict->size =0;
-	
-	char *line = NULL;
-	size_t len = 0;
-	while(getline(&line, &len, fp_dict) != -1){
-			remove_newline(line);
-			//dynamically resize the array dict->words to accommodate an additional
-			//word every time a new word is read from the dictionary file.	
-			dict->words = realloc(dict->words, (dict->size + 1) * sizeof(char*));
-			if (dict->words == NULL){
+	struct stat st;
+	if (fstat(fileno(fp_dict), &st) != 0){
+		printf("Unable to read dictionary file\n");
+		free(dict);
+		return NULL;
+	}
+	dict->data_size = st.st_size;
+	if (dict->data_size > 0){
+		void *data = mmap(NULL, dict->data_size, PROT_READ, MAP_PRIVATE, fileno(fp_dict), 0);
+		if (data == MAP_FAILED){
+			printf("Unable to map dictionary file\n");
+			free(dict);
+			return NULL;
+		}
+		dict->data = data;
+	}
+
+	if (dict->data_size >= sizeof(DawgHeader) && memcmp(dict->data, DAWG_MAGIC, 8) == 0){
+		if (load_dawg(dict) != 0){
+			free_dictionary(dict);
+			return NULL;
+		}
+		return dict;
+	}
+	madvise((void *)dict->data, dict->data_size, MADV_SEQUENTIAL);
+
+	int capacity = 0;
+	const char *pt = dict->data;
+	const char *end = dict->data + dict->data_size;
+	while (pt < end){
+		const char *newline = memchr(pt, '\n', end - pt);
+		if (newline == NULL){
+			newline = end; // last line without a newline
+		}
+		if (dict->size == capacity){
+			capacity = capacity ? 2 * capacity : 4096;
+			Word *words = realloc(dict->words, capacity * sizeof(Word));
+			if (words == NULL){
 				printf("Memory reallocation failed for dictionary words\n");
-				free(line);
-				for (int i = 0; i < dict->size; i++) {
-					free(dict->words[i]);
-				}
-				free(dict);
-				return NULL;
-			} 
-			
-			//dynamically allocate the rest word in the dictionary
-			dict->words[dict->size] = malloc(strlen(line) + 1);
-			if (dict->words[dict->size] == NULL){
-				printf("Memory reallocation failed for the rest of the words in dictionarys\n");
-				free(line);
-				for (int i = 0; i < dict->size; i++) {
-					free(dict->words[i]);
-				}
-				free(dict->words);
-				free(dict);
+				free_dictionary(dict);
 				return NULL;
 			}
-			strcpy(dict->words[dict->size], line);
-			dict->size++;
+			dict->words = words;
+		}
+		dict->words[dict->size].offset = pt - dict->data;
+		dict->words[dict->size].length = newline - pt;
+		dict->size++;
+		pt = newline + 1;
+	}
+
+	if (build_word_table(dict) != 0){
+		free_dictionary(dict);
+		return NULL;
 	}
-	free(line);
 	return dict;
 }
 
+/*
+ * check if the word is in a compiled dictionary, by following its letters
+ * from the root
+ */
+int is_word_in_dawg(Dictionary *dict, const char *word){
+	const DawgNode *node = &dict->nodes[dict->dawg->root];
+	for (const char *pt = word; *pt != '\0'; pt++){
+		const uint32_t *edge = dict->edges + node->first_edge;
+		const uint32_t *end = edge + node->edge_count;
+		while (edge < end && DAWG_LETTER(*edge) < (unsigned char)*pt){
+			edge++;
+		}
+		if (edge == end || DAWG_LETTER(*edge) != (unsigned char)*pt){
+			return 0;
+		}
+		node = &dict->nodes[DAWG_TARGET(*edge)];
+	}
+	return node->terminal;
+}
+
 /*
  * check if the word is in the dictionary
  */
 int is_word_in_dictionary(Dictionary *dict, char *word){
-	for(int i = 0; i < dict->size; i++){
-		if(strcmp(dict->words[i], word) == 0){
+	if (dict->dawg != NULL){
+		return is_word_in_dawg(dict, word);
+	}
+	size_t length = strlen(word);
+	unsigned int mask = dict->capacity - 1;
+	for (unsigned int slot = hash_word(word, length) & mask; dict->table[slot] != 0; slot = (slot + 1) & mask){
+		Word *entry = &dict->words[dict->table[slot] - 1];
+		if(entry->length == length && memcmp(dict->data + entry->offset, word, length) == 0){
 			return 1;
 		}
 	}
@@ -384,12 +529,8 @@ int main(int argc, char *argv[]){
 	}
 	free(board);
 	
-	for (int i = 0; i < dict->size; i++) {
-        free(dict->words[i]);
-    }
 	free(line);
-    free(dict->words);
-    free(dict);
+    free_dictionary(dict);
 	
 	return result; 		
 }